@@ -0,0 +1,92 @@
+#include "allocator.h"
+#include <cstdlib>
+#include <cstring>
+
+// Blocks sitting in a free list are poisoned so the sanitizer still catches the gc freeing something that's in use.
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define POISON(pointer, size) ASAN_POISON_MEMORY_REGION(pointer, size)
+#define UNPOISON(pointer, size) ASAN_UNPOISON_MEMORY_REGION(pointer, size)
+#else
+#define POISON(pointer, size)
+#define UNPOISON(pointer, size)
+#endif
+
+SizeClassAllocator::SizeClassAllocator() {
+    for (int i=0;i<POOL_CLASS_COUNT;i++){
+        freeLists[i] = nullptr;
+    }
+    bumpNext = nullptr;
+    bumpEnd = nullptr;
+}
+
+SizeClassAllocator::~SizeClassAllocator() {
+    for (void* slab : slabs) {
+        UNPOISON(slab, POOL_SLAB_SIZE);
+        ::free(slab);
+    }
+}
+
+void* SizeClassAllocator::reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    if (pointer == nullptr || oldSize == 0) {
+        return newSize == 0 ? nullptr : allocate(newSize);
+    }
+    if (newSize == 0) {
+        release(pointer, oldSize);
+        return nullptr;
+    }
+
+    bool oldIsSmall = oldSize <= POOL_MAX_SIZE;
+    bool newIsSmall = newSize <= POOL_MAX_SIZE;
+    if (!oldIsSmall && !newIsSmall) return realloc(pointer, newSize);
+    if (oldIsSmall && newIsSmall && sizeClass(oldSize) == sizeClass(newSize)) return pointer;
+
+    void* result = allocate(newSize);
+    if (result == nullptr) return nullptr;
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    release(pointer, oldSize);
+    return result;
+}
+
+void* SizeClassAllocator::allocate(size_t size) {
+    if (size > POOL_MAX_SIZE) return malloc(size);
+
+    int index = sizeClass(size);
+    size_t blockSize = (index + 1) * POOL_GRANULARITY;
+    FreeBlock* block = freeLists[index];
+    if (block == nullptr) return allocateFromSlab(blockSize);
+
+    UNPOISON(block, blockSize);
+    freeLists[index] = block->next;
+    return block;
+}
+
+void SizeClassAllocator::release(void* pointer, size_t size) {
+    if (size > POOL_MAX_SIZE) {
+        ::free(pointer);
+        return;
+    }
+
+    int index = sizeClass(size);
+    auto block = (FreeBlock*) pointer;
+    block->next = freeLists[index];
+    freeLists[index] = block;
+    POISON(block, (index + 1) * POOL_GRANULARITY);
+}
+
+// Whatever is left at the end of the old slab when it runs out is just wasted. At most POOL_MAX_SIZE per slab.
+void* SizeClassAllocator::allocateFromSlab(size_t blockSize) {
+    if ((size_t) (bumpEnd - bumpNext) < blockSize) {
+        char* slab = (char*) malloc(POOL_SLAB_SIZE);
+        if (slab == nullptr) return nullptr;
+        POISON(slab, POOL_SLAB_SIZE);
+        slabs.push_back(slab);
+        bumpNext = slab;
+        bumpEnd = slab + POOL_SLAB_SIZE;
+    }
+
+    void* block = bumpNext;
+    bumpNext += blockSize;
+    UNPOISON(block, blockSize);
+    return block;
+}
@@ -0,0 +1,44 @@
+#ifndef clox_allocator_h
+#define clox_allocator_h
+
+#include "common.h"
+#include <vector>
+
+// Object headers, short strings and small tables are a handful of fixed sizes that get allocated and freed constantly.
+// Instead of going to malloc for each one, they're carved out of big slabs and recycled through a free list per size.
+// Anything bigger than POOL_MAX_SIZE goes straight to malloc.
+#define POOL_GRANULARITY 8
+#define POOL_MAX_SIZE 256
+#define POOL_SLAB_SIZE (64 * 1024)
+#define POOL_CLASS_COUNT (POOL_MAX_SIZE / POOL_GRANULARITY)
+
+class SizeClassAllocator {
+public:
+    SizeClassAllocator();
+    ~SizeClassAllocator();
+
+    // Same contract as realloc except the caller must pass the size it asked for last time.
+    // Returns nullptr if a new block was needed and couldn't be allocated.
+    void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+
+private:
+    typedef struct FreeBlock {
+        FreeBlock* next;
+    } FreeBlock;
+
+    FreeBlock* freeLists[POOL_CLASS_COUNT];
+    // The unused end of the newest slab. Shared by every size class.
+    char* bumpNext;
+    char* bumpEnd;
+    std::vector<void*> slabs;
+
+    static inline int sizeClass(size_t size) {
+        return (int) ((size - 1) / POOL_GRANULARITY);
+    }
+
+    void* allocate(size_t size);
+    void release(void* pointer, size_t size);
+    void* allocateFromSlab(size_t blockSize);
+};
+
+#endif
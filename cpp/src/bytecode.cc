@@ -0,0 +1,404 @@
+#include "bytecode.h"
+#include "chunk.h"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Value tags match the ones OP_LOAD_INLINE_CONSTANT uses.
+#define TAG_NUMBER 0
+#define TAG_STRING (1 + OBJ_STRING)
+#define TAG_FUNCTION (1 + OBJ_FUNCTION)
+#define TAG_NATIVE (1 + OBJ_NATIVE)
+#define NO_NAME UINT32_MAX
+
+// Everything is written in the host's byte order. A cache is only meant to be read by the machine that wrote it.
+void appendAsBytes(ArrayList<byte>* data, uint32_t number, Memory& gc) {
+    data->grow(sizeof(number), gc);
+    memcpy(data->data + data->count, &number, sizeof(number));
+    data->count += sizeof(number);
+}
+
+void appendAsBytes(ArrayList<byte>* data, double number, Memory& gc) {
+    data->grow(sizeof(number), gc);
+    memcpy(data->data + data->count, &number, sizeof(number));
+    data->count += sizeof(number);
+}
+
+static void appendString(ArrayList<byte>* data, ObjString* string, Memory& gc) {
+    if (string == nullptr) {
+        appendAsBytes(data, (uint32_t) NO_NAME, gc);
+        return;
+    }
+    uint32_t length = string->array.length;  // includes the null terminator
+    appendAsBytes(data, length, gc);
+    data->grow(length, gc);
+    memcpy(data->data + data->count, string->array.contents, length);
+    data->count += length;
+}
+
+// FNV-1a like hashString but 64 bits since a collision here means running the wrong program.
+uint64_t BytecodeFile::hashSource(const char* src, size_t length) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t) src[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+void BytecodeFile::writeFunction(ArrayList<byte>* out, ObjFunction* function, Memory& gc) {
+    Chunk* chunk = function->chunk;
+    appendString(out, function->name, gc);
+    out->push(function->arity, gc);
+    appendAsBytes(out, (uint32_t) function->upvalueCount, gc);
+    appendAsBytes(out, (uint32_t) function->maxLocals, gc);
+
+    appendAsBytes(out, chunk->code->count, gc);
+    out->grow(chunk->code->count, gc);
+    memcpy(out->data + out->count, chunk->code->data, chunk->code->count);
+    out->count += chunk->code->count;
+
+    // The packed line table from Chunk::setDone. Its checkpoints are found again when loading.
+    appendAsBytes(out, chunk->lineTable->count, gc);
+    out->grow(chunk->lineTable->count, gc);
+    memcpy(out->data + out->count, chunk->lineTable->data, chunk->lineTable->count);
+    out->count += chunk->lineTable->count;
+
+    appendAsBytes(out, chunk->inlineCaches->count, gc);
+
+    appendAsBytes(out, chunk->constants->count, gc);
+    for (uint32_t i=0;i<chunk->constants->count;i++){
+        Value value = (*chunk->constants)[i];
+        if (IS_NUMBER(value)) {
+            out->push(TAG_NUMBER, gc);
+            appendAsBytes(out, AS_NUMBER(value), gc);
+        } else if (IS_STRING(value)) {
+            out->push(TAG_STRING, gc);
+            appendString(out, AS_STRING(value), gc);
+        } else if (IS_FUNCTION(value)) {
+            out->push(TAG_FUNCTION, gc);
+            writeFunction(out, AS_FUNCTION(value), gc);
+        } else if (isObjType(value, OBJ_NATIVE)) {
+            // Natives are looked up by name again when loading.
+            out->push(TAG_NATIVE, gc);
+            appendString(out, ((ObjNative*) AS_OBJ(value))->name, gc);
+        } else {
+            cerr << "ICE: can't serialize constant ";
+            printValue(value, &cerr);
+            cerr << endl;
+        }
+    }
+}
+
+bool BytecodeFile::write(ObjFunction* script, const char* path, uint64_t sourceHash, Memory& gc) {
+    ArrayList<byte> out;
+    out.grow(strlen(LOXC_MAGIC), gc);
+    memcpy(out.data, LOXC_MAGIC, strlen(LOXC_MAGIC));
+    out.count += strlen(LOXC_MAGIC);
+    appendAsBytes(&out, (uint32_t) LOXC_VERSION, gc);
+    appendAsBytes(&out, (uint32_t) sourceHash, gc);
+    appendAsBytes(&out, (uint32_t) (sourceHash >> 32), gc);
+    uint32_t checksumAt = out.count;
+    appendAsBytes(&out, (uint32_t) 0, gc);
+    appendAsBytes(&out, (uint32_t) 0, gc);
+    uint32_t payloadAt = out.count;
+    writeFunction(&out, script, gc);
+
+    uint64_t checksum = hashSource((const char*) out.data + payloadAt, out.count - payloadAt);
+    uint32_t halves[2] = {(uint32_t) checksum, (uint32_t) (checksum >> 32)};
+    memcpy(out.data + checksumAt, halves, sizeof(halves));
+
+    FILE* file = fopen(path, "wb");
+    bool ok = file != nullptr && fwrite(out.data, 1, out.count, file) == out.count;
+    if (file != nullptr && fclose(file) != 0) ok = false;
+    out.release(gc);
+    if (!ok) fprintf(stderr, "Could not write bytecode to \"%s\".\n", path);
+    return ok;
+}
+
+// Bounds checked cursor over the mapped file. Any read past the end sets <failed> and returns zeros.
+struct BytecodeReader {
+    const byte* next;
+    const byte* end;
+    bool failed;
+
+    const byte* take(size_t length) {
+        if (failed || (size_t) (end - next) < length) {
+            failed = true;
+            return nullptr;
+        }
+        const byte* start = next;
+        next += length;
+        return start;
+    }
+
+    uint8_t readByte() {
+        const byte* bytes = take(1);
+        return bytes == nullptr ? 0 : *bytes;
+    }
+
+    uint32_t readInt() {
+        uint32_t number = 0;
+        const byte* bytes = take(sizeof(number));
+        if (bytes != nullptr) memcpy(&number, bytes, sizeof(number));
+        return number;
+    }
+
+    double readDouble() {
+        double number = 0;
+        const byte* bytes = take(sizeof(number));
+        if (bytes != nullptr) memcpy(&number, bytes, sizeof(number));
+        return number;
+    }
+
+    ObjString* readString(Memory& gc) {
+        uint32_t length = readInt();
+        if (length == NO_NAME || length == 0) return nullptr;
+        const byte* chars = take(length);
+        if (chars == nullptr) return nullptr;
+        return gc.copyString((const char*) chars, (int) length - 1);
+    }
+};
+
+ObjFunction* BytecodeFile::readFunction(BytecodeReader* in, Memory& gc) {
+    ObjFunction* function = gc.newFunction();
+    Chunk* chunk = function->chunk;
+    function->name = in->readString(gc);
+    function->arity = in->readByte();
+    function->upvalueCount = (int) in->readInt();
+    function->maxLocals = (int) in->readInt();
+
+    // Neither can be empty. Every function ends with a return and every byte of code has a position.
+    uint32_t codeLength = in->readInt();
+    const byte* code = in->take(codeLength);
+    if (codeLength == 0) in->failed = true;
+    if (in->failed) return function;
+    chunk->code->growExact(codeLength, gc);
+    memcpy(chunk->code->data, code, codeLength);
+    chunk->code->count = codeLength;
+
+    uint32_t lineTableLength = in->readInt();
+    const byte* lineTable = in->take(lineTableLength);
+    if (lineTableLength == 0) in->failed = true;
+    if (in->failed) return function;
+    chunk->lineTable->growExact(lineTableLength, gc);
+    memcpy(chunk->lineTable->data, lineTable, lineTableLength);
+    chunk->lineTable->count = lineTableLength;
+    chunk->indexLineTable(gc);
+
+    uint32_t cacheCount = in->readInt();
+    if (cacheCount > UINT16_MAX) in->failed = true;
+    for (uint32_t i=0;i<cacheCount && !in->failed;i++){
+        chunk->addInlineCache(gc);
+    }
+
+    uint32_t constantCount = in->readInt();
+    for (uint32_t i=0;i<constantCount && !in->failed;i++){
+        switch (in->readByte()) {
+            case TAG_NUMBER:
+                chunk->rawAddConstant(NUMBER_VAL(in->readDouble()), gc);
+                break;
+            case TAG_STRING: {
+                ObjString* string = in->readString(gc);
+                if (string == nullptr) in->failed = true;
+                else chunk->rawAddConstant(OBJ_VAL(string), gc);
+                break;
+            }
+            case TAG_FUNCTION:
+                chunk->rawAddConstant(OBJ_VAL(readFunction(in, gc)), gc);
+                break;
+            case TAG_NATIVE: {
+                ObjString* name = in->readString(gc);
+                Value native;
+                if (name == nullptr || !gc.natives->get(name, &native)) in->failed = true;
+                else chunk->rawAddConstant(native, gc);
+                break;
+            }
+            default:
+                in->failed = true;
+                break;
+        }
+    }
+
+    // Nested functions were checked as they were read so OP_CLOSURE can trust their upvalue counts.
+    if (!in->failed && !validChunk(function)) in->failed = true;
+    return function;
+}
+
+static bool isConstant(Chunk* chunk, uint32_t index) {
+    return index < (uint32_t) chunk->getConstantsSize();
+}
+
+// The VM uses AS_STRING on the names of properties, methods and classes without checking.
+static bool isNameConstant(Chunk* chunk, uint32_t index) {
+    return isConstant(chunk, index) && IS_STRING(chunk->getConstant(index));
+}
+
+// The length of the instruction at <offset>, or -1 if it doesn't fit in the code or an operand points outside
+// the constants, inline caches, locals or upvalues of <function>. Jump targets are checked by validChunk.
+static int checkInstruction(ObjFunction* function, uint32_t offset) {
+    Chunk* chunk = function->chunk;
+    const byte* code = chunk->code->data + offset;
+    uint32_t available = chunk->code->count - offset;
+    uint32_t locals = function->maxLocals;
+    uint32_t upvalues = function->upvalueCount;
+
+    // Chunk::instructionLength reads these operands itself so they have to be checked first.
+    byte op = code[0];
+    bool wide = op == OP_WIDE;
+    if (wide) {
+        if (available < 5) return -1;
+        op = code[1];
+    }
+    uint32_t index = wide ? chunk->readWide(offset + 2) : (available > 1 ? code[1] : 0);  // the operand OP_WIDE widens
+    if (op == OP_CLOSURE && (available < 2 || !isConstant(chunk, index) || !IS_FUNCTION(chunk->getConstant(index)))) return -1;
+    if (op == OP_LOAD_INLINE_CONSTANT) return -1;  // only the repl makes these and they write to the constants
+
+    int length = chunk->instructionLength(offset);
+    if (length <= 0 || (uint32_t) length > available) return -1;
+
+    uint32_t after = wide ? 5 : 2;  // where the operands after that one start
+    uint32_t caches = chunk->getInlineCacheCount();
+    switch (op) {
+        case OP_GET_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+            return isConstant(chunk, index) ? length : -1;
+        case OP_GET_CONSTANT_LONG:
+            return isConstant(chunk, chunk->readWide(offset + 1)) ? length : -1;
+        case OP_CLASS:
+        case OP_SET_PROPERTY:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+        case OP_SUPER_INVOKE:
+            return isNameConstant(chunk, index) ? length : -1;
+        case OP_GET_PROPERTY:
+            return isNameConstant(chunk, index) && (uint32_t) ((code[after] << 8) | code[after + 1]) < caches ? length : -1;
+        case OP_INVOKE:  // the cache index is after the arg count
+            return isNameConstant(chunk, index) && (uint32_t) ((code[after + 1] << 8) | code[after + 2]) < caches ? length : -1;
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            return index < locals ? length : -1;
+        case OP_GET_LOCALS:
+            return index < locals && code[3] < locals ? length : -1;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE:
+            return index < locals && isConstant(chunk, code[3]) ? length : -1;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            return index < upvalues ? length : -1;
+        case OP_CLOSURE: {
+            // Each pair is whether it captures a local (or else one of this function's upvalues) and its index.
+            uint32_t pairLength = wide ? 4 : 2;
+            for (uint32_t pair = after; pair < (uint32_t) length; pair += pairLength) {
+                uint32_t captured = wide ? chunk->readWide(offset + pair + 1) : code[pair + 1];
+                if (code[pair] > 1 || captured >= (code[pair] ? locals : upvalues)) return -1;
+            }
+            return length;
+        }
+        case OP_R_LOAD_CONSTANT:
+            return isConstant(chunk, code[2]) ? length : -1;
+        case OP_R_GET_UPVALUE:
+            return code[2] < upvalues ? length : -1;
+        case OP_R_SET_UPVALUE:
+            return code[1] < upvalues ? length : -1;
+        case OP_R_ADD_K:
+        case OP_R_SUBTRACT_K:
+        case OP_R_MULTIPLY_K:
+        case OP_R_DIVIDE_K:
+        case OP_R_EQUAL_K:
+        case OP_R_NOT_EQUAL_K:
+        case OP_R_LESS_K:
+        case OP_R_GREATER_K:
+        case OP_R_LESS_EQUAL_K:
+        case OP_R_GREATER_EQUAL_K:
+            return isConstant(chunk, code[3]) ? length : -1;
+        default:
+            // No operands or only ones that can't reach outside the frame. Register slots are a byte and every frame gets 256.
+            return length;
+    }
+}
+
+// Walks the code the way the disassembler does. Every jump has to land on the start of an instruction
+// and the last one has to return or jump (the peephole pass drops the return after a loop that never ends)
+// so the VM never runs off the end.
+bool BytecodeFile::validChunk(ObjFunction* function) {
+    Chunk* chunk = function->chunk;
+    uint32_t size = chunk->code->count;
+    if (function->maxLocals <= function->arity || function->maxLocals > LOCALS_MAX) return false;
+    if (function->upvalueCount < 0 || function->upvalueCount > WIDE_OPERAND_MAX + 1) return false;
+
+    vector<bool> starts(size, false);
+    vector<int> targets;
+    byte last = OP_INVALID;
+    for (uint32_t offset = 0; offset < size;) {
+        int length = checkInstruction(function, offset);
+        if (length == -1) return false;
+        starts[offset] = true;
+        int target = chunk->jumpTarget(offset);
+        if (target != -1) targets.push_back(target);
+        last = chunk->code->data[offset];
+        offset += length;
+    }
+    switch (last) {
+        case OP_RETURN:
+        case OP_R_RETURN:
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+            break;
+        default:
+            return false;
+    }
+
+    for (int target : targets) {
+        if (target < 0 || (uint32_t) target >= size || !starts[target]) return false;
+    }
+    return true;
+}
+
+ObjFunction* BytecodeFile::read(const char* path, const uint64_t* expectedHash, Memory& gc) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return nullptr;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    size_t size = info.st_size;
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return nullptr;
+
+    BytecodeReader in;
+    in.next = (const byte*) mapped;
+    in.end = in.next + size;
+    in.failed = false;
+
+    ObjFunction* script = nullptr;
+    const byte* magic = in.take(strlen(LOXC_MAGIC));
+    bool valid = magic != nullptr && memcmp(magic, LOXC_MAGIC, strlen(LOXC_MAGIC)) == 0 && in.readInt() == LOXC_VERSION;
+    uint64_t hash = in.readInt();
+    hash |= (uint64_t) in.readInt() << 32;
+    if (expectedHash != nullptr && hash != *expectedHash) valid = false;
+    uint64_t checksum = in.readInt();
+    checksum |= (uint64_t) in.readInt() << 32;
+    if (!in.failed && checksum != hashSource((const char*) in.next, in.end - in.next)) in.failed = true;
+
+    if (valid) {
+        if (!in.failed) script = readFunction(&in, gc);
+        if (in.failed || in.next != in.end) {
+            // The half built functions are already in the gc's objects list so they get freed with everything else.
+            fprintf(stderr, "Ignoring malformed bytecode file \"%s\".\n", path);
+            script = nullptr;
+        }
+    }
+
+    munmap(mapped, size);
+    return script;
+}
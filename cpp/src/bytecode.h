@@ -0,0 +1,42 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "common.h"
+#include "object.h"
+
+// Compiled scripts can be saved as a .loxc file so the next run can skip the scanner and compiler.
+// The file is the whole ObjFunction tree: header, then the script function, then each nested function in
+// its parent's constants. Upvalue descriptors are operands of OP_CLOSURE so they come along with the code.
+// The header has a hash of the rest so a damaged file is noticed before anything reads it, and every operand
+// is checked against its chunk as well since the VM trusts them completely.
+// Bump LOXC_VERSION whenever opcodes, their operands or this layout change so old caches are ignored.
+// Register code can't run on a stack build or the other way round so they don't share caches.
+#ifdef VM_REGISTERS
+#define LOXC_MAGIC "LOXR"
+#else
+#define LOXC_MAGIC "LOXC"
+#endif
+#define LOXC_VERSION 10
+
+class BytecodeFile {
+public:
+    static uint64_t hashSource(const char* src, size_t length);
+
+    // Returns false if the file couldn't be written.
+    static bool write(ObjFunction* script, const char* path, uint64_t sourceHash, Memory& gc);
+
+    // Returns nullptr if the file doesn't exist, is malformed or damaged, was written by a different version,
+    // or (if <expectedHash> isn't null) was compiled from different source.
+    // The gc must not be enabled while this runs.
+    static ObjFunction* read(const char* path, const uint64_t* expectedHash, Memory& gc);
+
+private:
+    static void writeFunction(ArrayList<byte>* out, ObjFunction* function, Memory& gc);
+    static ObjFunction* readFunction(struct BytecodeReader* in, Memory& gc);
+    static bool validChunk(ObjFunction* function);
+};
+
+void appendAsBytes(ArrayList<byte>* data, uint32_t number, Memory& gc);
+void appendAsBytes(ArrayList<byte>* data, double number, Memory& gc);
+
+#endif
@@ -5,65 +5,146 @@
 Chunk::Chunk(){
     code = new ArrayList<byte>();
     constants = new ArrayList<Value>();
-    lines = new ArrayList<int>();  // run-length encoded: count, line, count, line
+    lines = new ArrayList<LineRun>();
+    lineTable = new ArrayList<byte>();
+    lineCheckpoints = new ArrayList<LineCheckpoint>();
+    inlineCaches = new ArrayList<InlineCache>();
 }
 
 Chunk::~Chunk(){
     delete code;
     delete constants;
     delete lines;
+    delete lineTable;
+    delete lineCheckpoints;
+    delete inlineCaches;
 }
 
 void Chunk::release(Memory& gc){
     code->release(gc);
     constants->release(gc);
     lines->release(gc);
+    lineTable->release(gc);
+    lineCheckpoints->release(gc);
+    inlineCaches->release(gc);
+    numberConstants.clear();
+    objectConstants.clear();
 }
 
 Chunk::Chunk(const Chunk& other){
     code = new ArrayList<byte>(*other.code);
     delete constants;
     constants = new ArrayList<Value>(*other.constants);
-    lines = new ArrayList<int>(*other.lines);
+    lines = new ArrayList<LineRun>(*other.lines);
+    lineTable = new ArrayList<byte>(*other.lineTable);
+    lineCheckpoints = new ArrayList<LineCheckpoint>(*other.lineCheckpoints);
+    inlineCaches = new ArrayList<InlineCache>(*other.inlineCaches);
+    numberConstants = other.numberConstants;
+    objectConstants = other.objectConstants;
 }
 
 
-void Chunk::write(byte b, int line, Memory& gc){
+void Chunk::write(byte b, SourcePosition position, Memory& gc){
     code->push(b, gc);
 
     if (!lines->isEmpty()){
-        int prevLine = (*lines)[lines->count - 1];
-        if (line == prevLine){
-            int prevCount = (*lines)[lines->count - 2];
-            lines->set(lines->count - 2, prevCount + 1);
+        LineRun& last = lines->peekLast();
+        if (last.position.line == position.line && last.position.column == position.column){
+            last.count++;
             return;
         }
     }
 
-    lines->push(1, gc);
-    lines->push(line, gc);
+    lines->push({1, position}, gc);
 }
 
-// This has O(n) but since it will only be called while debugging or when an exception is thrown, it doesn't matter.
-int Chunk::getLineNumber(int opcodeOffset){
-    if (lines->isEmpty()) return -1;
+static void writeVarint(ArrayList<byte>* out, uint32_t value, Memory& gc){
+    while (value >= 0x80){
+        out->push((byte) (value | 0x80), gc);
+        value >>= 7;
+    }
+    out->push((byte) value, gc);
+}
 
-    int currentTokenIndex = 0;
-    for (int i=0;i<lines->count-1;i+=2){
-        int count = (*lines)[i];
-        int lineNumber = (*lines)[i+1];
-        currentTokenIndex += count;
-        if (opcodeOffset <= currentTokenIndex) return lineNumber;
+// Stops at <end> so a bad line table from a .loxc file gives wrong lines rather than reading past it.
+static uint32_t readVarint(const byte*& in, const byte* end){
+    uint32_t value = 0;
+    for (int shift = 0; in < end && shift < 32; shift += 7){
+        byte b = *in++;
+        value |= (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
     }
+    return value;
+}
+
+// Small negative numbers stay small. -1 -> 1, 1 -> 2, -2 -> 3...
+static uint32_t zigzag(int value){
+    return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
 
-    return -1;
+static int unzigzag(uint32_t value){
+    return (int) (value >> 1) ^ -(int) (value & 1);
+}
+
+// Reads the run at <in>. <position> starts as the position of the run before it. See LineCheckpoint.
+static int decodeRun(const byte*& in, const byte* end, SourcePosition& position){
+    uint32_t header = readVarint(in, end);
+    if (header & 1){
+        position.line += unzigzag(readVarint(in, end));
+        position.column = 0;
+    }
+    position.column += unzigzag(readVarint(in, end));
+    return (int) (header >> 1);
+}
+
+int Chunk::getLineNumber(int offset){
+    return getPosition(offset).line;
+}
+
+// Once the chunk is done, this binary searches the checkpoints and decodes at most LINE_CHECKPOINT_RUNS runs.
+// Before that, only the debugger asks, so it just goes through every run.
+SourcePosition Chunk::getPosition(int offset){
+    SourcePosition none = {-1, -1};
+    if (offset < 0) return none;
+
+    if (!lines->isEmpty()){
+        int end = 0;
+        for (uint32_t i=0;i<lines->count;i++){
+            end += (*lines)[i].count;
+            if (offset < end) return (*lines)[i].position;
+        }
+        return none;
+    }
+
+    // The last checkpoint at or before <offset>. The first run doesn't need one since it starts from nothing.
+    LineCheckpoint checkpoint = {0, 0, {0, 0}};
+    int low = 0;
+    int high = (int) lineCheckpoints->count - 1;
+    while (low <= high){
+        int middle = (low + high) / 2;
+        if ((*lineCheckpoints)[middle].offset <= (uint32_t) offset){
+            checkpoint = (*lineCheckpoints)[middle];
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    const byte* in = lineTable->data + checkpoint.encoded;
+    const byte* end = lineTable->data + lineTable->count;
+    SourcePosition position = checkpoint.previous;
+    uint32_t runEnd = checkpoint.offset;
+    while (in < end){
+        runEnd += decodeRun(in, end, position);
+        if ((uint32_t) offset < runEnd) return position;
+    }
+    return none;
 }
 
 // Adds a constant to the array (without a push op code).
 // Ownership of the value's heap memory (if an object) is passed to the chunk.
 const_index_t Chunk::addConstant(Value value, Memory& gc){
-    // TODO: another opcode for reading two bytes for the index for programs long enough to need more than 256
-    if (constants->size() >= 256){
+    if (constants->size() > WIDE_OPERAND_MAX){
         cerr << "Too many constants in chunk." << endl;
         exit(65);  // TODO: more consistent error handling. web version cant just exit here
         return -1;
@@ -75,26 +156,35 @@ const_index_t Chunk::addConstant(Value value, Memory& gc){
         return -1;
     }
 
-    // Loop through all existing constants to deduplicate.
-    for (int i=0;i<constants->size();i++){
-        Value constant = (*constants)[i];
-        if (valuesEqual(value, constant)){
-            if (IS_OBJ(value)){ // The Obj struct is allocated on the heap.
-                bool sameAddress = AS_OBJ(value) == AS_OBJ(constant);
-                if (!sameAddress){  // if the new Value is a different address but the same data, we delete it and use the old one instead
-                    switch (AS_OBJ(value)->type) {
-                        case OBJ_STRING:
-                            gc.FREE(ObjString, AS_STRING(value));
-                            break;
-                    }
-                }
-            }
-            return i;
-        }
+    // Deduplicate. Strings are interned so the same text is always the same object.
+    // 0 == -0 but they print differently (and folding can produce -0) so numbers go by their bits instead of ==.
+    const_index_t index = constants->size();
+    if (IS_NUMBER(value)){
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        auto found = numberConstants.emplace(bits, index);
+        if (!found.second) return found.first->second;
+    } else {
+        auto found = objectConstants.emplace(AS_OBJ(value), index);
+        if (!found.second) return found.first->second;
     }
 
     rawAddConstant(value, gc);
-    return constants->size() - 1;
+    return index;
+}
+
+// Removes the newest constant. For when the compiler throws away the only code that used it.
+void Chunk::popConstant(){
+    Value value = constants->pop();
+    if (IS_NUMBER(value)){
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        numberConstants.erase(bits);
+    } else {
+        objectConstants.erase(AS_OBJ(value));
+    }
 }
 
 void Chunk::rawAddConstant(Value value, Memory& gc){
@@ -137,11 +227,296 @@ void Chunk::setCodeAt(int index, byte value){
     code->set(index, value);
 }
 
+// Reserves an empty cache slot for one property access site. The compiler writes the index as the instruction's operand.
+uint16_t Chunk::addInlineCache(Memory& gc){
+    if (inlineCaches->size() > UINT16_MAX) {
+        cerr << "Too many property accesses in chunk." << endl;
+        exit(65);
+    }
+
+    InlineCache cache;
+    cache.shape = nullptr;
+    cache.method = nullptr;
+    cache.fieldSlot = 0;
+    inlineCaches->push(cache, gc);
+    return inlineCaches->size() - 1;
+}
+
+int Chunk::getInlineCacheCount(){
+    return inlineCaches->size();
+}
+
+// Size in bytes of the instruction at <offset> including its operands. Returns -1 for an unknown opcode.
+int Chunk::instructionLength(int offset){
+    switch ((*code)[offset]) {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_RETURN:
+        case OP_EXPONENT:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_DEBUG_BREAK_POINT:
+        case OP_EXIT_VM:
+        case OP_ACCESS_INDEX:
+        case OP_SLICE_INDEX:
+        case OP_SET_INDEX:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_GREATER_NUM:
+        case OP_LESS_NUM:
+        case OP_LESS_EQUAL_NUM:
+        case OP_GREATER_EQUAL_NUM:
+            return 1;
+        case OP_R_LOAD_NIL:
+        case OP_R_RETURN:
+        case OP_R_SET_TOP:
+            return 2;
+        case OP_R_MOVE:
+        case OP_R_LOAD_CONSTANT:
+        case OP_R_LOAD_BOOL:
+        case OP_R_GET_UPVALUE:
+        case OP_R_SET_UPVALUE:
+        case OP_R_NEGATE:
+        case OP_R_NOT:
+            return 3;
+        case OP_R_SUBTRACT:
+        case OP_R_SUBTRACT_K:
+        case OP_R_MULTIPLY:
+        case OP_R_MULTIPLY_K:
+        case OP_R_DIVIDE:
+        case OP_R_DIVIDE_K:
+        case OP_R_EQUAL:
+        case OP_R_EQUAL_K:
+        case OP_R_NOT_EQUAL:
+        case OP_R_NOT_EQUAL_K:
+        case OP_R_LESS:
+        case OP_R_LESS_K:
+        case OP_R_GREATER:
+        case OP_R_GREATER_K:
+        case OP_R_LESS_EQUAL:
+        case OP_R_LESS_EQUAL_K:
+        case OP_R_GREATER_EQUAL:
+        case OP_R_GREATER_EQUAL_K:
+        case OP_R_JUMP_IF_FALSE:
+        case OP_R_JUMP_IF_TRUE:
+            return 4;
+        case OP_R_ADD:
+        case OP_R_ADD_K:
+            return 5;
+        case OP_GET_CONSTANT:
+        case OP_POP_MANY:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_LENGTH:
+        case OP_BUILD_LIST:
+        case OP_BUILD_MAP:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_CALL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CLASS:
+        case OP_SET_PROPERTY:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+            return 2;
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_SUPER_INVOKE:
+        case OP_SET_LOCAL_POP:
+            return 3;
+        case OP_GET_PROPERTY:  // name, cache index
+        case OP_GET_LOCALS:
+            return 4;
+        case OP_INVOKE:  // name, arg count, cache index
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            return 5;
+        case OP_GET_CONSTANT_LONG:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+        case OP_POP_JUMP_IF_TRUE_LONG:
+            return 4;
+        case OP_WIDE: {
+            byte op = (*code)[offset + 1];
+            if (op == OP_CLOSURE) {
+                ObjFunction* function = AS_FUNCTION(getConstant(readWide(offset + 2)));
+                return 5 + 4 * function->upvalueCount;
+            }
+            if (!canBeWide(op)) return -1;
+            return 3 + instructionLength(offset + 1);
+        }
+        case OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE:
+            return 8;
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(getConstant((*code)[offset + 1]));
+            return 2 + 2 * function->upvalueCount;
+        }
+        case OP_LOAD_INLINE_CONSTANT: {
+            byte* operands = code->data + offset + 2;
+            uint32_t length;
+            switch ((*code)[offset + 1]) {
+                case 0:
+                    return 2 + sizeof(double);
+                case (1 + OBJ_STRING):
+                    memcpy(&length, operands, sizeof(length));
+                    return 2 + sizeof(length) + length;
+                case (1 + OBJ_FUNCTION):
+                    memcpy(&length, operands + 1, sizeof(length));
+                    return 3 + sizeof(length) + length;
+                default:
+                    return -1;
+            }
+        }
+        default:
+            return -1;
+    }
+}
+
+// Where the instruction at <offset> can jump to, or -1 if it's not a jump.
+int Chunk::jumpTarget(int offset){
+    byte* instruction = code->data + offset;
+    switch (instruction[0]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+            return offset + 3 + ((instruction[1] << 8) | instruction[2]);
+        case OP_LOOP:
+            return offset + 3 - ((instruction[1] << 8) | instruction[2]);
+        case OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE:
+            return offset + 8 + ((instruction[6] << 8) | instruction[7]);
+        case OP_R_JUMP_IF_FALSE:
+        case OP_R_JUMP_IF_TRUE:
+            return offset + 4 + ((instruction[2] << 8) | instruction[3]);
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+        case OP_POP_JUMP_IF_TRUE_LONG:
+            return offset + 4 + readWide(offset + 1);
+        case OP_LOOP_LONG:
+            return offset + 4 - readWide(offset + 1);
+        default:
+            return -1;
+    }
+}
+
+// The three byte operand starting at <offset>.
+uint32_t Chunk::readWide(int offset){
+    byte* operand = code->data + offset;
+    return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+}
+
+// Whether OP_WIDE can go before <op>. See chunk.h.
+bool Chunk::canBeWide(byte op){
+    switch (op) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_INVOKE:
+        case OP_GET_SUPER:
+        case OP_SUPER_INVOKE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Unpacks the line runs so passes that move code around can look up positions by offset. Only works before setDone.
+vector<SourcePosition> Chunk::positionOfEachByte(){
+    vector<SourcePosition> result;
+    for (uint32_t i=0;i<lines->count;i++){
+        result.insert(result.end(), (*lines)[i].count, (*lines)[i].position);
+    }
+    return result;
+}
+
+// Throws away the code and line table (keeping the constants and inline caches) so a pass can write new code with Chunk::write.
+void Chunk::clearCode(){
+    code->count = 0;
+    lines->count = 0;
+}
+
+// Throws away everything after the first <size> bytes of code, and their entries in the line table.
+// For when the compiler replaces the code it just wrote.
+void Chunk::truncateCode(int size){
+    int extra = code->count - size;
+    code->count = size;
+    while (extra > 0 && !lines->isEmpty()){
+        LineRun& last = lines->peekLast();
+        if (last.count > extra){
+            last.count -= extra;
+            break;
+        }
+        extra -= last.count;
+        lines->count--;
+    }
+}
+
 // When done compiling the function, the chunk is effectively immutable, so we can remove the extra list space.
+// The line runs are packed into lineTable since nothing changes the code after this. See LineCheckpoint.
 void Chunk::setDone(Memory& gc){
     constants->shrink(gc);
     code->shrink(gc);
-    lines->shrink(gc);
+    inlineCaches->shrink(gc);
+
+    SourcePosition previous = {0, 0};
+    for (uint32_t i=0;i<lines->count;i++){
+        LineRun run = (*lines)[i];
+        bool newLine = run.position.line != previous.line;
+        writeVarint(lineTable, ((uint32_t) run.count << 1) | newLine, gc);
+        if (newLine){
+            writeVarint(lineTable, zigzag(run.position.line - previous.line), gc);
+            previous.column = 0;
+        }
+        writeVarint(lineTable, zigzag(run.position.column - previous.column), gc);
+        previous = run.position;
+    }
+    lines->release(gc);
+    lineTable->shrink(gc);
+    indexLineTable(gc);
+}
+
+// Finds the checkpoints for lineTable. Also used when it's loaded from a .loxc file.
+void Chunk::indexLineTable(Memory& gc){
+    lineCheckpoints->clear();
+    const byte* in = lineTable->data;
+    const byte* end = lineTable->data + lineTable->count;
+    SourcePosition position = {0, 0};
+    uint32_t offset = 0;
+    for (int run = 0; in < end; run++){
+        if (run > 0 && run % LINE_CHECKPOINT_RUNS == 0) lineCheckpoints->push({offset, (uint32_t) (in - lineTable->data), position}, gc);
+        offset += decodeRun(in, end, position);
+    }
+    lineCheckpoints->shrink(gc);
 }
 
 #define OP(name) [name] = #name,
@@ -172,6 +547,9 @@ string Chunk::opcodeNames[256] = {
         OP(OP_ACCESS_INDEX)
         OP(OP_SLICE_INDEX)
         OP(OP_GET_LENGTH)
+        OP(OP_SET_INDEX)
+        OP(OP_BUILD_LIST)
+        OP(OP_BUILD_MAP)
         OP(OP_GET_LOCAL)
         OP(OP_SET_LOCAL)
         OP(OP_LOAD_INLINE_CONSTANT)
@@ -191,6 +569,64 @@ string Chunk::opcodeNames[256] = {
         OP(OP_INHERIT)
         OP(OP_GET_SUPER)
         OP(OP_SUPER_INVOKE)
+        OP(OP_NOT_EQUAL)
+        OP(OP_LESS_EQUAL)
+        OP(OP_GREATER_EQUAL)
+        OP(OP_POP_JUMP_IF_FALSE)
+        OP(OP_POP_JUMP_IF_TRUE)
+        OP(OP_SET_LOCAL_POP)
+        OP(OP_GET_LOCALS)
+        OP(OP_ADD_LOCAL_CONSTANT)
+        OP(OP_SUBTRACT_LOCAL_CONSTANT)
+        OP(OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE)
+        OP(OP_ADD_NUM)
+        OP(OP_ADD_STR)
+        OP(OP_SUBTRACT_NUM)
+        OP(OP_MULTIPLY_NUM)
+        OP(OP_DIVIDE_NUM)
+        OP(OP_GREATER_NUM)
+        OP(OP_LESS_NUM)
+        OP(OP_LESS_EQUAL_NUM)
+        OP(OP_GREATER_EQUAL_NUM)
+        OP(OP_GET_CONSTANT_LONG)
+        OP(OP_JUMP_LONG)
+        OP(OP_LOOP_LONG)
+        OP(OP_JUMP_IF_FALSE_LONG)
+        OP(OP_POP_JUMP_IF_FALSE_LONG)
+        OP(OP_POP_JUMP_IF_TRUE_LONG)
+        OP(OP_WIDE)
+        OP(OP_R_MOVE)
+        OP(OP_R_LOAD_CONSTANT)
+        OP(OP_R_LOAD_NIL)
+        OP(OP_R_LOAD_BOOL)
+        OP(OP_R_GET_UPVALUE)
+        OP(OP_R_SET_UPVALUE)
+        OP(OP_R_NEGATE)
+        OP(OP_R_NOT)
+        OP(OP_R_ADD)
+        OP(OP_R_ADD_K)
+        OP(OP_R_SUBTRACT)
+        OP(OP_R_SUBTRACT_K)
+        OP(OP_R_MULTIPLY)
+        OP(OP_R_MULTIPLY_K)
+        OP(OP_R_DIVIDE)
+        OP(OP_R_DIVIDE_K)
+        OP(OP_R_EQUAL)
+        OP(OP_R_EQUAL_K)
+        OP(OP_R_NOT_EQUAL)
+        OP(OP_R_NOT_EQUAL_K)
+        OP(OP_R_LESS)
+        OP(OP_R_LESS_K)
+        OP(OP_R_GREATER)
+        OP(OP_R_GREATER_K)
+        OP(OP_R_LESS_EQUAL)
+        OP(OP_R_LESS_EQUAL_K)
+        OP(OP_R_GREATER_EQUAL)
+        OP(OP_R_GREATER_EQUAL_K)
+        OP(OP_R_JUMP_IF_FALSE)
+        OP(OP_R_JUMP_IF_TRUE)
+        OP(OP_R_RETURN)
+        OP(OP_R_SET_TOP)
 };
 
 #undef OP
\ No newline at end of file
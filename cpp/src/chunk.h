@@ -6,10 +6,49 @@
 #include "list.cc"
 #include "value.h"
 #include <fstream>
+#include <vector>
+#include <unordered_map>
 
 
-typedef byte const_index_t;
+typedef uint32_t const_index_t;
 
+// The biggest operand OP_WIDE and the _LONG instructions can hold. Three bytes, big endian like the two byte ones.
+#define WIDE_OPERAND_MAX 0xFFFFFF
+
+// Remembers what a property access resolved to the last time it ran, keyed by the receiver's shape.
+// A shape belongs to one class and has a fixed set of fields, so on a hit the field index is right
+// and, if the name was a method, there can't be a field shadowing it.
+typedef struct {
+    struct ObjShape* shape;
+    struct ObjClosure* method;  // non-null if the name was a method rather than a field
+    uint32_t fieldSlot;
+} InlineCache;
+
+// Where the code for some bytes came from. Columns count from 1.
+typedef struct {
+    int line;
+    int column;
+} SourcePosition;
+
+// A run of bytes that all came from the same position. The compiler builds the line table out of these.
+typedef struct {
+    int count;
+    SourcePosition position;
+} LineRun;
+
+// Chunk::setDone packs the runs into lineTable, one varint after another. For each run, (count << 1) | <line changed>,
+// then the zigzag change in line if it did, then the zigzag change in column (from 0 on a new line).
+// Every LINE_CHECKPOINT_RUNS runs after the first, a checkpoint remembers where that run starts so a lookup can binary
+// search them and only decode the runs after the closest one.
+#define LINE_CHECKPOINT_RUNS 32
+
+typedef struct {
+    uint32_t offset;  // the first byte of code in the run
+    uint32_t encoded;  // where the run starts in lineTable
+    SourcePosition previous;  // of the run before it, which its deltas are from
+} LineCheckpoint;
+
+// Changing these or their operands changes the meaning of .loxc files so bump LOXC_VERSION in bytecode.h.
 typedef enum {
     OP_INVALID = 0,  // zero initialized memory shouldn't be valid instructions
     OP_GET_CONSTANT,
@@ -36,6 +75,9 @@ typedef enum {
     OP_ACCESS_INDEX,
     OP_SLICE_INDEX,
     OP_GET_LENGTH,
+    OP_SET_INDEX,  // sequence, index, value -> value
+    OP_BUILD_LIST,  // count. makes a list of the top <count> values
+    OP_BUILD_MAP,  // count. makes a map of the top <count> key, value pairs
     OP_GET_LOCAL,
     OP_SET_LOCAL,
     OP_LOAD_INLINE_CONSTANT,
@@ -55,6 +97,82 @@ typedef enum {
     OP_INHERIT,
     OP_GET_SUPER,
     OP_SUPER_INVOKE,
+    OP_NOT_EQUAL,
+    OP_LESS_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_POP_JUMP_IF_FALSE,  // pops the condition either way. the peephole pass makes these from JUMP_IF_FALSE; POP
+    OP_POP_JUMP_IF_TRUE,
+
+    // Superinstructions. Compiler::fuseSuperinstructions swaps the first opcode of a common sequence for one of these
+    // and leaves the rest of the bytes alone. The handler reads its operands from where they already are and skips the whole sequence.
+    // Picked from the counts tests/ngrams.py reports over the benchmarks.
+    OP_SET_LOCAL_POP,  // SET_LOCAL a; POP
+    OP_GET_LOCALS,  // GET_LOCAL a; GET_LOCAL b
+    OP_ADD_LOCAL_CONSTANT,  // GET_LOCAL a; GET_CONSTANT k; ADD
+    OP_SUBTRACT_LOCAL_CONSTANT,  // GET_LOCAL a; GET_CONSTANT k; SUBTRACT
+    OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE,  // GET_LOCAL a; GET_CONSTANT k; LESS; POP_JUMP_IF_FALSE d
+
+    // Quickened instructions. Never made by the compiler. VM::run rewrites a generic arithmetic opcode in place to one
+    // of these for the operand types it saw, and puts the generic one back if they ever don't match.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_LESS_EQUAL_NUM,
+    OP_GREATER_EQUAL_NUM,
+
+    // For code too big for the one byte constant indexes and two byte jump distances above. The compiler only uses these
+    // when the short form can't reach, so normal sized functions never see them.
+    OP_GET_CONSTANT_LONG,  // three byte k
+    OP_JUMP_LONG,  // three byte distance
+    OP_LOOP_LONG,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_POP_JUMP_IF_FALSE_LONG,
+    OP_POP_JUMP_IF_TRUE_LONG,
+    // Prefix for the instruction after it. Its first operand, a local, upvalue or constant index, is three bytes instead of one.
+    // Any other operands are the same as usual, except OP_CLOSURE where the index in each upvalue pair is also three bytes.
+    // Works on GET_LOCAL, SET_LOCAL, GET_UPVALUE, SET_UPVALUE, CLOSURE, CLASS, METHOD, GET_PROPERTY, SET_PROPERTY, INVOKE, GET_SUPER and SUPER_INVOKE.
+    OP_WIDE,
+
+    // Register instructions. Only made by Compiler::translateToRegisters when VM_REGISTERS is defined.
+    // Operands are stack slots relative to the frame (like GET_LOCAL) with the destination first.
+    // A _K suffix means the last operand is a constant index instead of a slot.
+    // They read and write slots above gc.stackTop without moving it, OP_R_SET_TOP fixes it up before a stack instruction.
+    OP_R_MOVE,  // dest, source
+    OP_R_LOAD_CONSTANT,  // dest, k
+    OP_R_LOAD_NIL,  // dest
+    OP_R_LOAD_BOOL,  // dest, 0 or 1
+    OP_R_GET_UPVALUE,  // dest, upvalue index
+    OP_R_SET_UPVALUE,  // upvalue index, source
+    OP_R_NEGATE,  // dest, a
+    OP_R_NOT,  // dest, a
+    OP_R_ADD,  // dest, a, b, scratch. strings are concatenated in scratch and the slot after it
+    OP_R_ADD_K,
+    OP_R_SUBTRACT,
+    OP_R_SUBTRACT_K,
+    OP_R_MULTIPLY,
+    OP_R_MULTIPLY_K,
+    OP_R_DIVIDE,
+    OP_R_DIVIDE_K,
+    OP_R_EQUAL,
+    OP_R_EQUAL_K,
+    OP_R_NOT_EQUAL,
+    OP_R_NOT_EQUAL_K,
+    OP_R_LESS,
+    OP_R_LESS_K,
+    OP_R_GREATER,
+    OP_R_GREATER_K,
+    OP_R_LESS_EQUAL,
+    OP_R_LESS_EQUAL_K,
+    OP_R_GREATER_EQUAL,
+    OP_R_GREATER_EQUAL_K,
+    OP_R_JUMP_IF_FALSE,  // condition, distance (2 bytes)
+    OP_R_JUMP_IF_TRUE,
+    OP_R_RETURN,  // source
+    OP_R_SET_TOP,  // height. sets gc.stackTop to that many slots above the frame
 } OpCode;
 
 class Chunk {
@@ -63,10 +181,12 @@ class Chunk {
         ~Chunk();
         Chunk(const Chunk& other);
         void release(Memory& gc);
-        void write(byte b, int line, Memory& gc);
-        int getLineNumber(int tokenIndex);
+        void write(byte b, SourcePosition position, Memory& gc);
+        int getLineNumber(int offset);
+        SourcePosition getPosition(int offset);
         const_index_t addConstant(Value value, Memory& gc);
         void rawAddConstant(Value value, Memory& gc);
+        void popConstant();
         int getCodeSize();
         unsigned char* getCodePtr();
         void printConstantsArray();
@@ -75,19 +195,38 @@ class Chunk {
         int popInstruction();
         int getConstantsSize();
         void setCodeAt(int index, byte value);
+        uint16_t addInlineCache(Memory& gc);
+        int getInlineCacheCount();
+        int instructionLength(int offset);
+        int jumpTarget(int offset);
+        uint32_t readWide(int offset);
+        static bool canBeWide(byte op);
+        vector<SourcePosition> positionOfEachByte();
+        void clearCode();
+        void truncateCode(int size);
+        void setDone(Memory& gc);
+
+        inline InlineCache* getInlineCache(int index) {
+            return inlineCaches->data + index;
+        }
 
         static string opcodeNames[256];
 
         // TODO: why are these lists on the heap
         ArrayList<byte>* code;
 private:
-    ArrayList<int>* lines;
+    ArrayList<LineRun>* lines;  // only while compiling. released by setDone.
+    ArrayList<byte>* lineTable;
+    ArrayList<LineCheckpoint>* lineCheckpoints;
     ArrayList<Value>* constants;
+    ArrayList<InlineCache>* inlineCaches;
+    // Where each constant already is so addConstant doesn't search the whole list. Numbers are keyed by their bits.
+    std::unordered_map<uint64_t, const_index_t> numberConstants;
+    std::unordered_map<Obj*, const_index_t> objectConstants;
 
-    void setDone(Memory& gc);
-};
+    void indexLineTable(Memory& gc);
 
-void appendAsBytes(ArrayList<byte>* data, uint32_t number);
-void appendAsBytes(ArrayList<byte>* data, double number);
+    friend class BytecodeFile;
+};
 
 #endif
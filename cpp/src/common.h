@@ -12,19 +12,101 @@ using namespace std;
 //#define DEBUG_STRESS_GC
 
 //#define VM_SAFE_MODE
+
+// Pack every Value into one 64-bit word (a double, or a pointer/singleton hidden in the bits of a NaN)
+// instead of the 16-byte tagged union. Halves the value stack, constant arrays and Table entries.
+//#define NAN_BOXING
+
+// Probe Table in groups of 16 slots using a byte per slot of hash bits (a Swiss table) instead of one Entry at a time.
+// Checks 16 keys with a couple of SSE2 instructions, and a miss usually stops at the first group.
+// make bench_table times both layouts.
+//#define TABLE_SWISS
+
 // These cause various debugging info to be logged to stderr.
 #define COMPILER_DEBUG_PRINT_CODE
 //#define VM_DEBUG_TRACE_EXECUTION
-//#define VM_PROFILING
+//#define VM_OPCODE_NGRAMS
+//#define VM_INLINE_CACHE_STATS
 //#define DEBUG_LOG_GC
+//#define GC_PAUSE_HISTOGRAM
 
 //#define VM_ALLOW_DEBUG_BREAK_POINT
 
+// Count how many times each opcode, and each pair of opcodes in a row, runs with a plain increment as it's dispatched.
+// The totals are printed to stderr and lox -j stats.json writes them out. VM_PROFILING_CYCLES also reads the time stamp
+// counter at every dispatch and charges the cycles since the last one to the instruction that was running. x86-64 only.
+//#define VM_PROFILING
+//#define VM_PROFILING_CYCLES
+#if defined(VM_PROFILING_CYCLES) && !defined(VM_PROFILING)
+#define VM_PROFILING
+#endif
+#if defined(VM_PROFILING_CYCLES) && !defined(__x86_64__)
+#undef VM_PROFILING_CYCLES
+#endif
+
+// Emit operators on constants as written instead of working them out while compiling.
+//#define COMPILER_NO_CONSTANT_FOLDING
+// Leave finished chunks exactly as the compiler emitted them instead of cleaning up jumps and pops.
+//#define COMPILER_NO_PEEPHOLE
+// Leave common opcode sequences as separate instructions instead of fusing them into superinstructions.
+//#define COMPILER_NO_SUPERINSTRUCTIONS
+
+// Translate each finished chunk into three-address instructions that work on the frame's stack slots as registers,
+// so i = i + 1 is one instruction instead of five. Anything without a register form stays a stack instruction.
+// See Compiler::translateToRegisters. tests/bench_registers.py times it against the normal stack code.
+//#define VM_REGISTERS
+#ifdef VM_REGISTERS
+#define COMPILER_NO_SUPERINSTRUCTIONS  // they're sequences of stack instructions the register code doesn't have
+#endif
+
+// Threaded dispatch in VM::run using the GCC/Clang labels-as-values extension.
+// Each handler jumps straight to the next one instead of going back through the switch.
+// Wasm has no indirect jumps so the emscripten build always uses the portable switch.
+// Tracing and n-gram counting hook the top of the switch loop so they force the switch as well.
+//#define VM_NO_COMPUTED_GOTO
+#if defined(__GNUC__) && !defined(__EMSCRIPTEN__) && !defined(VM_NO_COMPUTED_GOTO) && !defined(VM_DEBUG_TRACE_EXECUTION) && !defined(VM_OPCODE_NGRAMS)
+#define VM_COMPUTED_GOTO
+#endif
+
+// Compile functions to x86-64 machine code once they've run VM_JIT_THRESHOLD calls plus loop iterations. See jit.cc.
+// Only on x86-64 outside the browser, and not while tracing or counting instructions since the machine code skips those hooks.
+// The register instructions don't have templates so there'd be nothing to gain there either.
+// make test_jit builds with a threshold of 0, which compiles every function before it first runs.
+//#define VM_NO_JIT
+#if defined(__x86_64__) && !defined(__EMSCRIPTEN__) && !defined(VM_NO_JIT) && !defined(VM_REGISTERS) && !defined(VM_DEBUG_TRACE_EXECUTION) && !defined(VM_PROFILING) && !defined(VM_OPCODE_NGRAMS)
+#define VM_JIT
+#endif
+#ifndef VM_JIT_THRESHOLD
+#define VM_JIT_THRESHOLD 1000
+#endif
+
 #define byte uint8_t
 #define cast(targetType, v) (reinterpret_cast<targetType>(v))
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * 256)
+// Most functions fit in their share of the stack. One with more locals than that is checked by VM::call.
+#define LOCALS_MAX (STACK_MAX / 2)
 #define GC_HEAP_GROW_FACTOR 2
+// How many bytes can be allocated before a minor collection of just the young generation.
+#define GC_NURSERY_SIZE (256 * 1024)
+
+// Spread full collections across allocations instead of stopping until the whole heap is traced.
+// During a cycle, every GC_STEP_SIZE bytes allocated does at most GC_MAX_PAUSE_US of marking or sweeping.
+//#define GC_INCREMENTAL
+#define GC_MAX_PAUSE_US 500
+#define GC_STEP_SIZE (16 * 1024)
+
+// Send every allocation straight to realloc/free instead of recycling small blocks in SizeClassAllocator.
+//#define GC_NO_POOL_ALLOCATOR
+
+// How often lox -p samples the running script. See SamplingProfiler.
+#define PROFILER_SAMPLES_PER_SECOND 1000
+
+// How much printed output the native vm holds before writing it out. See OutputBuffer.
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+// The browser build hands output to the page when this much is waiting, or after WEB_PRINT_INTERVAL_MS, instead of every line.
+#define WEB_PRINT_BATCH_SIZE 4096
+#define WEB_PRINT_INTERVAL_MS 50
 
 #endif
\ No newline at end of file
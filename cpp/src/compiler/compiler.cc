@@ -32,6 +32,7 @@ void Compiler::pushFunction(FunctionType currentFunctionType){
     func.scopeDepth = 0;
 
     functionStack.push(func, gc);
+    forgetConstants();
 
     // Reserve a stack slot. For methods, it holds the receiver (`this`). For functions, it holds the ObjClosure but is unused.
     const char* name = "";
@@ -45,6 +46,7 @@ void Compiler::pushFunction(FunctionType currentFunctionType){
 // TODO: get rid of this cause i dont always call it
 ObjFunction *Compiler::popFunction() {
     TargetFunction func = functionStack.pop();
+    forgetConstants();
     func.variableStack->release(gc);
     func.upvalues->release(gc);
     delete func.variableStack;
@@ -63,6 +65,7 @@ ObjFunction* Compiler::compile(char* src){
 
     pushFunction(TYPE_SCRIPT);
     advance();
+    previous = current;  // gives the implicit imports a position
 
     // Original Lox doesn't have explicit imports, so implicitly import clock
     importNative(syntheticToken("clock"));
@@ -73,6 +76,12 @@ ObjFunction* Compiler::compile(char* src){
 
     emitConstantAccess(NUMBER_VAL(0));
     emitByte(OP_RETURN);
+    if (!hadError) {
+        peepholeOptimize(currentChunk());
+        translateToRegisters(currentChunk(), 1);
+        fuseSuperinstructions(currentChunk());
+    }
+    currentChunk()->setDone(gc);
 
     #ifdef COMPILER_DEBUG_PRINT_CODE
     if (!hadError){
@@ -199,7 +208,7 @@ void Compiler::classDeclaration(){
     int nameId = identifierConstant(className);
     declareLocalVariable();
     defineLocalVariable();
-    emitBytes(OP_CLASS, nameId);
+    emitIndexed(OP_CLASS, nameId);
 
     beginScope();
     if (match(TOKEN_LESS)) {
@@ -248,7 +257,7 @@ void Compiler::method() {
         functionExpression(TYPE_METHOD, name);
     }
 
-    emitBytes(OP_METHOD, nameId);
+    emitIndexed(OP_METHOD, nameId);
 }
 
 void Compiler::block(){
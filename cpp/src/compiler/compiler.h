@@ -52,7 +52,7 @@ typedef enum {
 } FunctionType;
 
 typedef struct {
-    uint8_t index;
+    int index;
     bool isLocal;  // is index a stack offset or an upvalue index?
 } Upvalue;
 
@@ -64,6 +64,14 @@ typedef struct {
     ArrayList<Upvalue>* upvalues;  // TODO: dont heap allocate the lists. but c++ is hateful and i cant deal with destructors rn
 } TargetFunction;
 
+// A constant the compiler just pushed and where its code is in the chunk.
+typedef struct {
+    int start;
+    int end;
+    Value value;
+    int addedConstant;  // index in the chunk's constants if this was its first use, otherwise -1
+} FoldableConstant;
+
 class Compiler {
 public:
     Compiler(Memory& gc);
@@ -88,6 +96,7 @@ private:
     ArrayList<ArrayList<byte>*> bufferStack;
     ArrayList<LoopContext*> loopStack;
     ArrayList<TargetFunction> functionStack;
+    vector<FoldableConstant> foldableConstants;  // the run of constants at the end of the current chunk
 
     void funDeclaration();
     void expression();
@@ -95,6 +104,7 @@ private:
     void consume(TokenType token, const char* message);
     void emitByte(byte byte1);
     void emitBytes(byte byte1, byte byte2);
+    void emitIndexed(OpCode op, uint32_t index);
     void emitConstantAccess(Value value);
     Chunk* currentChunk();
     void advance();
@@ -107,7 +117,9 @@ private:
     void breakOrContinueStatement(TokenType type);
 
     void grouping();
-    void sequenceSliceExpression();
+    void sequenceSliceExpression(bool canAssign);
+    void listLiteral();
+    void mapLiteral();
     void setBreakTargetAndPopActiveLoop();
     void setContinueTarget();
 
@@ -136,7 +148,7 @@ private:
 
     void synchronize();
 
-    byte identifierConstant(Token name);
+    const_index_t identifierConstant(Token name);
 
     void namedVariable(Token name, bool canAssign);
     int resolveUpvalue(int funcIndex, Token* name);
@@ -158,7 +170,7 @@ private:
     void emitPops(int count);
 
     int resolveLocal(TargetFunction& func, Token name);
-    int addUpvalue(TargetFunction& func, uint8_t local, bool isLocal);
+    int addUpvalue(TargetFunction& func, int index, bool isLocal);
 
     int emitJumpIfTrue();
 
@@ -176,6 +188,17 @@ private:
     void pushActiveLoop();
 
     void writeShort(int offset, uint16_t v);
+    void writeWide(int offset, uint32_t v);
+    void peepholeOptimize(Chunk* chunk);
+    void fuseSuperinstructions(Chunk* chunk);
+    void translateToRegisters(Chunk* chunk, int slotsAtEntry);
+    void rememberConstant(int start, Value value, int addedConstant);
+    void dropConstant(FoldableConstant operand);
+    void forgetConstants();
+    bool hasConstantOperands(int count);
+    bool foldUnary(OpCode op);
+    bool foldBinary(OpCode op);
+    void emitInlineCache();
 
     void functionExpression(FunctionType funcType, ObjString* name);
 
@@ -25,10 +25,10 @@ void Compiler::unary(){
 
     switch (operatorType) {
         case TOKEN_MINUS:
-            emitByte(OP_NEGATE);  // vm: pop it off, negate, put back
+            if (!foldUnary(OP_NEGATE)) emitByte(OP_NEGATE);  // vm: pop it off, negate, put back
             break;
         case TOKEN_BANG:
-            emitByte(OP_NOT);
+            if (!foldUnary(OP_NOT)) emitByte(OP_NOT);
             break;
         default:
             cerr << "Unreachable unary token." << endl;
@@ -53,9 +53,9 @@ Value Compiler::createStringValue(const char* chars, int length){
 void Compiler::parsePrecedence(Precedence precedence){
     advance();
 
-#define LITERAL(token, opcode)   \
-            case token:              \
-                emitByte(opcode);    \
+#define LITERAL(token, value)          \
+            case token:                    \
+                emitConstantAccess(value); \
                 break;
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
@@ -64,14 +64,16 @@ void Compiler::parsePrecedence(Precedence precedence){
         case TOKEN_NUMBER: number(); break;
         case TOKEN_STRING: string(); break;
         case TOKEN_LEFT_PAREN: grouping(); break;
+        case TOKEN_LEFT_SQUARE_BRACKET: listLiteral(); break;
+        case TOKEN_LEFT_BRACE: mapLiteral(); break;
         case TOKEN_MINUS:  // fallthrough
         case TOKEN_BANG:
             unary();
             break;
 
-        LITERAL(TOKEN_TRUE, OP_TRUE)
-        LITERAL(TOKEN_FALSE, OP_FALSE)
-        LITERAL(TOKEN_NIL, OP_NIL)
+        LITERAL(TOKEN_TRUE, BOOL_VAL(true))
+        LITERAL(TOKEN_FALSE, BOOL_VAL(false))
+        LITERAL(TOKEN_NIL, NIL_VAL())
         case TOKEN_IDENTIFIER:
             namedVariable(previous, canAssign);
             break;
@@ -99,20 +101,10 @@ void Compiler::parsePrecedence(Precedence precedence){
                 if (precedence > operatorPrecedence) return;           \
                 advance();                                             \
                 parsePrecedence((Precedence)(operatorPrecedence + 1)); \
-                emitByte(opcode);                                      \
+                if (!foldBinary(opcode)) emitByte(opcode);             \
                 break;                                                 \
             }                                                          \
 
-#define DOUBLE_BINARY_INFIX_OP(operatorToken, operatorPrecedence, opcode, opcode2) \
-            case operatorToken: {                                      \
-                if (precedence > operatorPrecedence) return;           \
-                advance();                                             \
-                parsePrecedence((Precedence)(operatorPrecedence + 1)); \
-                emitByte(opcode);                                      \
-                emitByte(opcode2);                                     \
-                break;                                                 \
-            }
-
     for (;;){
         switch (current.type) {
             BINARY_INFIX_OP(TOKEN_MINUS, PREC_TERM, OP_SUBTRACT)
@@ -123,16 +115,16 @@ void Compiler::parsePrecedence(Precedence precedence){
             BINARY_INFIX_OP(TOKEN_EQUAL_EQUAL, PREC_EQUALITY, OP_EQUAL)
             BINARY_INFIX_OP(TOKEN_LESS, PREC_COMPARISON, OP_LESS)
             BINARY_INFIX_OP(TOKEN_GREATER, PREC_COMPARISON, OP_GREATER)
-            DOUBLE_BINARY_INFIX_OP(TOKEN_BANG_EQUAL, PREC_EQUALITY, OP_EQUAL, OP_NOT)
-            DOUBLE_BINARY_INFIX_OP(TOKEN_GREATER_EQUAL, PREC_COMPARISON, OP_LESS, OP_NOT)
-            DOUBLE_BINARY_INFIX_OP(TOKEN_LESS_EQUAL, PREC_COMPARISON, OP_GREATER, OP_NOT)
+            BINARY_INFIX_OP(TOKEN_BANG_EQUAL, PREC_EQUALITY, OP_NOT_EQUAL)
+            BINARY_INFIX_OP(TOKEN_GREATER_EQUAL, PREC_COMPARISON, OP_GREATER_EQUAL)
+            BINARY_INFIX_OP(TOKEN_LESS_EQUAL, PREC_COMPARISON, OP_LESS_EQUAL)
             case TOKEN_EQUAL:
                 errorAt(current, "Invalid assignment target.");
                 return;
             case TOKEN_LEFT_SQUARE_BRACKET:
                 if (precedence > PREC_INDEX) return;
                 advance();  // consume [
-                sequenceSliceExpression();
+                sequenceSliceExpression(canAssign);
                 break;
             case TOKEN_AND: {
                 advance();
@@ -183,13 +175,15 @@ void Compiler::parsePrecedence(Precedence precedence){
 
                 if (canAssign && match(TOKEN_EQUAL)) {
                     expression();
-                    emitBytes(OP_SET_PROPERTY, nameId);
+                    emitIndexed(OP_SET_PROPERTY, nameId);
                 } else if (match(TOKEN_LEFT_PAREN)) {  // Fast path for direct method call
                     int args = argumentList();
-                    emitBytes(OP_INVOKE, nameId);
+                    emitIndexed(OP_INVOKE, nameId);
                     emitByte(args);
+                    emitInlineCache();
                 } else {
-                    emitBytes(OP_GET_PROPERTY, nameId);
+                    emitIndexed(OP_GET_PROPERTY, nameId);
+                    emitInlineCache();
                 }
                 break;
             }
@@ -200,7 +194,6 @@ void Compiler::parsePrecedence(Precedence precedence){
 
 #undef BINARY_INFIX_OP
 #undef LITERAL
-#undef DOUBLE_BINARY_INFIX_OP
 }
 
 Token Compiler::syntheticToken(const char* name) {
@@ -223,17 +216,16 @@ void Compiler::superAccess() {
     if (match(TOKEN_LEFT_PAREN)) {  // Fast path for direct method call
         int args = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, methodNameId);
+        emitIndexed(OP_SUPER_INVOKE, methodNameId);
         emitByte(args);
     } else {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, methodNameId);
+        emitIndexed(OP_GET_SUPER, methodNameId);
     }
 }
 
-// TODO: should be easy to extend this with write opcodes instead of the read ones.
 // Expects '[' already consumed.
-void Compiler::sequenceSliceExpression(){
+void Compiler::sequenceSliceExpression(bool canAssign){
     if (check(TOKEN_COLON)){  // no starting index. default to beginning of sequence
         emitConstantAccess(NUMBER_VAL(0));
     } else {
@@ -248,12 +240,53 @@ void Compiler::sequenceSliceExpression(){
             consume(TOKEN_RIGHT_SQUARE_BRACKET, "Expect ']' after sequence slice");
         }
         emitByte(OP_SLICE_INDEX);
-    } else {  // just access the one index
+    } else {  // just the one index
         consume(TOKEN_RIGHT_SQUARE_BRACKET, "Expect ']' after sequence index");
-        emitByte(OP_ACCESS_INDEX);
+        if (canAssign && match(TOKEN_EQUAL)) {
+            expression();
+            emitByte(OP_SET_INDEX);
+        } else {
+            emitByte(OP_ACCESS_INDEX);
+        }
     }
 }
 
+// Expects '[' already consumed. The items go on the stack and OP_BUILD_LIST collects them.
+void Compiler::listLiteral(){
+    int count = 0;
+    if (!check(TOKEN_RIGHT_SQUARE_BRACKET)){
+        do {
+            if (check(TOKEN_RIGHT_SQUARE_BRACKET)) break;  // trailing comma
+            if (count >= 255) {
+                errorAt(current, "Can't have more than 255 items in a list literal.");
+            }
+            expression();
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_SQUARE_BRACKET, "Expect ']' after list items.");
+    emitBytes(OP_BUILD_LIST, count);
+}
+
+// Expects '{' already consumed. A '{' that starts a statement is a block so this is only reached inside an expression.
+void Compiler::mapLiteral(){
+    int count = 0;
+    if (!check(TOKEN_RIGHT_BRACE)){
+        do {
+            if (check(TOKEN_RIGHT_BRACE)) break;  // trailing comma
+            if (count >= 255) {
+                errorAt(current, "Can't have more than 255 entries in a map literal.");
+            }
+            expression();  // key
+            consume(TOKEN_COLON, "Expect ':' after map key.");
+            expression();  // value
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+    emitBytes(OP_BUILD_MAP, count);
+}
+
 // Grouping exists to change precedence but doesn't actually have a unique runtime representation.
 void Compiler::grouping(){
     expression();
@@ -262,13 +295,23 @@ void Compiler::grouping(){
 
 
 void Compiler::emitConstantAccess(Value value){
+    int start = currentChunk()->getCodeSize();
+    int addedConstant = -1;
     // just in-case I call this by accident instead of writing the opcode myself.
     if (IS_BOOL(value)) AS_BOOL(value) ? emitByte(OP_TRUE) : emitByte(OP_FALSE);
     else if (IS_NIL(value)) emitByte(OP_NIL);
     else {
+        int constantsBefore = currentChunk()->getConstantsSize();
         const_index_t location = currentChunk()->addConstant(value, gc);
-        emitBytes(OP_GET_CONSTANT, location);
+        if (currentChunk()->getConstantsSize() != constantsBefore) addedConstant = (int) location;
+        if (location <= UINT8_MAX) {
+            emitBytes(OP_GET_CONSTANT, location);
+        } else {
+            emitByte(OP_GET_CONSTANT_LONG);
+            writeWide(-1, location);
+        }
     }
+    rememberConstant(start, value, addedConstant);
 }
 
 int Compiler::parseLocalVariable(const char* errorMessage) {
@@ -283,7 +326,7 @@ int Compiler::parseLocalVariable(const char* errorMessage) {
 // Must call defineLocalVariable after.
 // They're separate for preventing self reference in a definition
 int Compiler::makeLocal(Token name) {
-    if (getLocals().count >= 256) {  // TODO: another opcode for more but that means i have to grow the stack as well
+    if (getLocals().count >= LOCALS_MAX) {
         errorAt(previous, "Too many local variables in function.");
         return -1;
     }
@@ -305,6 +348,8 @@ int Compiler::makeLocal(Token name) {
     }
 
     getLocals().push(local, gc);
+    ObjFunction* function = functionStack.peekLast().function;
+    function->maxLocals = std::max(function->maxLocals, (int) getLocals().count);
 
     return (int) getLocals().count - 1;
 }
@@ -345,7 +390,6 @@ const_index_t Compiler::identifierConstant(Token name) {
 }
 
 void Compiler::namedVariable(Token name, bool canAssign) {
-    // TODO: need another opcode if i grow the stack and allow >256 variableStack
     int local = resolveLocal(functionStack.peekLast(), name);
 
     OpCode set_op = OP_SET_LOCAL;
@@ -366,15 +410,18 @@ void Compiler::namedVariable(Token name, bool canAssign) {
     // If the variable is inside a high precedence expression, it has to be a get not a set.
     // Like a * b = c should be a syntax error not parse as a * (b = c).
     if (canAssign && match(TOKEN_EQUAL)){
-        Local& variable = getLocals().peek(local);
-        if (variable.assignments++ != 0 && variable.isFinal) {
-            errorAt(previous, "Cannot assign to final variable.");
-            return;
+        // An upvalue index isn't a slot in this function's locals so only locals are checked here.
+        if (set_op == OP_SET_LOCAL) {
+            Local& variable = getLocals().peek(local);
+            if (variable.assignments++ != 0 && variable.isFinal) {
+                errorAt(previous, "Cannot assign to final variable.");
+                return;
+            }
         }
         expression();
-        emitBytes(set_op, local);
+        emitIndexed(set_op, local);
     } else {
-        emitBytes(get_op, local);
+        emitIndexed(get_op, local);
     }
 }
 
@@ -386,19 +433,19 @@ int Compiler::resolveUpvalue(int funcIndex, Token* name) {
     int local = resolveLocal(functionStack[funcIndex - 1], *name);
     if (local != -1){
         (*functionStack[funcIndex - 1].variableStack)[local].isCaptured = true;
-        return addUpvalue(*currentFunc, (uint8_t)local, true);
+        return addUpvalue(*currentFunc, local, true);
     }
 
     int upvalue = resolveUpvalue(funcIndex - 1, name);
     if (upvalue != -1) {
-        return addUpvalue(*currentFunc, (uint8_t)upvalue, false);
+        return addUpvalue(*currentFunc, upvalue, false);
     }
 
     // got to the main script without finding it.
     return -1;
 }
 
-int Compiler::addUpvalue(TargetFunction& func, uint8_t index, bool isLocal) {
+int Compiler::addUpvalue(TargetFunction& func, int index, bool isLocal) {
     for (int i=0;i<func.upvalues->count;i++) {
         Upvalue val = (*func.upvalues)[i];
         if (val.index == index && val.isLocal == isLocal) {
@@ -406,12 +453,12 @@ int Compiler::addUpvalue(TargetFunction& func, uint8_t index, bool isLocal) {
         }
     }
 
+    if (func.function->upvalueCount > WIDE_OPERAND_MAX) {
+        errorAt(previous, "Too many closure variables in function.");
+        return 0;
+    }
     Upvalue val = { index, isLocal };
     func.upvalues->push(val, gc);
-    if (func.function->upvalueCount >= 255) {  // TODO
-        cerr << "Too many up values. Need bigger index!" << endl;
-        exit(65);
-    }
     return func.function->upvalueCount++;
 }
 
@@ -442,6 +489,12 @@ void Compiler::functionExpression(FunctionType funcType, ObjString* name){
 
     // scope not closed. return implicitly pops everything
     emitEmptyReturn();
+    if (!hadError) {
+        peepholeOptimize(currentChunk());
+        translateToRegisters(currentChunk(), func->arity + 1);  // the closure or receiver then the arguments
+        fuseSuperinstructions(currentChunk());
+    }
+    currentChunk()->setDone(gc);
 
 #ifdef COMPILER_DEBUG_PRINT_CODE
     debugger.setChunk(currentChunk());
@@ -451,16 +504,27 @@ void Compiler::functionExpression(FunctionType funcType, ObjString* name){
     TargetFunction target = functionStack.pop();
 
     const_index_t location = currentChunk()->addConstant(OBJ_VAL(func), gc);
-    emitBytes(OP_CLOSURE, location);
-
     if (target.upvalues->count != target.function->upvalueCount) {
         errorAt(t, "ICE. Incorrect upvalue count");
     }
 
+    // Either every index fits in a byte or they're all three bytes.
+    bool wide = location > UINT8_MAX;
+    for (int i=0;i<func->upvalueCount;i++) {
+        if ((*target.upvalues)[i].index > UINT8_MAX) wide = true;
+    }
+    if (wide) {
+        emitBytes(OP_WIDE, OP_CLOSURE);
+        writeWide(-1, location);
+    } else {
+        emitBytes(OP_CLOSURE, location);
+    }
+
     for (int i=0;i<func->upvalueCount;i++) {
         Upvalue val = (*target.upvalues)[i];
         emitByte(val.isLocal ? 1 : 0);
-        emitByte(val.index);
+        if (wide) writeWide(-1, val.index);
+        else emitByte(val.index);
     }
 }
 
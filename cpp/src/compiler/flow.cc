@@ -121,9 +121,8 @@ void Compiler::pushActiveLoop(){
 }
 
 // Call at the location 'continue' should return to.
-// Must be called after getJumpTarget.
 void Compiler::setContinueTarget(){
-    loopStack.peekLast()->continueTargetPosition = currentChunk()->getCodeSize();
+    loopStack.peekLast()->continueTargetPosition = getJumpTarget();
 }
 
 // Call at the location 'break' should skip to.
@@ -136,64 +135,76 @@ void Compiler::setBreakTargetAndPopActiveLoop(){
     }
     for (int i=0;i<ctx->continueStatementPositions.count;i++){
         int fromLocation = ctx->continueStatementPositions[i];
-        int jumpDistance = ctx->continueTargetPosition - fromLocation - 2;
-        OpCode jumpType = OP_JUMP;
+        int jumpDistance = ctx->continueTargetPosition - fromLocation - 3;
+        OpCode jumpType = OP_JUMP_LONG;
         if (jumpDistance < 0){
             jumpDistance *= -1;
-            jumpType = OP_LOOP;
+            jumpType = OP_LOOP_LONG;
         }
-        if (jumpDistance > UINT16_MAX) {
-            errorAt(current, "Too much code to jump over.");  // TODO: long jump
+        if (jumpDistance > WIDE_OPERAND_MAX) {
+            errorAt(current, "Too much code to jump over.");
         }
         currentChunk()->setCodeAt(fromLocation - 1, jumpType);
-        writeShort(fromLocation, jumpDistance);
+        writeWide(fromLocation, jumpDistance);
     }
+    ctx->breakStatementPositions.release(gc);
+    ctx->continueStatementPositions.release(gc);
     delete ctx;
 }
 
-// Called to jump FROM the current location
+// Called to jump FROM the current location. <instruction> is one of the _LONG jumps since how far it goes isn't known yet.
+// Compiler::peepholeOptimize turns the ones that don't need it back into the short form.
 int Compiler::emitJump(OpCode instruction) {
     emitByte(instruction);
-    emitBytes(0xff, 0xff);
-    return getJumpTarget() - 2;
+    writeWide(-1, 0xffffff);
+    return getJumpTarget() - 3;
 }
 
 // Called to jump TO the current location
 // <fromLocation> is the location that we're jumping FROM, where we'll patch in the current location in the bytecode
 void Compiler::patchJump(int fromLocation) {
-    int jumpDistance = getJumpTarget() - fromLocation - 2;
-    if (jumpDistance > UINT16_MAX) {
-        errorAt(current, "Too much code to jump over.");  // TODO: long jump
+    int jumpDistance = getJumpTarget() - fromLocation - 3;
+    if (jumpDistance > WIDE_OPERAND_MAX) {
+        errorAt(current, "Too much code to jump over.");
     }
-    writeShort(fromLocation, jumpDistance);
+    writeWide(fromLocation, jumpDistance);
 }
 
 int Compiler::emitJumpIfTrue() {
-    int jumpOverSkip = emitJump(OP_JUMP_IF_FALSE);
-    int skip = emitJump(OP_JUMP);
+    int jumpOverSkip = emitJump(OP_JUMP_IF_FALSE_LONG);
+    int skip = emitJump(OP_JUMP_LONG);
     patchJump(jumpOverSkip);
     return skip;
 }
 
 int Compiler::emitJumpIfFalse() {
-    return emitJump(OP_JUMP_IF_FALSE);
+    return emitJump(OP_JUMP_IF_FALSE_LONG);
 }
 
 int Compiler::emitJumpUnconditionally() {
-    return emitJump(OP_JUMP);
+    return emitJump(OP_JUMP_LONG);
 }
 
 // TODO: detect if jumping over buffer boundary and throw error. jumping within is fine cause its a delta
+// Something might jump here so constants before this point can't be folded with code after it.
 int Compiler::getJumpTarget(){
+    forgetConstants();
     return currentChunk()->getCodeSize();
 }
 
+// Unlike the forwards jumps, the distance is already known so the short form is used if it fits.
 void Compiler::patchLoop(int loopStart) {
-    emitByte(OP_LOOP);
-    int jumpDistance = getJumpTarget() - loopStart + 2;
-    if (jumpDistance > UINT16_MAX) {
-        errorAt(current, "Too much code to jump over.");  // TODO: long jump
+    int jumpDistance = getJumpTarget() - loopStart + 3;
+    if (jumpDistance <= UINT16_MAX) {
+        emitByte(OP_LOOP);
+        writeShort(-1, jumpDistance);
+        return;
     }
 
-    writeShort(-1, jumpDistance);
+    jumpDistance++;
+    if (jumpDistance > WIDE_OPERAND_MAX) {
+        errorAt(current, "Too much code to jump over.");
+    }
+    emitByte(OP_LOOP_LONG);
+    writeWide(-1, jumpDistance);
 }
@@ -0,0 +1,107 @@
+#include "compiler.h"
+#include <cmath>
+
+// The compiler keeps track of the run of constants at the end of the chunk it's writing.
+// When an operator comes right after its operands and they're all still in that run,
+// it does the work now and pushes the answer instead. So 60 * 60 * 24 is one constant and -1 doesn't need an OP_NEGATE.
+// Results are chained so a whole expression of literals folds down to a single value.
+// Anything that would be a runtime error (like 1 + "a") is left alone so it still happens at runtime.
+// There's no simplification like x * 1 => x because that would skip the error when x isn't a number.
+
+void Compiler::rememberConstant(int start, Value value, int addedConstant) {
+    if (bufferStack.count != 0) return;  // the chunk positions don't mean anything for code in a buffer
+    if (!foldableConstants.empty() && foldableConstants.back().end != start) foldableConstants.clear();
+    foldableConstants.push_back({start, currentChunk()->getCodeSize(), value, addedConstant});
+}
+
+// Called whenever a jump might land at the current position (something else could be on the stack by then)
+// or the compiler switches chunks.
+void Compiler::forgetConstants() {
+    foldableConstants.clear();
+}
+
+// The run is always contiguous so if it ends right here, the last <count> constants are the operands.
+bool Compiler::hasConstantOperands(int count) {
+#ifdef COMPILER_NO_CONSTANT_FOLDING
+    return false;
+#else
+    if (bufferStack.count != 0 || (int) foldableConstants.size() < count) return false;
+    return foldableConstants.back().end == currentChunk()->getCodeSize();
+#endif
+}
+
+// A constant only the folded code used would be left in the chunk for nothing and push later ones towards the _LONG instructions.
+// If the operand added it and nothing has been added since, nothing else can refer to it.
+// Operands must be dropped newest first.
+void Compiler::dropConstant(FoldableConstant operand) {
+    if (operand.addedConstant != -1 && operand.addedConstant == currentChunk()->getConstantsSize() - 1) {
+        currentChunk()->popConstant();
+    }
+}
+
+// Returns true if the operator was folded and should not be emitted.
+bool Compiler::foldUnary(OpCode op) {
+    if (!hasConstantOperands(1)) return false;
+    FoldableConstant operand = foldableConstants.back();
+    Value value = operand.value;
+
+    Value result;
+    if (op == OP_NOT) {
+        result = BOOL_VAL(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)));
+    } else if (op == OP_NEGATE && IS_NUMBER(value)) {
+        result = NUMBER_VAL(-AS_NUMBER(value));
+    } else {
+        return false;
+    }
+
+    foldableConstants.pop_back();
+    dropConstant(operand);
+    currentChunk()->truncateCode(operand.start);
+    emitConstantAccess(result);
+    return true;
+}
+
+// Each case matches what VM::run does for the opcode.
+bool Compiler::foldBinary(OpCode op) {
+    if (!hasConstantOperands(2)) return false;
+    FoldableConstant right = foldableConstants[foldableConstants.size() - 1];
+    FoldableConstant left = foldableConstants[foldableConstants.size() - 2];
+    Value a = left.value;
+    Value b = right.value;
+
+    Value result;
+    if (op == OP_EQUAL) {
+        result = BOOL_VAL(valuesEqual(a, b));
+    } else if (op == OP_NOT_EQUAL) {
+        result = BOOL_VAL(!valuesEqual(a, b));
+    } else if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+        // The result is interned like any other string literal so it's shared with the same text anywhere else.
+        std::string chars = std::string(AS_CSTRING(a)) + AS_CSTRING(b);
+        result = createStringValue(chars.c_str(), (int) chars.length());
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        switch (op) {
+            case OP_ADD: result = NUMBER_VAL(x + y); break;
+            case OP_SUBTRACT: result = NUMBER_VAL(x - y); break;
+            case OP_MULTIPLY: result = NUMBER_VAL(x * y); break;
+            case OP_DIVIDE: result = NUMBER_VAL(x / y); break;
+            case OP_EXPONENT: result = NUMBER_VAL(pow(x, y)); break;
+            case OP_LESS: result = BOOL_VAL(x < y); break;
+            case OP_GREATER: result = BOOL_VAL(x > y); break;
+            case OP_LESS_EQUAL: result = BOOL_VAL(!(x > y)); break;
+            case OP_GREATER_EQUAL: result = BOOL_VAL(!(x < y)); break;
+            default: return false;
+        }
+    } else {
+        return false;
+    }
+
+    foldableConstants.pop_back();
+    foldableConstants.pop_back();
+    dropConstant(right);
+    dropConstant(left);
+    currentChunk()->truncateCode(left.start);
+    emitConstantAccess(result);
+    return true;
+}
@@ -0,0 +1,231 @@
+#include "compiler.h"
+
+// One instruction of a finished chunk while the peephole pass moves things around.
+typedef struct {
+    int offset;  // where it was in the original code. the operands are copied from there.
+    int length;
+    SourcePosition position;
+    byte op;
+    int target;  // index of the instruction a jump goes to. -1 if it's not a jump.
+    bool removed;
+} PeepholeInstruction;
+
+static bool isConditionalJump(byte op) {
+    return op == OP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_TRUE;
+}
+
+static bool isUnconditionalJump(byte op) {
+    return op == OP_JUMP || op == OP_LOOP;
+}
+
+// The compiler writes every forwards jump as the _LONG form since it doesn't know the distance yet.
+// The pass works with the short opcode and picks the form again when it writes the jump out.
+static byte shortJump(byte op) {
+    switch (op) {
+        case OP_JUMP_LONG: return OP_JUMP;
+        case OP_LOOP_LONG: return OP_LOOP;
+        case OP_JUMP_IF_FALSE_LONG: return OP_JUMP_IF_FALSE;
+        case OP_POP_JUMP_IF_FALSE_LONG: return OP_POP_JUMP_IF_FALSE;
+        case OP_POP_JUMP_IF_TRUE_LONG: return OP_POP_JUMP_IF_TRUE;
+        default: return op;
+    }
+}
+
+static byte longJump(byte op) {
+    switch (op) {
+        case OP_JUMP: return OP_JUMP_LONG;
+        case OP_LOOP: return OP_LOOP_LONG;
+        case OP_JUMP_IF_FALSE: return OP_JUMP_IF_FALSE_LONG;
+        case OP_POP_JUMP_IF_FALSE: return OP_POP_JUMP_IF_FALSE_LONG;
+        case OP_POP_JUMP_IF_TRUE: return OP_POP_JUMP_IF_TRUE_LONG;
+        default: return op;
+    }
+}
+
+static bool isConstant(byte op) {
+    return op == OP_GET_CONSTANT || op == OP_NIL || op == OP_TRUE || op == OP_FALSE;
+}
+
+// Things the compiler leaves behind because it only ever looks at one statement at a time.
+// - A jump to a jump goes straight to the final target.
+// - A jump to the very next instruction is removed.
+// - JUMP_IF_FALSE; POP where the target is also a POP becomes a single POP_JUMP_IF_FALSE.
+//   The condition of every if, while and for looks like that.
+// - NOT before a POP_JUMP_IF_* flips the jump instead. So does a POP_JUMP_IF_* that only skips over a JUMP.
+// - A POP_JUMP_IF_* on a constant always or never jumps.
+// - A value that's pushed and immediately popped is never pushed.
+// - Code nothing can reach is removed. That includes the POP on the false path of an if without an else
+//   (and the jump the then branch used to skip it) once POP_JUMP_IF_FALSE has taken over popping the condition.
+// Then the chunk is written out again with the jump distances and line table matching the new positions.
+// Any jump that went to a removed instruction goes to the next one that's left instead.
+// Each jump is written in the short form if its distance fits in two bytes and the _LONG form if not.
+void Compiler::peepholeOptimize(Chunk* chunk) {
+#ifndef COMPILER_NO_PEEPHOLE
+    int size = chunk->getCodeSize();
+    vector<SourcePosition> positions = chunk->positionOfEachByte();
+    if ((int) positions.size() < size) return;
+
+    vector<PeepholeInstruction> code;
+    vector<int> indexAt(size + 1, -1);
+    for (int offset=0; offset < size;){
+        int length = chunk->instructionLength(offset);
+        if (length <= 0) return;  // can't tell where the next instruction starts so leave it as is
+        indexAt[offset] = (int) code.size();
+        code.push_back({offset, length, positions[offset], shortJump(chunk->getCodePtr()[offset]), -1, false});
+        offset += length;
+    }
+    int count = (int) code.size();
+    indexAt[size] = count;
+
+    for (auto& instruction : code) {
+        int target = chunk->jumpTarget(instruction.offset);
+        if (target == -1) continue;
+        if (target < 0 || target > size || indexAt[target] == -1) return;
+        instruction.target = indexAt[target];
+    }
+
+    auto next = [&](int index) {
+        do index++; while (index < count && code[index].removed);
+        return index;
+    };
+    auto resolve = [&](int index) {
+        return index < count && code[index].removed ? next(index) : index;
+    };
+
+    // How many jumps land on each instruction. Kept up to date as jumps move so each rule can tell
+    // whether something other than the instruction before might run next.
+    vector<int> arrivals(count + 1, 0);
+    for (auto& instruction : code) {
+        if (instruction.target != -1) arrivals[instruction.target]++;
+    }
+    auto retarget = [&](int index, int target) {
+        arrivals[resolve(code[index].target)]--;
+        code[index].target = target;
+        arrivals[resolve(target)]++;
+    };
+    auto remove = [&](int index) {
+        if (code[index].target != -1) arrivals[resolve(code[index].target)]--;
+        code[index].removed = true;
+        arrivals[next(index)] += arrivals[index];
+        arrivals[index] = 0;
+    };
+    auto is = [&](int index, byte op) {
+        return index < count && code[index].op == op;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < count; i = next(i)) {
+            PeepholeInstruction& instruction = code[i];
+            int following = next(i);
+
+            if (instruction.target != -1) {
+                int target = resolve(instruction.target);
+                int hops = 0;
+                while (target < count && isUnconditionalJump(code[target].op) && target != i && hops < 16) {
+                    target = resolve(code[target].target);
+                    hops++;
+                }
+                // Conditional jumps can only go forwards. The code only gets shorter so anything in range before still is.
+                bool canReach = !isConditionalJump(instruction.op) || target > i;
+                int targetOffset = target < count ? code[target].offset : size;
+                if (target != resolve(instruction.target) && canReach && abs(targetOffset - instruction.offset) <= UINT16_MAX) {
+                    retarget(i, target);
+                    changed = true;
+                }
+            }
+
+            if (instruction.op == OP_JUMP && resolve(instruction.target) == following) {
+                remove(i);
+                changed = true;
+            } else if (instruction.op == OP_JUMP_IF_FALSE && is(following, OP_POP) && arrivals[following] == 0 && is(resolve(instruction.target), OP_POP)) {
+                instruction.op = OP_POP_JUMP_IF_FALSE;
+                remove(following);
+                retarget(i, next(resolve(instruction.target)));
+                changed = true;
+            } else if (instruction.op == OP_NOT && (is(following, OP_POP_JUMP_IF_FALSE) || is(following, OP_POP_JUMP_IF_TRUE)) && arrivals[following] == 0) {
+                code[following].op = code[following].op == OP_POP_JUMP_IF_FALSE ? OP_POP_JUMP_IF_TRUE : OP_POP_JUMP_IF_FALSE;
+                remove(i);
+                changed = true;
+            } else if ((instruction.op == OP_POP_JUMP_IF_FALSE || instruction.op == OP_POP_JUMP_IF_TRUE) && is(following, OP_JUMP) && arrivals[following] == 0
+                        && resolve(instruction.target) == next(following) && resolve(code[following].target) > i) {
+                // Like if (done) break;
+                instruction.op = instruction.op == OP_POP_JUMP_IF_FALSE ? OP_POP_JUMP_IF_TRUE : OP_POP_JUMP_IF_FALSE;
+                retarget(i, code[following].target);
+                remove(following);
+                changed = true;
+            } else if (isConstant(instruction.op) && (is(following, OP_POP_JUMP_IF_FALSE) || is(following, OP_POP_JUMP_IF_TRUE)) && arrivals[following] == 0) {
+                // Like the condition of while (true). Constants in the table can't be false or nil.
+                bool isTruthy = instruction.op == OP_TRUE || instruction.op == OP_GET_CONSTANT;
+                bool jumps = isTruthy == (code[following].op == OP_POP_JUMP_IF_TRUE);
+                if (jumps) code[following].op = OP_JUMP;
+                else remove(following);
+                remove(i);
+                changed = true;
+            } else if ((isConstant(instruction.op) || instruction.op == OP_GET_LOCAL || instruction.op == OP_GET_UPVALUE) && is(following, OP_POP) && arrivals[following] == 0) {
+                remove(i);
+                remove(following);
+                changed = true;
+            } else if (isUnconditionalJump(instruction.op) || instruction.op == OP_RETURN) {
+                while (following < count && arrivals[following] == 0) {
+                    remove(following);
+                    following = next(following);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Laid out with every jump long first. Shrinking any of them can only make the others shorter,
+    // so a jump that fits in the short form then still fits after the second layout.
+    vector<bool> isLong(count, true);
+    vector<int> newOffset(count + 1);
+    auto layout = [&]() {
+        int offset = 0;
+        for (int i=0;i<count;i++){
+            newOffset[i] = offset;
+            if (code[i].removed) continue;
+            offset += code[i].target == -1 ? code[i].length : (isLong[i] ? 4 : 3);
+        }
+        newOffset[count] = offset;
+    };
+    layout();
+    for (int i=0;i<count;i++){
+        if (code[i].removed || code[i].target == -1) continue;
+        int from = newOffset[i] + 3;
+        int to = newOffset[resolve(code[i].target)];
+        isLong[i] = abs(to - from) > UINT16_MAX;
+    }
+    layout();
+
+    vector<byte> original(chunk->getCodePtr(), chunk->getCodePtr() + size);
+    chunk->clearCode();
+    for (int i=0;i<count;i++){
+        PeepholeInstruction& instruction = code[i];
+        if (instruction.removed) continue;
+
+        if (instruction.target == -1) {
+            chunk->write(instruction.op, instruction.position, gc);
+            for (int j=1;j<instruction.length;j++){
+                chunk->write(original[instruction.offset + j], instruction.position, gc);
+            }
+            continue;
+        }
+
+        int from = chunk->getCodeSize() + (isLong[i] ? 4 : 3);
+        int to = newOffset[resolve(instruction.target)];
+        byte op = instruction.op;
+        if (isUnconditionalJump(op)) op = to >= from ? OP_JUMP : OP_LOOP;
+        int distance = to >= from ? to - from : from - to;
+        if (isLong[i]) {
+            chunk->write(longJump(op), instruction.position, gc);
+            chunk->write((distance >> 16) & 0xff, instruction.position, gc);
+        } else {
+            chunk->write(op, instruction.position, gc);
+        }
+        chunk->write((distance >> 8) & 0xff, instruction.position, gc);
+        chunk->write(distance & 0xff, instruction.position, gc);
+    }
+#endif
+}
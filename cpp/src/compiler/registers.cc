@@ -0,0 +1,432 @@
+#include "compiler.h"
+
+#ifdef VM_REGISTERS
+
+// Where the value at one position of the stack code's stack actually is while the register code is being written.
+// Pushing a local or a constant doesn't need an instruction, it just remembers where the value can be read from.
+typedef enum {
+    SLOT_VALUE,  // it's in the stack slot at that position
+    SLOT_LOCAL,  // it's in another slot (the operand), not copied yet
+    SLOT_CONSTANT,  // the operand is an index into the constants
+    SLOT_NIL,
+    SLOT_TRUE,
+    SLOT_FALSE,
+} SlotKind;
+
+typedef struct {
+    SlotKind kind;
+    int operand;
+} VirtualSlot;
+
+typedef struct {
+    vector<byte> bytes;
+    SourcePosition position;
+    int target;  // index of the stack instruction a jump goes to. -1 if it's not a jump.
+} RegisterInstruction;
+
+// How many values the instruction at <offset> leaves on the stack minus how many it takes.
+// Returns false for anything the translation doesn't understand.
+static bool stackEffect(Chunk* chunk, int offset, int* effect) {
+    byte* code = chunk->getCodePtr() + offset;
+    switch (code[0]) {
+        case OP_GET_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_GET_LENGTH:
+            *effect = 1;
+            return true;
+        case OP_SET_LOCAL:
+        case OP_SET_UPVALUE:
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_JUMP_IF_FALSE:
+        case OP_GET_PROPERTY:
+        case OP_DEBUG_BREAK_POINT:
+        case OP_EXIT_VM:
+            *effect = 0;
+            return true;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EXPONENT:
+        case OP_RETURN:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_ACCESS_INDEX:
+        case OP_CLOSE_UPVALUE:
+        case OP_SET_PROPERTY:
+        case OP_METHOD:
+        case OP_INHERIT:
+        case OP_GET_SUPER:
+            *effect = -1;
+            return true;
+        case OP_SLICE_INDEX:
+        case OP_SET_INDEX:
+            *effect = -2;
+            return true;
+        case OP_POP_MANY:
+        case OP_CALL:
+            *effect = -code[1];
+            return true;
+        case OP_BUILD_LIST:
+            *effect = 1 - code[1];
+            return true;
+        case OP_BUILD_MAP:
+            *effect = 1 - 2 * code[1];
+            return true;
+        case OP_INVOKE:
+            *effect = -code[2];
+            return true;
+        case OP_SUPER_INVOKE:
+            *effect = -code[2] - 1;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool fallsThrough(byte op) {
+    return op != OP_JUMP && op != OP_LOOP && op != OP_RETURN && op != OP_EXIT_VM;
+}
+
+// Rewrites a finished chunk of stack code (after the peephole pass) to use register instructions where it can.
+// The register for each position on the stack is just the slot the stack code would have used there,
+// so locals are already registers and anything left as a stack instruction finds its operands where it expects.
+// Values are only copied into their slot when something needs them there:
+// - a stack instruction (it also gets an OP_R_SET_TOP first if gc.stackTop isn't already right).
+// - a jump, or the start of code that something jumps to. At those points everything is in its slot and gc.stackTop is right.
+// - the local they came from is about to be assigned.
+// Assigning the result of an operator to a local makes the operator write straight to the local, so i = i + 1 is one OP_R_ADD_K.
+// Register instructions don't move gc.stackTop. Their results go in slots above it that the gc can't see, which is
+// fine because none of them allocate except string +. That one makes sure everything below it is really in its slot first
+// and has an extra operand for where the stack code had its operands, which it moves gc.stackTop over while it concatenates.
+// Leaves the chunk alone if it has a stack height that won't fit in a byte operand or anything else it doesn't understand.
+void Compiler::translateToRegisters(Chunk* chunk, int slotsAtEntry) {
+    int size = chunk->getCodeSize();
+    vector<SourcePosition> positions = chunk->positionOfEachByte();
+    if ((int) positions.size() < size) return;
+    byte* code = chunk->getCodePtr();
+
+    vector<int> offsets;
+    vector<int> indexAt(size + 1, -1);
+    for (int offset=0; offset < size;){
+        int length = chunk->instructionLength(offset);
+        if (length <= 0) return;
+        indexAt[offset] = (int) offsets.size();
+        offsets.push_back(offset);
+        offset += length;
+    }
+    int count = (int) offsets.size();
+    offsets.push_back(size);
+    indexAt[size] = count;
+
+    vector<int> targets(count, -1);
+    vector<bool> isJumpTarget(count + 1, false);
+    for (int i=0;i<count;i++){
+        int target = chunk->jumpTarget(offsets[i]);
+        if (target == -1) continue;
+        if (target < 0 || target > size || indexAt[target] == -1) return;
+        targets[i] = indexAt[target];
+        isJumpTarget[targets[i]] = true;
+    }
+
+    // The stack height before each instruction. -1 if nothing reaches it.
+    vector<int> heights(count + 1, -1);
+    vector<int> work = {0};
+    heights[0] = slotsAtEntry;
+    while (!work.empty()) {
+        int i = work.back();
+        work.pop_back();
+        if (i >= count) continue;
+
+        int effect;
+        if (!stackEffect(chunk, offsets[i], &effect)) return;
+        int after = heights[i] + effect;
+        if (after < 0 || after > UINT8_MAX) return;
+
+        vector<int> next;
+        if (fallsThrough(code[offsets[i]])) next.push_back(i + 1);
+        if (targets[i] != -1) next.push_back(targets[i]);
+        for (int j : next) {
+            if (heights[j] == -1) {
+                heights[j] = after;
+                work.push_back(j);
+            } else if (heights[j] != after) {
+                return;
+            }
+        }
+    }
+
+    vector<RegisterInstruction> out;
+    vector<int> labels(count + 1, -1);  // index in out where the code for each stack instruction starts
+    vector<VirtualSlot> stack;
+    int top = slotsAtEntry;  // what gc.stackTop will be, relative to the frame
+    int lastWrite = -1;  // index in out of the last instruction if its destination is the value on top of the stack
+    SourcePosition source = {0, 0};  // of the stack instruction being translated
+
+    auto emit = [&](vector<byte> bytes, int target = -1) {
+        out.push_back({bytes, source, target});
+        lastWrite = -1;
+    };
+    auto materialize = [&](int position) {
+        VirtualSlot& slot = stack[position];
+        byte at = position;
+        switch (slot.kind) {
+            case SLOT_VALUE: return;
+            case SLOT_LOCAL: emit({OP_R_MOVE, at, (byte) slot.operand}); break;
+            case SLOT_CONSTANT: emit({OP_R_LOAD_CONSTANT, at, (byte) slot.operand}); break;
+            case SLOT_NIL: emit({OP_R_LOAD_NIL, at}); break;
+            case SLOT_TRUE: emit({OP_R_LOAD_BOOL, at, 1}); break;
+            case SLOT_FALSE: emit({OP_R_LOAD_BOOL, at, 0}); break;
+        }
+        slot = {SLOT_VALUE, 0};
+    };
+    // Everything in its slot and gc.stackTop just above it, like the stack code would have it.
+    // A value that goes right at gc.stackTop uses the normal stack instruction to push it so gc.stackTop doesn't need fixing after.
+    auto sync = [&]() {
+        for (int position=0; position < (int) stack.size(); position++) {
+            VirtualSlot slot = stack[position];
+            if (position != top || slot.kind == SLOT_VALUE) {
+                materialize(position);
+                continue;
+            }
+            switch (slot.kind) {
+                case SLOT_LOCAL: emit({OP_GET_LOCAL, (byte) slot.operand}); break;
+                case SLOT_CONSTANT: emit({OP_GET_CONSTANT, (byte) slot.operand}); break;
+                case SLOT_NIL: emit({OP_NIL}); break;
+                case SLOT_TRUE: emit({OP_TRUE}); break;
+                default: emit({OP_FALSE}); break;
+            }
+            stack[position] = {SLOT_VALUE, 0};
+            top++;
+        }
+        if (top != (int) stack.size()) {
+            top = (int) stack.size();
+            emit({OP_R_SET_TOP, (byte) top});
+        }
+    };
+    // The slot an operand can be read from.
+    auto registerFor = [&](int position) {
+        if (stack[position].kind == SLOT_LOCAL) return (byte) stack[position].operand;
+        materialize(position);
+        return (byte) position;
+    };
+    auto pushResult = [&](vector<byte> bytes) {
+        emit(bytes);
+        stack.push_back({SLOT_VALUE, 0});
+        lastWrite = (int) out.size() - 1;
+    };
+
+    stack.assign(slotsAtEntry, {SLOT_VALUE, 0});
+    bool reachable = false;
+    for (int i=0;i<count;i++){
+        if (heights[i] == -1) {
+            reachable = false;
+            continue;
+        }
+        if (isJumpTarget[i]) {
+            if (reachable) sync();
+            labels[i] = (int) out.size();
+            stack.assign(heights[i], {SLOT_VALUE, 0});
+            top = heights[i];
+            lastWrite = -1;
+        }
+        if ((int) stack.size() != heights[i]) return;
+        reachable = true;
+
+        source = positions[offsets[i]];
+        byte* instruction = code + offsets[i];
+        byte op = instruction[0];
+        int height = (int) stack.size();
+        switch (op) {
+            case OP_GET_LOCAL: {
+                byte local = instruction[1];
+                if (local >= height) return;
+                materialize(local);
+                stack.push_back({SLOT_LOCAL, local});
+                break;
+            }
+            case OP_GET_CONSTANT:
+                stack.push_back({SLOT_CONSTANT, instruction[1]});
+                break;
+            case OP_NIL:
+                stack.push_back({SLOT_NIL, 0});
+                break;
+            case OP_TRUE:
+                stack.push_back({SLOT_TRUE, 0});
+                break;
+            case OP_FALSE:
+                stack.push_back({SLOT_FALSE, 0});
+                break;
+            case OP_SET_LOCAL: {
+                byte local = instruction[1];
+                int value = height - 1;
+                if (local >= value) return;
+
+                // Anything still pointing at the old value needs its own copy first.
+                for (int position=0; position < value; position++) {
+                    if (stack[position].kind == SLOT_LOCAL && stack[position].operand == local) materialize(position);
+                }
+
+                VirtualSlot slot = stack[value];
+                if (slot.kind == SLOT_VALUE && lastWrite != -1 && lastWrite == (int) out.size() - 1 && out[lastWrite].bytes[1] == value) {
+                    out[lastWrite].bytes[1] = local;  // the value was never needed in its own slot
+                    stack[value] = {SLOT_LOCAL, local};
+                } else {
+                    switch (slot.kind) {
+                        case SLOT_VALUE: emit({OP_R_MOVE, local, (byte) value}); break;
+                        case SLOT_LOCAL: emit({OP_R_MOVE, local, (byte) slot.operand}); break;
+                        case SLOT_CONSTANT: emit({OP_R_LOAD_CONSTANT, local, (byte) slot.operand}); break;
+                        case SLOT_NIL: emit({OP_R_LOAD_NIL, local}); break;
+                        case SLOT_TRUE: emit({OP_R_LOAD_BOOL, local, 1}); break;
+                        case SLOT_FALSE: emit({OP_R_LOAD_BOOL, local, 0}); break;
+                    }
+                }
+                stack[local] = {SLOT_VALUE, 0};
+                break;
+            }
+            case OP_GET_UPVALUE:
+                pushResult({OP_R_GET_UPVALUE, (byte) height, instruction[1]});
+                break;
+            case OP_SET_UPVALUE:
+                emit({OP_R_SET_UPVALUE, instruction[1], registerFor(height - 1)});
+                break;
+            case OP_POP:
+                stack.pop_back();
+                break;
+            case OP_POP_MANY:
+                stack.resize(height - instruction[1]);
+                break;
+            case OP_NEGATE:
+            case OP_NOT: {
+                byte source = registerFor(height - 1);
+                stack.pop_back();
+                pushResult({op == OP_NEGATE ? OP_R_NEGATE : OP_R_NOT, (byte) (height - 1), source});
+                break;
+            }
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_LESS:
+            case OP_GREATER:
+            case OP_LESS_EQUAL:
+            case OP_GREATER_EQUAL: {
+                byte registerOp;
+                switch (op) {
+                    case OP_ADD: registerOp = OP_R_ADD; break;
+                    case OP_SUBTRACT: registerOp = OP_R_SUBTRACT; break;
+                    case OP_MULTIPLY: registerOp = OP_R_MULTIPLY; break;
+                    case OP_DIVIDE: registerOp = OP_R_DIVIDE; break;
+                    case OP_EQUAL: registerOp = OP_R_EQUAL; break;
+                    case OP_NOT_EQUAL: registerOp = OP_R_NOT_EQUAL; break;
+                    case OP_LESS: registerOp = OP_R_LESS; break;
+                    case OP_GREATER: registerOp = OP_R_GREATER; break;
+                    case OP_LESS_EQUAL: registerOp = OP_R_LESS_EQUAL; break;
+                    default: registerOp = OP_R_GREATER_EQUAL; break;
+                }
+
+                int dest = height - 2;
+                if (op == OP_ADD) {
+                    // Concatenating can collect garbage.
+                    for (int position=0; position < dest; position++) materialize(position);
+                }
+                byte left = registerFor(dest);
+                vector<byte> bytes;
+                if (stack[dest + 1].kind == SLOT_CONSTANT) {
+                    bytes = {(byte) (registerOp + 1), (byte) dest, left, (byte) stack[dest + 1].operand};
+                } else {
+                    bytes = {registerOp, (byte) dest, left, registerFor(dest + 1)};
+                }
+                // Where the stack code had the operands. Still free even if the result ends up going straight to a local.
+                if (op == OP_ADD) bytes.push_back(dest);
+                stack.resize(dest);
+                pushResult(bytes);
+                break;
+            }
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_TRUE: {
+                byte condition = registerFor(height - 1);
+                stack.pop_back();
+                sync();
+                emit({op == OP_POP_JUMP_IF_FALSE ? OP_R_JUMP_IF_FALSE : OP_R_JUMP_IF_TRUE, condition, 0, 0}, targets[i]);
+                break;
+            }
+            case OP_RETURN:
+                emit({OP_R_RETURN, registerFor(height - 1)});
+                break;
+            case OP_JUMP:
+            case OP_LOOP:
+            case OP_JUMP_IF_FALSE:
+                sync();
+                emit({op, 0, 0}, targets[i]);
+                break;
+            default: {
+                // Everything else runs as a normal stack instruction.
+                sync();
+                int length = offsets[i + 1] - offsets[i];
+                emit(vector<byte>(instruction, instruction + length));
+                int effect;
+                stackEffect(chunk, offsets[i], &effect);
+                stack.assign(height + effect, {SLOT_VALUE, 0});
+                top = height + effect;
+                break;
+            }
+        }
+        reachable = fallsThrough(op);
+    }
+    labels[count] = (int) out.size();
+
+    vector<int> newOffset(out.size() + 1);
+    int offset = 0;
+    for (int i=0;i<(int) out.size();i++){
+        newOffset[i] = offset;
+        offset += (int) out[i].bytes.size();
+    }
+    newOffset[out.size()] = offset;
+
+    for (int i=0;i<(int) out.size();i++){
+        RegisterInstruction& instruction = out[i];
+        if (instruction.target == -1) continue;
+        if (labels[instruction.target] == -1) return;
+        int from = newOffset[i + 1];
+        int to = newOffset[labels[instruction.target]];
+        byte& op = instruction.bytes[0];
+        if (op == OP_JUMP || op == OP_LOOP) op = to >= from ? OP_JUMP : OP_LOOP;
+        else if (to < from) return;  // conditional jumps only go forwards
+        int distance = abs(to - from);
+        if (distance > UINT16_MAX) return;
+        instruction.bytes[instruction.bytes.size() - 2] = (distance >> 8) & 0xff;
+        instruction.bytes[instruction.bytes.size() - 1] = distance & 0xff;
+    }
+
+    chunk->clearCode();
+    for (auto& instruction : out) {
+        for (byte b : instruction.bytes) chunk->write(b, instruction.position, gc);
+    }
+}
+
+#else
+
+// Without VM_REGISTERS the VM can't run register instructions so the stack code is left alone.
+void Compiler::translateToRegisters(Chunk*, int) {}
+
+#endif
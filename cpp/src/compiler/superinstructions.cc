@@ -0,0 +1,49 @@
+#include "compiler.h"
+
+// Runs once a function's code is finished (after the peephole pass) so every jump has been patched.
+// Only the first byte of a sequence is rewritten. The rest stay where they were as the superinstruction's operands,
+// which means nothing moves and no jump distances or line numbers need fixing.
+// A sequence can't be fused if something jumps into the middle of it, since that code would have to keep running alone.
+void Compiler::fuseSuperinstructions(Chunk* chunk) {
+#ifndef COMPILER_NO_SUPERINSTRUCTIONS
+    int size = chunk->getCodeSize();
+    byte* code = chunk->getCodePtr();
+
+    vector<bool> isJumpTarget(size + 1, false);
+    for (int offset=0; offset < size;){
+        int length = chunk->instructionLength(offset);
+        if (length <= 0) return;  // can't tell where the next instruction starts so leave it as is
+
+        int target = chunk->jumpTarget(offset);
+        if (target >= 0 && target <= size) isJumpTarget[target] = true;
+        offset += length;
+    }
+
+    // Checks that each opcode is at its offset and that nothing jumps to any but the first.
+    // Each offset is only looked at once the one before matched, so it's always the start of an instruction.
+    auto sequence = [&](std::initializer_list<std::pair<int, OpCode>> ops) {
+        bool first = true;
+        for (auto op : ops) {
+            if (op.first >= size || code[op.first] != op.second) return false;
+            if (!first && isJumpTarget[op.first]) return false;
+            first = false;
+        }
+        return true;
+    };
+
+    for (int o=0; o < size; o += chunk->instructionLength(o)){
+        if (sequence({{o, OP_GET_LOCAL}, {o + 2, OP_GET_CONSTANT}, {o + 4, OP_LESS}, {o + 5, OP_POP_JUMP_IF_FALSE}})) {
+            code[o] = OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE;
+        } else if (sequence({{o, OP_GET_LOCAL}, {o + 2, OP_GET_CONSTANT}, {o + 4, OP_ADD}})) {
+            code[o] = OP_ADD_LOCAL_CONSTANT;
+        } else if (sequence({{o, OP_GET_LOCAL}, {o + 2, OP_GET_CONSTANT}, {o + 4, OP_SUBTRACT}})) {
+            code[o] = OP_SUBTRACT_LOCAL_CONSTANT;
+        } else if (sequence({{o, OP_GET_LOCAL}, {o + 2, OP_GET_LOCAL}}) && (o + 4 >= size || code[o + 4] != OP_GET_CONSTANT)) {
+            // Otherwise the second local is better off starting one of the local and constant ones above.
+            code[o] = OP_GET_LOCALS;
+        } else if (sequence({{o, OP_SET_LOCAL}, {o + 2, OP_POP}})) {
+            code[o] = OP_SET_LOCAL_POP;
+        }
+    }
+#endif
+}
@@ -27,7 +27,7 @@ void Compiler::synchronize() {
 
 void Compiler::emitByte(byte b){
     if (bufferStack.count == 0){
-        currentChunk()->write(b, current.line, gc);
+        currentChunk()->write(b, {previous.line, previous.col}, gc);  // the token the instruction came from, not the one after it
     } else {
         bufferStack.peekLast()->push(b, gc);
     }
@@ -38,6 +38,16 @@ void Compiler::emitBytes(byte byte1, byte byte2){
     emitByte(byte2);
 }
 
+// Emits <op> with <index> as its first operand. Behind OP_WIDE if it doesn't fit in a byte.
+void Compiler::emitIndexed(OpCode op, uint32_t index){
+    if (index <= UINT8_MAX) {
+        emitBytes(op, index);
+    } else {
+        emitBytes(OP_WIDE, op);
+        writeWide(-1, index);
+    }
+}
+
 void Compiler::advance(){
     previous = current;
     for (;;) {
@@ -96,6 +106,28 @@ void Compiler::writeShort(int offset, uint16_t v){
     }
 }
 
+// Three bytes for OP_WIDE and the _LONG instructions. Like writeShort, an offset of -1 emits them instead.
+void Compiler::writeWide(int offset, uint32_t v){
+    byte a = (v >> 16) & 0xff;
+    byte b = (v >> 8) & 0xff;
+    byte c = v & 0xff;
+    if (offset != -1){
+        currentChunk()->setCodeAt(offset, a);
+        currentChunk()->setCodeAt(offset + 1, b);
+        currentChunk()->setCodeAt(offset + 2, c);
+    } else {
+        emitBytes(a, b);
+        emitByte(c);
+    }
+}
+
+// The operand is an index into the chunk's side table of caches rather than the cache itself,
+// so the bytecode stays immutable while the vm fills in the caches.
+void Compiler::emitInlineCache(){
+    uint16_t index = currentChunk()->addInlineCache(gc);
+    writeShort(-1, index);
+}
+
 // TODO: Make sure this doesnt break and/or that jump within expressions. I think its fine because they're relative and never need to go across buffers.
 ArrayList<byte>* Compiler::pushBuffer(){
     ArrayList<byte>* buffer = new ArrayList<byte>();
@@ -65,6 +65,125 @@ int Debugger::invokeInstruction(const char* name, int offset) {
     return offset + 3;
 }
 
+// OP_INVOKE and OP_GET_PROPERTY have a two byte inline cache index after their normal operands.
+int Debugger::cachedInstruction(int offset) {
+    offset = chunk->getCodePtr()[offset] == OP_INVOKE ? invokeInstruction("OP_INVOKE", offset) : constantInstruction("OP_GET_PROPERTY", offset);
+    uint16_t index = (uint16_t)(chunk->getCodePtr()[offset] << 8);
+    index |= chunk->getCodePtr()[offset + 1];
+    fprintf(stderr, "%04d      |                     cache %d\n", offset, index);
+    return offset + 2;
+}
+
+// The operands of a superinstruction are spread out between the opcodes it replaced. See Compiler::fuseSuperinstructions.
+int Debugger::superInstruction(int offset) {
+    byte* code = chunk->getCodePtr() + offset;
+    const char* name = Chunk::opcodeNames[code[0]].c_str();
+    switch (code[0]) {
+        case OP_SET_LOCAL_POP:
+            fprintf(stderr, "%-16s %4d\n", name, code[1]);
+            break;
+        case OP_GET_LOCALS:
+            fprintf(stderr, "%-16s %4d %d\n", name, code[1], code[3]);
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            fprintf(stderr, "%-16s %4d '", name, code[1]);
+            printValue(chunk->getConstant(code[3]), &cerr);
+            cerr << "'" << endl;
+            break;
+        case OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE:
+            fprintf(stderr, "%-16s %4d '", name, code[1]);
+            printValue(chunk->getConstant(code[3]), &cerr);
+            fprintf(stderr, "' -> %d\n", chunk->jumpTarget(offset));
+            break;
+    }
+    return offset + chunk->instructionLength(offset);
+}
+
+// Three byte operands. OP_WIDE prints the instruction it widens after it.
+int Debugger::wideInstruction(int offset) {
+    byte* code = chunk->getCodePtr() + offset;
+    const char* name = Chunk::opcodeNames[code[0]].c_str();
+    int length = chunk->instructionLength(offset);
+    switch (code[0]) {
+        case OP_GET_CONSTANT_LONG:
+            fprintf(stderr, "%-16s %4d '", name, chunk->readWide(offset + 1));
+            printValue(chunk->getConstant(chunk->readWide(offset + 1)), &cerr);
+            cerr << "'" << endl;
+            break;
+        case OP_WIDE: {
+            byte op = code[1];
+            uint32_t index = chunk->readWide(offset + 2);
+            fprintf(stderr, "%-16s %-16s %4d", name, Chunk::opcodeNames[op].c_str(), index);
+            if (op == OP_GET_LOCAL || op == OP_SET_LOCAL || op == OP_GET_UPVALUE || op == OP_SET_UPVALUE) {
+                cerr << endl;
+                break;
+            }
+            cerr << " '";
+            printValue(chunk->getConstant(index), &cerr);
+            cerr << "'" << endl;
+            if (op == OP_CLOSURE) {
+                for (int i = offset + 5; i < offset + length; i += 4) {
+                    fprintf(stderr, "%04d      |                     %s %d\n", i, code[i - offset] ? "local" : "upvalue", chunk->readWide(i + 1));
+                }
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "%-16s %4d -> %d\n", name, offset, chunk->jumpTarget(offset));
+            break;
+    }
+    return offset + length;
+}
+
+// Slots print as r<n> so they're easy to tell apart from constants.
+int Debugger::registerInstruction(int offset) {
+    byte* code = chunk->getCodePtr() + offset;
+    byte op = code[0];
+    int length = chunk->instructionLength(offset);
+    fprintf(stderr, "%-16s", Chunk::opcodeNames[op].c_str());
+    switch (op) {
+        case OP_R_SET_TOP:
+            fprintf(stderr, " %d\n", code[1]);
+            return offset + length;
+        case OP_R_LOAD_BOOL:
+            fprintf(stderr, " r%d %s\n", code[1], code[2] ? "true" : "false");
+            return offset + length;
+        case OP_R_GET_UPVALUE:
+            fprintf(stderr, " r%d upvalue %d\n", code[1], code[2]);
+            return offset + length;
+        case OP_R_SET_UPVALUE:
+            fprintf(stderr, " upvalue %d r%d\n", code[1], code[2]);
+            return offset + length;
+        case OP_R_JUMP_IF_FALSE:
+        case OP_R_JUMP_IF_TRUE:
+            fprintf(stderr, " r%d -> %d\n", code[1], chunk->jumpTarget(offset));
+            return offset + length;
+        case OP_R_ADD:
+            fprintf(stderr, " r%d r%d r%d scratch r%d\n", code[1], code[2], code[3], code[4]);
+            return offset + length;
+        case OP_R_ADD_K:
+            fprintf(stderr, " r%d r%d '", code[1], code[2]);
+            printValue(chunk->getConstant(code[3]), &cerr);
+            fprintf(stderr, "' scratch r%d\n", code[4]);
+            return offset + length;
+    }
+
+    // The rest are a destination and then sources. Only the last can be a constant.
+    bool lastIsConstant = op == OP_R_LOAD_CONSTANT || Chunk::opcodeNames[op].back() == 'K';
+    for (int i=1;i<length;i++){
+        if (i == length - 1 && lastIsConstant) {
+            fprintf(stderr, " '");
+            printValue(chunk->getConstant(code[i]), &cerr);
+            fprintf(stderr, "'");
+        } else {
+            fprintf(stderr, " r%d", code[i]);
+        }
+    }
+    fprintf(stderr, "\n");
+    return offset + length;
+}
+
 int Debugger::debugInstruction(int offset){
     if (silent) return 0;
 
@@ -107,19 +226,33 @@ int Debugger::debugInstruction(int offset){
         SIMPLE(OP_EQUAL)
         SIMPLE(OP_GREATER)
         SIMPLE(OP_LESS)
+        SIMPLE(OP_NOT_EQUAL)
+        SIMPLE(OP_LESS_EQUAL)
+        SIMPLE(OP_GREATER_EQUAL)
+        SIMPLE(OP_ADD_NUM)
+        SIMPLE(OP_ADD_STR)
+        SIMPLE(OP_SUBTRACT_NUM)
+        SIMPLE(OP_MULTIPLY_NUM)
+        SIMPLE(OP_DIVIDE_NUM)
+        SIMPLE(OP_GREATER_NUM)
+        SIMPLE(OP_LESS_NUM)
+        SIMPLE(OP_LESS_EQUAL_NUM)
+        SIMPLE(OP_GREATER_EQUAL_NUM)
         SIMPLE(OP_DEBUG_BREAK_POINT)
         SIMPLE(OP_EXIT_VM)
         SIMPLE(OP_ACCESS_INDEX)
         SIMPLE(OP_SLICE_INDEX)
+        SIMPLE(OP_SET_INDEX)
         CONSTANT(OP_DEFINE_GLOBAL)
         CONSTANT(OP_GET_CONSTANT)
-        CONSTANT(OP_GET_PROPERTY)
         CONSTANT(OP_SET_PROPERTY)
         CONSTANT(OP_CLASS)
         CONSTANT(OP_METHOD)
         BYTE_ARG(OP_POP_MANY)
         BYTE_ARG(OP_CALL)
         BYTE_ARG(OP_GET_LENGTH)
+        BYTE_ARG(OP_BUILD_LIST)
+        BYTE_ARG(OP_BUILD_MAP)
         BYTE_ARG(OP_GET_LOCAL)
         BYTE_ARG(OP_SET_LOCAL)
         BYTE_ARG(OP_GET_UPVALUE)
@@ -133,6 +266,10 @@ int Debugger::debugInstruction(int offset){
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_POP_JUMP_IF_TRUE:
+            return jumpInstruction("OP_POP_JUMP_IF_TRUE", 1, chunk, offset);
         case OP_LOAD_INLINE_CONSTANT: {
             offset++;  // op
             unsigned char type = chunk->getCodePtr()[offset];
@@ -185,11 +322,27 @@ int Debugger::debugInstruction(int offset){
             return offset;
         }
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", offset);
+        case OP_GET_PROPERTY:
+            return cachedInstruction(offset);
 
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", offset);
+        case OP_GET_CONSTANT_LONG:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+        case OP_POP_JUMP_IF_TRUE_LONG:
+        case OP_WIDE:
+            return wideInstruction(offset);
+        case OP_SET_LOCAL_POP:
+        case OP_GET_LOCALS:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE:
+            return superInstruction(offset);
         default:
+            if (instruction >= OP_R_MOVE && instruction <= OP_R_SET_TOP) return registerInstruction(offset);
             cerr << "Unknown Opcode (index=" << offset << ", value=" << (int) instruction << ")" << endl;
             return offset + 1;
     }
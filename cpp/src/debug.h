@@ -22,6 +22,10 @@ private:
     int constantInstruction(const string& name, int offset);
     int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset);
     int invokeInstruction(const char* name, int offset);
+    int cachedInstruction(int offset);
+    int superInstruction(int offset);
+    int registerInstruction(int offset);
+    int wideInstruction(int offset);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,844 @@
+#include "jit.h"
+
+#ifdef VM_JIT
+#include "vm.h"
+#include <sys/mman.h>
+
+// A baseline template JIT. Once a function is hot, each of its instructions is translated on its own into x86-64 code
+// that does the same thing to the same value stack, so the gc and CallFrames can't tell the difference.
+// Only the common cases get machine code. Anything else (calls, returns, a type check failing, most object operations)
+// is an exit: it saves the stack top and returns the instruction's address so VM::run does it with the normal handler.
+// VM::run comes back in at calls, returns and loops, so a function can move between the two any number of times.
+
+// x86-64 register numbers.
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSI = 6, RDI = 7, R8 = 8, R12 = 12, R13 = 13, R14 = 14, R15 = 15 };
+
+// Where the machine code keeps the interpreter's state. All callee saved so the helpers it calls leave them alone.
+#define SLOTS RBX  // frame->slots
+#define TOP R12  // gc.stackTop. only written back before leaving or calling something that looks at it.
+#define TOP_ADDRESS R13  // &gc.stackTop
+#define VM_POINTER R14
+#define CLOSURE R15
+
+// Condition codes for jcc and setcc.
+enum { CC_B = 2, CC_E = 4, CC_NE = 5, CC_BE = 6, CC_A = 7 };
+
+// Going into the machine code and back out costs about as much as interpreting a few instructions.
+// So VM::run only goes in where at least this many run before the next exit, or where there's a jump that might loop.
+#define JIT_MIN_RUN 4
+
+#define VALUE_SIZE ((int) sizeof(Value))
+#ifdef NAN_BOXING
+#define PAYLOAD 0
+#define NIL_BITS (QNAN | TAG_NIL)
+#define FALSE_BITS (QNAN | TAG_FALSE)
+#else
+#define PAYLOAD ((int) offsetof(Value, as))
+#endif
+static_assert(sizeof(Value) % 8 == 0, "values are copied a word at a time");
+
+// Just the instructions the templates below need. Memory operands are always [base + disp].
+class Assembler {
+public:
+    vector<byte> code;
+
+    int position() {
+        return (int) code.size();
+    }
+
+    void emit(byte b) {
+        code.push_back(b);
+    }
+
+    void emit32(uint32_t value) {
+        for (int i=0;i<4;i++) emit((value >> (i * 8)) & 0xFF);
+    }
+
+    void emit64(uint64_t value) {
+        for (int i=0;i<8;i++) emit((value >> (i * 8)) & 0xFF);
+    }
+
+    // Points the rel32 at <at> (as returned by jump or jumpIf) to <target>.
+    void patch(int at, int target) {
+        uint32_t distance = (uint32_t) (target - (at + 4));
+        for (int i=0;i<4;i++) code[at + i] = (distance >> (i * 8)) & 0xFF;
+    }
+
+    void bind(int at) {
+        patch(at, position());
+    }
+
+    void push(int reg) {
+        if (reg >= 8) emit(0x41);
+        emit(0x50 | (reg & 7));
+    }
+
+    void pop(int reg) {
+        if (reg >= 8) emit(0x41);
+        emit(0x58 | (reg & 7));
+    }
+
+    void ret() {
+        emit(0xC3);
+    }
+
+    void load(int reg, int base, int disp) {  // mov reg, [base + disp]
+        op(true, 0x8B, reg, base, disp);
+    }
+
+    void load32(int reg, int base, int disp) {  // mov reg32, [base + disp]
+        op(false, 0x8B, reg, base, disp);
+    }
+
+    void store(int base, int disp, int reg) {  // mov [base + disp], reg
+        op(true, 0x89, reg, base, disp);
+    }
+
+    void storeImmediate(int base, int disp, int32_t value) {  // mov qword [base + disp], value
+        op(true, 0xC7, 0, base, disp);
+        emit32(value);
+    }
+
+    void compare32(int base, int disp, int8_t value) {  // cmp dword [base + disp], value
+        op(false, 0x83, 7, base, disp);
+        emit(value);
+    }
+
+    void compare8(int base, int disp, byte value) {  // cmp byte [base + disp], value
+        op(false, 0x80, 7, base, disp);
+        emit(value);
+    }
+
+    void lea(int reg, int base, int disp) {
+        op(true, 0x8D, reg, base, disp);
+    }
+
+    void moveImmediate(int reg, uint64_t value) {
+        rex(true, 0, reg);
+        emit(0xB8 | (reg & 7));
+        emit64(value);
+    }
+
+    void move(int dest, int src) {
+        registers(0x89, dest, src);
+    }
+
+    void add(int reg, int32_t value) {
+        if (value == 0) return;
+        rex(true, 0, reg);
+        emit(0x81);
+        direct(0, reg);
+        emit32(value);
+    }
+
+    void addRegisters(int dest, int src) {
+        registers(0x01, dest, src);
+    }
+
+    void subtractRegisters(int dest, int src) {
+        registers(0x29, dest, src);
+    }
+
+    void andRegisters(int dest, int src) {
+        registers(0x21, dest, src);
+    }
+
+    void xorRegisters(int dest, int src) {
+        registers(0x31, dest, src);
+    }
+
+    void compare(int a, int b) {  // cmp a, b
+        registers(0x39, a, b);
+    }
+
+    void compareImmediate32(int reg, int8_t value) {  // cmp reg32, value
+        rex(false, 0, reg);
+        emit(0x83);
+        direct(7, reg);
+        emit(value);
+    }
+
+    void compareImmediate(int reg, int8_t value) {  // cmp reg, value
+        rex(true, 0, reg);
+        emit(0x83);
+        direct(7, reg);
+        emit(value);
+    }
+
+    void clearEax() {  // xor eax, eax
+        emit(0x31);
+        emit(0xC0);
+    }
+
+    void setIf(int cc) {  // setcc al
+        emit(0x0F);
+        emit(0x90 | cc);
+        emit(0xC0);
+    }
+
+    void zeroExtendAl() {  // movzx eax, al
+        emit(0x0F);
+        emit(0xB6);
+        emit(0xC0);
+    }
+
+    void flipAl() {  // xor al, 1
+        emit(0x34);
+        emit(0x01);
+    }
+
+    void testAl() {  // test al, al
+        emit(0x84);
+        emit(0xC0);
+    }
+
+    int jump() {
+        emit(0xE9);
+        emit32(0);
+        return position() - 4;
+    }
+
+    int jumpIf(int cc) {
+        emit(0x0F);
+        emit(0x80 | cc);
+        emit32(0);
+        return position() - 4;
+    }
+
+    void jumpTo(int target) {
+        patch(jump(), target);
+    }
+
+    void jumpRegister(int reg) {  // jmp reg
+        rex(false, 0, reg);
+        emit(0xFF);
+        direct(4, reg);
+    }
+
+    void call(void* function) {
+        moveImmediate(RAX, (uint64_t) function);
+        emit(0xFF);  // call rax
+        emit(0xD0);
+    }
+
+    // Only xmm0-xmm7 so they never need a REX prefix of their own.
+    void loadDouble(int xmm, int base, int disp) {  // movsd xmm, [base + disp]
+        sse(0xF2, 0x10, xmm, base, disp);
+    }
+
+    void storeDouble(int base, int disp, int xmm) {  // movsd [base + disp], xmm
+        sse(0xF2, 0x11, xmm, base, disp);
+    }
+
+    void moveToDouble(int xmm, int reg) {  // movq xmm, reg
+        emit(0x66);
+        rex(true, xmm, reg);
+        emit(0x0F);
+        emit(0x6E);
+        direct(xmm, reg);
+    }
+
+    void doubles(byte opcode, int a, int b) {  // addsd/subsd/mulsd/divsd a, b
+        emit(0xF2);
+        emit(0x0F);
+        emit(opcode);
+        direct(a, b);
+    }
+
+    void compareDoubles(int a, int b) {  // ucomisd a, b. unordered sets ZF, PF and CF.
+        emit(0x66);
+        emit(0x0F);
+        emit(0x2E);
+        direct(a, b);
+    }
+
+private:
+    void rex(bool wide, int reg, int base) {
+        byte prefix = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+        if (prefix != 0x40) emit(prefix);
+    }
+
+    void direct(int reg, int rm) {
+        emit(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    // ModRM for [base + disp]. rsp/r12 as the base need a SIB byte and rbp/r13 can't go without a displacement.
+    void memory(int reg, int base, int disp) {
+        byte mod = disp == 0 && (base & 7) != 5 ? 0 : (disp >= -128 && disp <= 127 ? 1 : 2);
+        emit((mod << 6) | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == 4) emit(0x24);
+        if (mod == 1) emit((byte) disp);
+        else if (mod == 2) emit32(disp);
+    }
+
+    void op(bool wide, byte opcode, int reg, int base, int disp) {
+        rex(wide, reg, base);
+        emit(opcode);
+        memory(reg, base, disp);
+    }
+
+    void registers(byte opcode, int rm, int reg) {
+        rex(true, reg, rm);
+        emit(opcode);
+        direct(reg, rm);
+    }
+
+    void sse(byte prefix, byte opcode, int xmm, int base, int disp) {
+        emit(prefix);
+        rex(false, xmm, base);
+        emit(0x0F);
+        emit(opcode);
+        memory(xmm, base, disp);
+    }
+};
+
+// Helpers the machine code calls for things that aren't worth writing out in assembly.
+
+static bool valuesEqualAt(Value* operands) {
+    return valuesEqual(operands[0], operands[1]);
+}
+
+static void getUpvalue(ObjClosure* closure, int slot, Value* dest) {
+    *dest = *closure->upvalues[slot]->location;
+}
+
+static void setUpvalue(VM* vm, ObjClosure* closure, int slot, Value* value) {
+    ObjUpvalue* upvalue = closure->upvalues[slot];
+    *upvalue->location = *value;
+    vm->gc.writeBarrier((Obj*) upvalue, *value);
+}
+
+static void closeUpvalue(VM* vm, Value* local) {
+    vm->closeUpvalues(local);
+}
+
+static void print(VM* vm, Value* value) {
+    printValue(*value, vm->out);
+    *vm->out << '\n';
+    vm->afterPrint();
+}
+
+// Only a hit on a field. Misses and methods go back to the interpreter which fills the cache for next time.
+static bool getCachedField(Value* top, InlineCache* cache) {
+    Value receiver = top[-1];
+    if (!IS_INSTANCE(receiver)) return false;
+    ObjInstance* inst = AS_INSTANCE(receiver);
+    if (cache->shape != inst->shape || inst->shape == nullptr || cache->method != nullptr) return false;
+    #ifdef VM_INLINE_CACHE_STATS
+    VM::inlineCacheHits++;
+    #endif
+    top[-1] = inst->fields[cache->fieldSlot];
+    return true;
+}
+
+// Can allocate so the machine code writes back gc.stackTop first.
+static bool setProperty(VM* vm, ObjString* name) {
+    Value* top = vm->gc.stackTop;
+    if (!IS_INSTANCE(top[-2])) return false;
+    Value value = top[-1];
+    vm->gc.setField(AS_INSTANCE(top[-2]), name, value);
+    vm->gc.stackTop[-2] = value;
+    vm->gc.stackTop--;
+    return true;
+}
+
+// Only an in bounds index into a list, string or view, or a key that's in a map. Ropes, negative indexes and errors go back to the interpreter.
+static bool getIndex(Value* top, VM* vm) {
+    if (IS_MAP(top[-2])) return AS_MAP(top[-2])->table->get(top[-1], &top[-2]);
+    if (IS_NUMBER(top[-1]) && IS_OBJ(top[-2]) && (OBJ_TYPE(top[-2]) == OBJ_STRING || OBJ_TYPE(top[-2]) == OBJ_STRING_VIEW)) {
+        Obj* text = skipFlattened(AS_OBJ(top[-2]));
+        int index = AS_NUMBER(top[-1]);
+        if ((uint32_t) index >= stringLength(text)) return false;
+        top[-2] = OBJ_VAL(vm->gc.singleChars[(uint8_t) stringChars(text)[index]]);
+        return true;
+    }
+    if (!IS_NUMBER(top[-1]) || !IS_LIST(top[-2])) return false;
+    ObjList* list = AS_LIST(top[-2]);
+    int index = AS_NUMBER(top[-1]);
+    if ((uint32_t) index >= list->values.count) return false;
+    top[-2] = list->values.data[index];
+    return true;
+}
+
+// A map can grow so the machine code writes back gc.stackTop first.
+static bool setIndex(VM* vm) {
+    Value* top = vm->gc.stackTop;
+    if (IS_MAP(top[-3])) {
+        top[-2] = vm->gc.flatten(top[-2]);
+        if (!ValueTable::isValidKey(top[-2])) return false;
+        AS_MAP(top[-3])->table->set(top[-2], top[-1]);
+    } else if (IS_NUMBER(top[-2]) && IS_LIST(top[-3])) {
+        ObjList* list = AS_LIST(top[-3]);
+        int index = AS_NUMBER(top[-2]);
+        if ((uint32_t) index >= list->values.count) return false;
+        list->values.data[index] = top[-1];
+        vm->gc.writeBarrier((Obj*) list, top[-1]);
+    } else {
+        return false;
+    }
+    top[-3] = top[-1];
+    vm->gc.stackTop -= 2;
+    return true;
+}
+
+class JitCompiler {
+public:
+    Assembler a;
+
+    explicit JitCompiler(Chunk* chunk) : chunk(chunk), bytecode(chunk->getCodePtr()) {}
+
+    // Fills in <isEntry> for each bytecode offset that's worth starting the machine code at.
+    bool compile(vector<int>& machineAt, vector<bool>& isEntry) {
+        int size = chunk->getCodeSize();
+        machineAt.assign(size + 1, -1);
+        isEntry.assign(size, false);
+
+        prologue();
+
+        vector<int> offsets;
+        vector<bool> compiled;
+        for (int offset=0; offset < size;){
+            int length = chunk->instructionLength(offset);
+            if (length <= 0) return false;
+            machineAt[offset] = a.position();
+            offsets.push_back(offset);
+            compiled.push_back(instruction(offset));
+            if (!compiled.back()) exitTo(offset);
+            offset += length;
+        }
+        machineAt[size] = a.position();
+        exitTo(size);
+
+        // How many instructions run in a row from each one before an exit, counting backwards from the end.
+        int run = 0;
+        for (int i=(int) offsets.size() - 1; i >= 0; i--){
+            if (!compiled[i]) run = 0;
+            else if (chunk->jumpTarget(offsets[i]) != -1) run = JIT_MIN_RUN;
+            else run++;
+            isEntry[offsets[i]] = run >= JIT_MIN_RUN;
+        }
+
+        for (auto& jump : jumps) {
+            if (jump.second < 0 || jump.second > size || machineAt[jump.second] == -1) return false;
+            a.patch(jump.first, machineAt[jump.second]);
+        }
+
+        // Exits from failed checks are out of the way at the end so the fast path falls straight through.
+        vector<int> stubAt(size + 1, -1);
+        for (auto& exit : exits) {
+            if (stubAt[exit.second] == -1) {
+                stubAt[exit.second] = a.position();
+                exitTo(exit.second);
+            }
+            a.patch(exit.first, stubAt[exit.second]);
+        }
+        return true;
+    }
+
+private:
+    Chunk* chunk;
+    byte* bytecode;
+    int epilogue;
+    vector<pair<int, int>> jumps;  // rel32 position, bytecode offset it goes to
+    vector<pair<int, int>> exits;  // rel32 position, bytecode offset of the instruction the interpreter should run
+
+    // JitFunction(stackTop, slots, closure, entry, vm)
+    void prologue() {
+        a.push(RBX);
+        a.push(R12);
+        a.push(R13);
+        a.push(R14);
+        a.push(R15);  // five pushes after the return address leaves the stack 16 byte aligned for calls
+        a.move(TOP_ADDRESS, RDI);
+        a.load(TOP, RDI, 0);
+        a.move(SLOTS, RSI);
+        a.move(CLOSURE, RDX);
+        a.move(VM_POINTER, R8);
+        a.jumpRegister(RCX);
+
+        epilogue = a.position();
+        a.pop(R15);
+        a.pop(R14);
+        a.pop(R13);
+        a.pop(R12);
+        a.pop(RBX);
+        a.ret();
+    }
+
+    void exitTo(int offset) {
+        a.store(TOP_ADDRESS, 0, TOP);
+        a.moveImmediate(RAX, (uint64_t) (bytecode + offset));
+        a.jumpTo(epilogue);
+    }
+
+    void exitIf(int cc, int offset) {
+        exits.emplace_back(a.jumpIf(cc), offset);
+    }
+
+    void jumpTo(int offset) {
+        jumps.emplace_back(a.jump(), offset);
+    }
+
+    void jumpIf(int cc, int offset) {
+        jumps.emplace_back(a.jumpIf(cc), offset);
+    }
+
+    // Everything below that knows how a Value is laid out.
+    // Values are always read and written a whole word at a time. A load that only partly overlaps an earlier store
+    // (like reading a whole tagged Value right after its type and number were stored separately) can't be forwarded
+    // from the store buffer and stalls until the store is done.
+
+    void copyValue(int destBase, int destDisp, int srcBase, int srcDisp) {
+        for (int i=0;i<VALUE_SIZE;i+=8){
+            a.load(RAX, srcBase, srcDisp + i);
+            a.store(destBase, destDisp + i, RAX);
+        }
+    }
+
+    void storeConstant(int base, int disp, Value value) {
+        uint64_t words[sizeof(Value) / 8];
+        memcpy(words, &value, sizeof(Value));
+        for (int i=0;i<(int) (sizeof(Value) / 8);i++){
+            a.moveImmediate(RAX, words[i]);
+            a.store(base, disp + i * 8, RAX);
+        }
+    }
+
+    void checkNumber(int base, int disp, int offset) {
+    #ifdef NAN_BOXING
+        a.load(RAX, base, disp);
+        a.moveImmediate(RCX, QNAN);
+        a.andRegisters(RAX, RCX);
+        a.compare(RAX, RCX);
+        exitIf(CC_E, offset);
+    #else
+        a.compare32(base, disp, VAL_NUMBER);
+        exitIf(CC_NE, offset);
+    #endif
+    }
+
+    void loadNumber(int xmm, int base, int disp) {
+        a.loadDouble(xmm, base, disp + PAYLOAD);
+    }
+
+    void loadNumber(int xmm, double number) {
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        a.moveImmediate(RAX, bits);
+        a.moveToDouble(xmm, RAX);
+    }
+
+    void storeNumber(int base, int disp, int xmm) {
+    #ifndef NAN_BOXING
+        a.storeImmediate(base, disp, VAL_NUMBER);
+    #endif
+        a.storeDouble(base, disp + PAYLOAD, xmm);
+    }
+
+    // From al, which is 0 or 1.
+    void storeBool(int base, int disp) {
+        a.zeroExtendAl();
+    #ifdef NAN_BOXING
+        a.moveImmediate(RCX, FALSE_BITS);  // true is false + 1
+        a.addRegisters(RAX, RCX);
+        a.store(base, disp, RAX);
+    #else
+        a.storeImmediate(base, disp, VAL_BOOL);
+        a.store(base, disp + PAYLOAD, RAX);
+    #endif
+    }
+
+    // Sets al to whether VM::isFalsy would be true.
+    void isFalsy(int base, int disp) {
+    #ifdef NAN_BOXING
+        a.load(RCX, base, disp);
+        a.moveImmediate(RDX, NIL_BITS);
+        a.subtractRegisters(RCX, RDX);
+        a.compareImmediate(RCX, (int8_t) (FALSE_BITS - NIL_BITS));
+        a.setIf(CC_BE);
+    #else
+        a.load32(RCX, base, disp);
+        a.clearEax();
+        a.compareImmediate32(RCX, VAL_NIL);
+        a.setIf(CC_E);
+        a.compareImmediate32(RCX, VAL_BOOL);
+        int notBool = a.jumpIf(CC_NE);
+        a.compare8(base, disp + PAYLOAD, 0);
+        a.setIf(CC_E);
+        a.bind(notBool);
+    #endif
+    }
+
+    // Both operands on top of the stack must be numbers. Leaves the left in xmm0 and the right in xmm1.
+    void numberOperands(int offset) {
+        checkNumber(TOP, -VALUE_SIZE, offset);
+        checkNumber(TOP, -2 * VALUE_SIZE, offset);
+        loadNumber(0, TOP, -2 * VALUE_SIZE);
+        loadNumber(1, TOP, -VALUE_SIZE);
+    }
+
+    void arithmetic(byte sseOpcode, int offset) {
+        numberOperands(offset);
+        a.doubles(sseOpcode, 0, 1);
+        a.add(TOP, -VALUE_SIZE);
+        storeNumber(TOP, -VALUE_SIZE, 0);
+    }
+
+    // <swap> compares right with left instead. See the comparisons in VM::run for why <= and >= are the negations.
+    void comparison(bool swap, int cc, int offset) {
+        numberOperands(offset);
+        if (swap) a.compareDoubles(1, 0);
+        else a.compareDoubles(0, 1);
+        a.setIf(cc);
+        a.add(TOP, -VALUE_SIZE);
+        storeBool(TOP, -VALUE_SIZE);
+    }
+
+    void call(void* helper) {
+        a.call(helper);
+    }
+
+    // Returns false without emitting anything if the instruction is left to the interpreter.
+    bool instruction(int offset) {
+        byte* code = bytecode + offset;
+        #define LOCAL(operand) (code[operand] * VALUE_SIZE)
+        switch (code[0]) {
+            case OP_GET_CONSTANT:
+                storeConstant(TOP, 0, chunk->getConstant(code[1]));
+                a.add(TOP, VALUE_SIZE);
+                return true;
+            case OP_GET_CONSTANT_LONG:
+                storeConstant(TOP, 0, chunk->getConstant(chunk->readWide(offset + 1)));
+                a.add(TOP, VALUE_SIZE);
+                return true;
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                storeConstant(TOP, 0, code[0] == OP_NIL ? NIL_VAL() : BOOL_VAL(code[0] == OP_TRUE));
+                a.add(TOP, VALUE_SIZE);
+                return true;
+            case OP_GET_LOCAL:
+                copyValue(TOP, 0, SLOTS, LOCAL(1));
+                a.add(TOP, VALUE_SIZE);
+                return true;
+            case OP_SET_LOCAL:
+                copyValue(SLOTS, LOCAL(1), TOP, -VALUE_SIZE);
+                return true;
+            case OP_POP:
+                a.add(TOP, -VALUE_SIZE);
+                return true;
+            case OP_POP_MANY:
+                a.add(TOP, -code[1] * VALUE_SIZE);
+                return true;
+            case OP_ADD:  // strings go back to the interpreter when the number check fails. OP_ADD_STR always does
+            case OP_ADD_NUM:
+                arithmetic(0x58, offset);
+                return true;
+            case OP_SUBTRACT:
+            case OP_SUBTRACT_NUM:
+                arithmetic(0x5C, offset);
+                return true;
+            case OP_MULTIPLY:
+            case OP_MULTIPLY_NUM:
+                arithmetic(0x59, offset);
+                return true;
+            case OP_DIVIDE:
+            case OP_DIVIDE_NUM:
+                arithmetic(0x5E, offset);
+                return true;
+            case OP_GREATER:
+            case OP_GREATER_NUM:
+                comparison(false, CC_A, offset);
+                return true;
+            case OP_LESS:
+            case OP_LESS_NUM:
+                comparison(true, CC_A, offset);
+                return true;
+            case OP_LESS_EQUAL:
+            case OP_LESS_EQUAL_NUM:
+                comparison(false, CC_BE, offset);
+                return true;
+            case OP_GREATER_EQUAL:
+            case OP_GREATER_EQUAL_NUM:
+                comparison(true, CC_BE, offset);
+                return true;
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+                a.lea(RDI, TOP, -2 * VALUE_SIZE);
+                call((void*) valuesEqualAt);
+                if (code[0] == OP_NOT_EQUAL) a.flipAl();
+                a.add(TOP, -VALUE_SIZE);
+                storeBool(TOP, -VALUE_SIZE);
+                return true;
+            case OP_NEGATE:
+                checkNumber(TOP, -VALUE_SIZE, offset);
+                a.load(RAX, TOP, -VALUE_SIZE + PAYLOAD);
+                a.moveImmediate(RCX, 0x8000000000000000ULL);
+                a.xorRegisters(RAX, RCX);
+                a.store(TOP, -VALUE_SIZE + PAYLOAD, RAX);
+                return true;
+            case OP_NOT:
+                isFalsy(TOP, -VALUE_SIZE);
+                storeBool(TOP, -VALUE_SIZE);
+                return true;
+            case OP_LOOP:
+            case OP_LOOP_LONG:
+                // While sampling, a loop goes back to VM::run when a tick is waiting so the sample is taken in there.
+                if (SamplingProfiler::running) {
+                    a.moveImmediate(RAX, (uint64_t) &SamplingProfiler::pendingTicks);
+                    a.compare32(RAX, 0, 0);
+                    exitIf(CC_NE, offset);
+                }
+                jumpTo(chunk->jumpTarget(offset));
+                return true;
+            case OP_JUMP:
+            case OP_JUMP_LONG:
+                jumpTo(chunk->jumpTarget(offset));
+                return true;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_FALSE_LONG:
+                isFalsy(TOP, -VALUE_SIZE);
+                a.testAl();
+                jumpIf(CC_NE, chunk->jumpTarget(offset));
+                return true;
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_TRUE:
+            case OP_POP_JUMP_IF_FALSE_LONG:
+            case OP_POP_JUMP_IF_TRUE_LONG:
+                isFalsy(TOP, -VALUE_SIZE);
+                a.add(TOP, -VALUE_SIZE);
+                a.testAl();
+                jumpIf(code[0] == OP_POP_JUMP_IF_FALSE || code[0] == OP_POP_JUMP_IF_FALSE_LONG ? CC_NE : CC_E, chunk->jumpTarget(offset));
+                return true;
+            case OP_SET_LOCAL_POP:
+                copyValue(SLOTS, LOCAL(1), TOP, -VALUE_SIZE);
+                a.add(TOP, -VALUE_SIZE);
+                return true;
+            case OP_GET_LOCALS:
+                copyValue(TOP, 0, SLOTS, LOCAL(1));
+                copyValue(TOP, VALUE_SIZE, SLOTS, LOCAL(3));
+                a.add(TOP, 2 * VALUE_SIZE);
+                return true;
+            case OP_ADD_LOCAL_CONSTANT:
+            case OP_SUBTRACT_LOCAL_CONSTANT: {
+                Value constant = chunk->getConstant(code[3]);
+                if (!IS_NUMBER(constant)) return false;
+                checkNumber(SLOTS, LOCAL(1), offset);
+                loadNumber(0, SLOTS, LOCAL(1));
+                loadNumber(1, AS_NUMBER(constant));
+                a.doubles(code[0] == OP_ADD_LOCAL_CONSTANT ? 0x58 : 0x5C, 0, 1);
+                storeNumber(TOP, 0, 0);
+                a.add(TOP, VALUE_SIZE);
+                return true;
+            }
+            case OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE: {
+                Value constant = chunk->getConstant(code[3]);
+                if (!IS_NUMBER(constant)) return false;
+                checkNumber(SLOTS, LOCAL(1), offset);
+                loadNumber(0, SLOTS, LOCAL(1));
+                loadNumber(1, AS_NUMBER(constant));
+                a.compareDoubles(1, 0);
+                jumpIf(CC_BE, chunk->jumpTarget(offset));  // not (local < constant), which includes NaN
+                return true;
+            }
+            case OP_GET_UPVALUE:
+                a.move(RDI, CLOSURE);
+                a.moveImmediate(RSI, code[1]);
+                a.move(RDX, TOP);
+                call((void*) getUpvalue);
+                a.add(TOP, VALUE_SIZE);
+                return true;
+            case OP_SET_UPVALUE:
+                a.move(RDI, VM_POINTER);
+                a.move(RSI, CLOSURE);
+                a.moveImmediate(RDX, code[1]);
+                a.lea(RCX, TOP, -VALUE_SIZE);
+                call((void*) setUpvalue);
+                return true;
+            case OP_CLOSE_UPVALUE:
+                a.move(RDI, VM_POINTER);
+                a.lea(RSI, TOP, -VALUE_SIZE);
+                call((void*) closeUpvalue);
+                a.add(TOP, -VALUE_SIZE);
+                return true;
+            case OP_PRINT:
+                a.add(TOP, -VALUE_SIZE);
+                a.store(TOP_ADDRESS, 0, TOP);
+                a.move(RDI, VM_POINTER);
+                a.move(RSI, TOP);
+                call((void*) print);
+                return true;
+            case OP_GET_PROPERTY:
+                a.move(RDI, TOP);
+                a.moveImmediate(RSI, (uint64_t) chunk->getInlineCache((code[2] << 8) | code[3]));
+                call((void*) getCachedField);
+                a.testAl();
+                exitIf(CC_E, offset);
+                return true;
+            case OP_SET_PROPERTY:
+                a.store(TOP_ADDRESS, 0, TOP);
+                a.move(RDI, VM_POINTER);
+                a.moveImmediate(RSI, (uint64_t) AS_STRING(chunk->getConstant(code[1])));
+                call((void*) setProperty);
+                a.testAl();
+                exitIf(CC_E, offset);
+                a.load(TOP, TOP_ADDRESS, 0);
+                return true;
+            case OP_ACCESS_INDEX:
+                a.move(RDI, TOP);
+                a.move(RSI, VM_POINTER);
+                call((void*) getIndex);
+                a.testAl();
+                exitIf(CC_E, offset);
+                a.add(TOP, -VALUE_SIZE);
+                return true;
+            case OP_SET_INDEX:
+                a.store(TOP_ADDRESS, 0, TOP);
+                a.move(RDI, VM_POINTER);
+                call((void*) setIndex);
+                a.testAl();
+                exitIf(CC_E, offset);
+                a.load(TOP, TOP_ADDRESS, 0);
+                return true;
+            default:
+                return false;
+        }
+        #undef LOCAL
+    }
+};
+
+JitCode* jitCompile(ObjFunction* function) {
+    Chunk* chunk = function->chunk;
+    JitCode* jit = new JitCode{nullptr, 0, chunk->getCodePtr(), {}};
+
+    JitCompiler compiler(chunk);
+    vector<int> machineAt;
+    vector<bool> isEntry;
+    if (!compiler.compile(machineAt, isEntry)) return jit;
+
+    // Written while it's only writable and then made only executable.
+    size_t size = compiler.a.code.size();
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return jit;
+    memcpy(memory, compiler.a.code.data(), size);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return jit;
+    }
+
+    jit->machineCode = (byte*) memory;
+    jit->size = size;
+    jit->entries.assign(isEntry.size(), nullptr);
+    for (size_t offset=0; offset < isEntry.size(); offset++){
+        if (isEntry[offset]) jit->entries[offset] = jit->machineCode + machineAt[offset];
+    }
+    return jit;
+}
+
+void jitFree(JitCode* jit) {
+    if (jit == nullptr) return;
+    if (jit->machineCode != nullptr) munmap(jit->machineCode, jit->size);
+    delete jit;
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+
+#ifdef VM_JIT
+#include "object.h"
+#include <vector>
+
+class VM;
+
+// Runs machine code starting at <entry> until it reaches something it leaves to the interpreter.
+// Returns the bytecode address the interpreter should carry on from. gc.stackTop is up to date by then.
+typedef byte* (*JitFunction)(Value** stackTop, Value* slots, ObjClosure* closure, byte* entry, VM* vm);
+
+// Machine code for one function, made by jitCompile once the function is hot.
+struct JitCode {
+    byte* machineCode;  // null if the function couldn't be compiled. it's not tried again.
+    size_t size;
+    byte* bytecode;  // the chunk's code. exits point back into it.
+    vector<byte*> entries;  // where the instruction at each bytecode offset starts. null if the interpreter should keep going.
+};
+
+JitCode* jitCompile(ObjFunction* function);
+void jitFree(JitCode* jit);
+
+// Runs the frame's machine code from ip if it has an entry there. Otherwise returns ip as it was.
+// Inline since VM::run checks on every call and return.
+static inline byte* jitRun(JitCode* jit, Value** stackTop, CallFrame& frame, VM* vm, byte* ip) {
+    size_t offset = ip - jit->bytecode;
+    if (offset >= jit->entries.size() || jit->entries[offset] == nullptr) return ip;
+    return ((JitFunction) jit->machineCode)(stackTop, frame.slots, frame.closure, jit->entries[offset], vm);
+}
+
+#endif
+
+#endif
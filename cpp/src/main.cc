@@ -2,38 +2,116 @@
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
+#include "bytecode.h"
+#include <unistd.h>
 
 char* readFile(const char* path);
-void script(VM *vm, const char *path);
+void script(VM *vm, const char *path, bool compileOnly, const char* profilePath, const char* statsPath);
 void repl(VM *vm);
 
+// lox [-s] [-c] [-l] [-p profile] [-j stats] path
+//  -s: don't print the compiled code
+//  -c: write the compiled bytecode to path + "c" (script.lox -> script.loxc) instead of running.
+//  -l: write out each line as it's printed. That's already the case when stdout is a terminal, otherwise it's buffered.
+//  -p: sample the script while it runs and write the stacks to profile for a flame graph. See SamplingProfiler.
+//  -j: write what was counted while the script ran to stats as JSON. See VM::writeStats.
+// When running script.lox, a script.loxc next to it that was compiled from the same source is used instead of compiling.
+// A .loxc path can also be run directly.
 // TODO: fix debug repl. should be able to put you in the context and add new code.
 int main(int argc, const char* argv[]) {
     VM vm;
+    vm.lineBuffered = isatty(STDOUT_FILENO);
 
     if (argc == 1){
+        vm.lineBuffered = true;
         repl(&vm);
-    } else if (argc == 2){
-        script(&vm, argv[1]);
-    } else if (argc == 3 && strcmp(argv[1], "-s") == 0){
-        Debugger::silent = true;
-        script(&vm, argv[2]);
+        return 0;
     }
 
+    bool compileOnly = false;
+    const char* profilePath = nullptr;
+    const char* statsPath = nullptr;
+    for (int i=1;i<argc-1;i++){
+        if (strcmp(argv[i], "-s") == 0) Debugger::silent = true;
+        else if (strcmp(argv[i], "-c") == 0) compileOnly = true;
+        else if (strcmp(argv[i], "-l") == 0) vm.lineBuffered = true;
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc - 1) profilePath = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc - 1) statsPath = argv[++i];
+        else {
+            fprintf(stderr, "Unknown option \"%s\".\n", argv[i]);
+            return 64;
+        }
+    }
+    script(&vm, argv[argc - 1], compileOnly, profilePath, statsPath);
+
     return 0;
 }
 
-void script(VM *vm, const char *path) {
-    char* src = readFile(path);
+static bool endsWith(const string& str, const string& suffix) {
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
 
-    InterpretResult result = INTERPRET_COMPILE_ERROR;
-    if (vm->loadFromSource(src)){
-        result = vm->run();
+void script(VM *vm, const char *path, bool compileOnly, const char* profilePath, const char* statsPath) {
+    ObjFunction* function;
+    if (endsWith(path, ".loxc")) {
+        function = BytecodeFile::read(path, nullptr, vm->gc);
+        if (function == nullptr) {
+            fprintf(stderr, "Could not load bytecode \"%s\".\n", path);
+            exit(74);
+        }
+    } else {
+        char* src = readFile(path);
+        uint64_t hash = BytecodeFile::hashSource(src, strlen(src));
+        string cachePath = string(path) + "c";
+
+        function = compileOnly ? nullptr : BytecodeFile::read(cachePath.c_str(), &hash, vm->gc);
+        if (function == nullptr) function = vm->compiler.compile(src);
+        free(src);
+        if (function == nullptr) exit(65);
+
+        if (compileOnly) {
+            exit(BytecodeFile::write(function, cachePath.c_str(), hash, vm->gc) ? 0 : 74);
+        }
+    }
+
+    SamplingProfiler profiler;
+    if (profilePath != nullptr) {
+        if (!profiler.start(PROFILER_SAMPLES_PER_SECOND)) {
+            fprintf(stderr, "Could not start the profiler.\n");
+            exit(71);
+        }
+        vm->profiler = &profiler;
+    }
+
+    HardwareCounters hardware;
+    if (statsPath != nullptr) hardware.start();
+
+    vm->loadFunction(function);
+    InterpretResult result = vm->run();
+    vm->flushOutput();  // exit() doesn't run the vm's destructor
+
+    if (statsPath != nullptr) {
+        hardware.stop();
+        if (!vm->writeStats(statsPath, hardware)) {
+            fprintf(stderr, "Could not write stats \"%s\".\n", statsPath);
+            exit(74);
+        }
+    }
+
+    if (profilePath != nullptr) {
+        profiler.stop();
+        vm->profiler = nullptr;
+        if (!profiler.write(profilePath)) {
+            fprintf(stderr, "Could not write profile \"%s\".\n", profilePath);
+            exit(74);
+        }
     }
 
-    free(src);
     if (result == INTERPRET_OK) {
         vm->printTimeByInstruction();
+        vm->printInlineCacheStats();
+        vm->printOpcodeNgrams();
+        vm->gc.printPauseHistogram();
         exit(vm->exitCode);
     }
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
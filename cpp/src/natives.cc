@@ -2,6 +2,7 @@
 #include <chrono>
 #include <iostream>
 #include <string>
+#include <vector>
 
 Value LoxNatives::klock(VM* vm, Value* args) {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
@@ -14,6 +15,7 @@ Value LoxNatives::time(VM* vm, Value* args) {
 
 // TODO: halt and wait for user
 Value LoxNatives::input(VM* vm, Value* args) {
+    vm->flushOutput();  // a prompt printed just before should show up
     string line;
     getline(std::cin, line);
     ObjString* str = vm->produceString(line);
@@ -22,6 +24,63 @@ Value LoxNatives::input(VM* vm, Value* args) {
 
 // TODO: remove. I feel like nobody sane wants this.
 Value LoxNatives::eval(VM* vm, Value* args) {
+    args[0] = vm->gc.flatten(args[0]);
     char* code = AS_CSTRING(args[0]);
     return vm->produceFunction(code);
 }
+
+// The list and value are still on the stack while it grows so the gc can find them.
+Value LoxNatives::push(VM* vm, Value* args) {
+    if (!IS_LIST(args[0])) return vm->nativeError("push() expects a list.");
+    ObjList* list = AS_LIST(args[0]);
+    list->values.push(args[1], vm->gc);
+    vm->gc.writeBarrier((Obj*) list, args[1]);
+    return NIL_VAL();
+}
+
+Value LoxNatives::pop(VM* vm, Value* args) {
+    if (!IS_LIST(args[0])) return vm->nativeError("pop() expects a list.");
+    ObjList* list = AS_LIST(args[0]);
+    if (list->values.count == 0) return vm->nativeError("Can't pop from an empty list.");
+    return list->values.pop();
+}
+
+Value LoxNatives::len(VM* vm, Value* args) {
+    if (IS_LIST(args[0])) return NUMBER_VAL((double) AS_LIST(args[0])->values.count);
+    if (IS_ANY_STRING(args[0])) return NUMBER_VAL((double) stringLength(AS_OBJ(args[0])));
+    if (IS_MAP(args[0])) return NUMBER_VAL((double) AS_MAP(args[0])->table->size);
+    return vm->nativeError("len() expects a list, string or map.");
+}
+
+Value LoxNatives::has(VM* vm, Value* args) {
+    if (!IS_MAP(args[0])) return vm->nativeError("has() expects a map.");
+    args[1] = vm->gc.flatten(args[1]);
+    Value unused;
+    return BOOL_VAL(AS_MAP(args[0])->table->get(args[1], &unused));
+}
+
+// Called delete in lox.
+Value LoxNatives::deleteKey(VM* vm, Value* args) {
+    if (!IS_MAP(args[0])) return vm->nativeError("delete() expects a map.");
+    args[1] = vm->gc.flatten(args[1]);
+    return BOOL_VAL(AS_MAP(args[0])->table->remove(args[1]));
+}
+
+// In no particular order. Index the map with them to get the values.
+Value LoxNatives::keys(VM* vm, Value* args) {
+    if (!IS_MAP(args[0])) return vm->nativeError("keys() expects a map.");
+    ValueTable* table = AS_MAP(args[0])->table;
+    std::vector<Value> keys;
+    keys.reserve(table->size);
+    for (uint32_t i=0;i<table->capacity;i++){
+        if (!ValueTable::isEmpty(table->entries + i)) keys.push_back(table->entries[i].key);
+    }
+    // The keys are still in the map so nothing is lost if making the list collects.
+    return OBJ_VAL(vm->gc.newList(keys.data(), (uint32_t) keys.size()));
+}
+
+// Print only fills a buffer. This writes it out now instead of when it's full or the script ends.
+Value LoxNatives::flush(VM* vm, Value* args) {
+    vm->flushOutput();
+    return NIL_VAL();
+}
@@ -9,4 +9,11 @@ namespace LoxNatives {
     Value time(VM* vm, Value* args);
     Value input(VM* vm, Value* args);
     Value eval(VM* vm, Value* args);
+    Value push(VM* vm, Value* args);
+    Value pop(VM* vm, Value* args);
+    Value len(VM* vm, Value* args);
+    Value has(VM* vm, Value* args);
+    Value deleteKey(VM* vm, Value* args);
+    Value keys(VM* vm, Value* args);
+    Value flush(VM* vm, Value* args);
 }
\ No newline at end of file
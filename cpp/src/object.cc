@@ -2,9 +2,11 @@
 #include "vm.h"
 #include "common.h"
 #include "object.h"
+#include <chrono>
+#include <algorithm>
 
 bool isObjType(Value value, ObjType type){
-    return value.type == VAL_OBJ && AS_OBJ(value)->type == type;
+    return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
 #define ALLOCATE_OBJ(type, objectType) \
@@ -48,7 +50,7 @@ ObjString* Memory::takeString(char* chars, uint32_t length) {
 
     Entry* slot;
     ObjString* str;
-    bool wasInterned = strings->safeFindEntry(chars, length, hashString(chars, length), &slot);
+    bool wasInterned = strings->safeFindEntry(chars, length, hash, &slot);
     if (wasInterned){
         str = slot->key;
         FREE_ARRAY(char, chars,  length + 1);  // + 1 for null terminator
@@ -73,9 +75,11 @@ ObjString* Memory::allocateString(char* chars, uint32_t length, uint32_t hash) {
 Obj* Memory::allocateObject(size_t size, ObjType type) {
     Obj* object = RAW_OBJ(reallocate(nullptr, 0, size));
     object->next = nullptr;
-    linkObjects(&objects, object);
+    linkObjects(&youngObjects, object);
     object->type = type;
     object->isMarked = false;
+    object->isOld = false;
+    object->isRemembered = false;
 #ifdef DEBUG_LOG_GC
     fprintf(stderr, "%p allocate %zu for %d\n", (void*)object, size, type);
 #endif
@@ -100,6 +104,9 @@ void Memory::freeObject(Obj* object){
             ObjFunction* function = (ObjFunction*)object;
             function->chunk->release(*this);
             delete function->chunk;
+#ifdef VM_JIT
+            jitFree(function->jit);
+#endif
             FREE(ObjFunction , object);
             break;
         }
@@ -125,14 +132,42 @@ void Memory::freeObject(Obj* object){
         }
         case OBJ_INSTANCE: {
             auto inst = (ObjInstance*)object;
-            delete inst->fields;  // GC will clean up entries in the table eventually
-            FREE(ObjInstance, object);
+            delete inst->dictionary;  // GC will clean up entries in the table eventually
+            if (inst->fields != inst->inlineFields()) {
+                FREE_ARRAY(Value, inst->fields, inst->capacity);
+            }
+            reallocate(object, sizeof(ObjInstance) + sizeof(Value) * inst->inlineCapacity, 0);
+            break;
+        }
+        case OBJ_SHAPE: {
+            auto shape = (ObjShape*)object;
+            delete shape->slots;
+            delete shape->transitions;
+            FREE(ObjShape, object);
             break;
         }
         case OBJ_BOUND_METHOD: {
             FREE(ObjBoundMethod, object);
             break;
         }
+        case OBJ_LIST: {
+            ((ObjList*)object)->values.release(*this);
+            FREE(ObjList, object);
+            break;
+        }
+        case OBJ_MAP: {
+            delete ((ObjMap*)object)->table;
+            FREE(ObjMap, object);
+            break;
+        }
+        case OBJ_ROPE: {
+            FREE(ObjRope, object);  // the halves and the flat string are objects of their own
+            break;
+        }
+        case OBJ_STRING_VIEW: {
+            FREE(ObjStringView, object);
+            break;
+        }
         case OBJ_FREED:
             cerr << "Double Free " << (void*)object << endl;
             break;
@@ -148,6 +183,19 @@ uint32_t hashString(const char* key, uint32_t length) {
     return hash;
 }
 
+// The lists and maps printObject is inside of. One that contains itself prints as [...] or {...} there instead of recursing forever.
+static vector<Obj*> printing;
+
+// Otherwise adds it to <printing>, which the caller pops when it's done.
+static bool isBeingPrinted(Obj* object, ostream* output, const char* placeholder) {
+    if (std::find(printing.begin(), printing.end(), object) != printing.end()) {
+        *output << placeholder;
+        return true;
+    }
+    printing.push_back(object);
+    return false;
+}
+
 void printObject(Value value, ostream* output){
     switch (OBJ_TYPE(value)) {
         case OBJ_STRING:
@@ -188,6 +236,55 @@ void printObject(Value value, ostream* output){
             *output << name << " instance";
             break;
         }
+        case OBJ_SHAPE:
+            *output << "<shape>";
+            break;
+        case OBJ_LIST: {
+            ObjList* list = AS_LIST(value);
+            if (isBeingPrinted(AS_OBJ(value), output, "[...]")) break;
+            *output << "[";
+            for (uint32_t i=0;i<list->values.count;i++){
+                if (i > 0) *output << ", ";
+                printValue(list->values[i], output);
+            }
+            *output << "]";
+            printing.pop_back();
+            break;
+        }
+        case OBJ_MAP: {
+            ValueTable* table = AS_MAP(value)->table;
+            if (isBeingPrinted(AS_OBJ(value), output, "{...}")) break;
+            *output << "{";
+            bool first = true;
+            for (uint32_t i=0;i<table->capacity;i++){
+                ValueEntry* entry = table->entries + i;
+                if (ValueTable::isEmpty(entry)) continue;
+                if (!first) *output << ", ";
+                first = false;
+                printValue(entry->key, output);
+                *output << ": ";
+                printValue(entry->value, output);
+            }
+            *output << "}";
+            printing.pop_back();
+            break;
+        }
+        case OBJ_ROPE:
+        case OBJ_STRING_VIEW: {
+            Obj* text = skipFlattened(AS_OBJ(value));
+            if (text->type == OBJ_STRING) {
+                *output << asCString((ObjString*) text);
+            } else if (text->type == OBJ_STRING_VIEW) {
+                ObjStringView* view = (ObjStringView*) text;
+                output->write(asCString(view->parent) + view->start, view->length);
+            } else {
+                // Printing doesn't need a hash so there's no point interning it.
+                string chars(stringLength(text), '\0');
+                copyStringChars(text, chars.data());
+                *output << chars;
+            }
+            break;
+        }
         default:
             *output << "<Untagged Obj " << AS_OBJ(value) << ">";
     }
@@ -230,6 +327,11 @@ ObjFunction* Memory::newFunction() {
     function->name = NULL;
     function->chunk = new Chunk;
     function->upvalueCount = 0;
+    function->maxLocals = 1;
+#ifdef VM_JIT
+    function->hotness = 0;
+    function->jit = nullptr;
+#endif
     return function;
 }
 
@@ -254,17 +356,138 @@ ObjClosure* Memory::newClosure(ObjFunction* function) {
 ObjClass* Memory::newClass(ObjString* name) {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
-    klass->methods = new Table(*this);
+    klass->methods = new Table(*this, (Obj*) klass);
+    klass->rootShape = nullptr;
+    klass->instanceFieldsHint = 0;
     return klass;
 }
 
+// The class must be reachable by the gc (it's on the stack as the value being called).
 ObjInstance* Memory::newInstance(ObjClass* klass) {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    if (klass->rootShape == nullptr) {
+        klass->rootShape = newShape(klass, nullptr);
+        writeBarrier((Obj*) klass, (Obj*) klass->rootShape);
+    }
+
+    uint32_t inlineCapacity = klass->instanceFieldsHint;
+    auto instance = (ObjInstance*) allocateObject(sizeof(ObjInstance) + sizeof(Value) * inlineCapacity, OBJ_INSTANCE);
     instance->klass = klass;
-    instance->fields = new Table(*this);
+    instance->shape = klass->rootShape;
+    instance->fields = instance->inlineFields();
+    instance->capacity = inlineCapacity;
+    instance->inlineCapacity = inlineCapacity;
+    instance->dictionary = nullptr;
     return instance;
 }
 
+ObjShape* Memory::newShape(ObjClass* klass, ObjShape* parent) {
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->klass = klass;
+    shape->parent = parent;
+    shape->fieldCount = parent == nullptr ? 0 : parent->fieldCount + 1;
+    shape->slots = new Table(*this, (Obj*) shape);
+    shape->transitions = new Table(*this, (Obj*) shape);
+    return shape;
+}
+
+// Returns the shape you get by adding <name> to <shape>, or nullptr if that would be too many fields.
+ObjShape* Memory::shapeWithField(ObjShape* shape, ObjString* name) {
+    Value existing;
+    if (shape->transitions->get(name, &existing)) return AS_SHAPE(existing);
+    if (shape->fieldCount >= SHAPE_MAX_FIELDS) return nullptr;
+
+    ObjShape* child = newShape(shape->klass, shape);
+    push(OBJ_VAL(child));  // for gc
+    child->slots->addAll(*shape->slots);
+    child->slots->set(name, NUMBER_VAL((double) shape->fieldCount));
+    shape->transitions->set(name, OBJ_VAL(child));
+    pop();
+    return child;
+}
+
+// The instance must be reachable by the gc.
+void Memory::setField(ObjInstance* instance, ObjString* name, Value value) {
+    if (instance->shape == nullptr) {
+        instance->dictionary->set(name, value);
+        return;
+    }
+
+    int slot = getFieldSlot(instance, name);
+    if (slot != -1) {
+        instance->fields[slot] = value;
+        writeBarrier((Obj*) instance, value);
+        return;
+    }
+
+    push(value);  // for gc
+    ObjShape* next = shapeWithField(instance->shape, name);
+    if (next == nullptr) {
+        makeDictionary(instance);
+        instance->dictionary->set(name, value);
+    } else {
+        if (next->fieldCount > instance->capacity) growFields(instance, next->fieldCount);
+        instance->fields[next->fieldCount - 1] = value;
+        instance->shape = next;
+        writeBarrier((Obj*) instance, (Obj*) next);
+        writeBarrier((Obj*) instance, value);
+    }
+    pop();
+}
+
+void Memory::growFields(ObjInstance* instance, uint32_t minCapacity) {
+    uint32_t newCapacity = instance->capacity < 4 ? 4 : instance->capacity * 2;
+    if (newCapacity < minCapacity) newCapacity = minCapacity;
+    if (newCapacity > SHAPE_MAX_FIELDS) newCapacity = SHAPE_MAX_FIELDS;
+
+    // Only the fields the shape says exist get marked so it's fine if a collection sees the instance halfway through.
+    Value* newFields = ALLOCATE(Value, newCapacity);
+    memcpy(newFields, instance->fields, sizeof(Value) * instance->shape->fieldCount);
+    if (instance->fields != instance->inlineFields()) {
+        FREE_ARRAY(Value, instance->fields, instance->capacity);
+    }
+    instance->fields = newFields;
+    instance->capacity = newCapacity;
+
+    ObjClass* klass = instance->klass;
+    if (minCapacity > klass->instanceFieldsHint) klass->instanceFieldsHint = minCapacity;
+}
+
+// Moves every field into a hash table owned by just this instance.
+void Memory::makeDictionary(ObjInstance* instance) {
+    Table* dictionary = new Table(*this, (Obj*) instance);
+    ObjShape* shape = instance->shape;
+    for (uint32_t i=0;i<shape->slots->capacity;i++){
+        Entry* entry = shape->slots->entries + i;
+        if (Table::isEmpty(entry)) continue;
+        dictionary->set(entry->key, instance->fields[(int) AS_NUMBER(entry->value)]);
+    }
+
+    if (instance->fields != instance->inlineFields()) {
+        FREE_ARRAY(Value, instance->fields, instance->capacity);
+    }
+    instance->fields = instance->inlineFields();
+    instance->capacity = instance->inlineCapacity;
+    instance->dictionary = dictionary;
+    instance->shape = nullptr;
+}
+
+int getFieldSlot(ObjInstance* instance, ObjString* name) {
+    Table* slots = instance->shape->slots;
+    if (slots->count == 0) return -1;
+    Value slot;
+    if (!slots->get(name, &slot)) return -1;
+    return (int) AS_NUMBER(slot);
+}
+
+bool getField(ObjInstance* instance, ObjString* name, Value* valueOut) {
+    if (instance->shape == nullptr) return instance->dictionary->get(name, valueOut);
+
+    int slot = getFieldSlot(instance, name);
+    if (slot == -1) return false;
+    *valueOut = instance->fields[slot];
+    return true;
+}
+
 ObjUpvalue* Memory::newUpvalue(Value* location) {
     ObjUpvalue* val = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     val->location = location;
@@ -281,45 +504,221 @@ ObjBoundMethod* Memory::newBoundMethod(Value receiver, ObjClosure* method) {
     return val;
 }
 
+// Copies <count> values into a new list. They must be reachable by the gc (on the stack or in a list that is).
+// The storage is allocated before the list itself so nothing can be collected (or promoted) between
+// making the list and filling it, which means no write barrier is needed.
+ObjList* Memory::newList(Value* values, uint32_t count) {
+    Value* data = count == 0 ? nullptr : ALLOCATE(Value, count);
+    ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    if (count > 0) memcpy(data, values, sizeof(Value) * count);
+    list->values.data = data;
+    list->values.count = count;
+    list->values.capacity = count;
+    return list;
+}
+
+ObjMap* Memory::newMap() {
+    ObjMap* map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+    map->table = new ValueTable(*this, (Obj*) map);
+    return map;
+}
+
+// <left> and <right> must be reachable by the gc. Nothing is copied so it doesn't matter how long they are.
+ObjRope* Memory::newRope(Obj* left, Obj* right, uint32_t length) {
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = nullptr;
+    return rope;
+}
+
+// <parent> must be reachable by the gc. The view keeps it alive until the view is flattened.
+ObjStringView* Memory::newStringView(ObjString* parent, uint32_t start, uint32_t length) {
+    ObjStringView* view = ALLOCATE_OBJ(ObjStringView, OBJ_STRING_VIEW);
+    view->length = length;
+    view->start = start;
+    view->parent = parent;
+    view->flat = nullptr;
+    return view;
+}
+
+// The interned string for a rope or view, copied out once and then cached on it. A flat string is returned as it is.
+// <text> must be reachable by the gc.
+ObjString* Memory::flattenString(Obj* text) {
+    text = skipFlattened(text);
+    if (text->type == OBJ_STRING) return (ObjString*) text;
+
+    ObjString* flat;
+    if (text->type == OBJ_STRING_VIEW) {
+        ObjStringView* view = (ObjStringView*) text;
+        // copyString only copies if the string isn't already interned.
+        flat = copyString(asCString(view->parent) + view->start, (int) view->length);
+        view->flat = flat;
+        view->parent = nullptr;
+    } else {
+        ObjRope* rope = (ObjRope*) text;
+        char* chars = ALLOCATE(char, rope->length + 1);
+        copyStringChars(text, chars);
+        chars[rope->length] = '\0';
+        flat = takeString(chars, rope->length);
+        rope->flat = flat;
+        rope->left = nullptr;
+        rope->right = nullptr;
+    }
+    writeBarrier(text, (Obj*) flat);
+    return flat;
+}
+
+uint32_t stringLength(Obj* text) {
+    if (text->type == OBJ_ROPE) return ((ObjRope*) text)->length;
+    if (text->type == OBJ_STRING_VIEW) return ((ObjStringView*) text)->length;
+    return ((ObjString*) text)->array.length - 1;
+}
+
+// <dest> must have room for stringLength(text) chars. No null terminator is added.
+// Goes from the end so the usual left leaning rope (s = s + x in a loop) never needs more than one pending node.
+void copyStringChars(Obj* text, char* dest) {
+    uint32_t end = stringLength(text);
+    vector<Obj*> pending;
+    for (;;) {
+        text = skipFlattened(text);
+        if (text->type == OBJ_ROPE) {
+            pending.push_back(((ObjRope*) text)->left);
+            text = ((ObjRope*) text)->right;
+            continue;
+        }
+        if (text->type == OBJ_STRING_VIEW) {
+            ObjStringView* view = (ObjStringView*) text;
+            end -= view->length;
+            memcpy(dest + end, asCString(view->parent) + view->start, view->length);
+        } else {
+            ObjString* leaf = (ObjString*) text;
+            end -= leaf->array.length - 1;
+            memcpy(dest + end, leaf->array.contents, leaf->array.length - 1);
+        }
+        if (pending.empty()) break;
+        text = pending.back();
+        pending.pop_back();
+    }
+}
+
+// For valuesEqual when at least one side is a rope or view that hasn't been flattened (the vm flattens before ==,
+// but not before comparing keys in a map or values in the jit).
+bool lazyStringsEqual(Obj* a, Obj* b) {
+    a = skipFlattened(a);
+    b = skipFlattened(b);
+    if (a == b) return true;
+    bool aIsText = a->type == OBJ_STRING || isLazyString(a);
+    bool bIsText = b->type == OBJ_STRING || isLazyString(b);
+    if (!aIsText || !bIsText) return false;
+    if (a->type == OBJ_STRING && b->type == OBJ_STRING) return false;  // interned
+    uint32_t length = stringLength(a);
+    if (stringLength(b) != length) return false;
+    string aChars(length, '\0');
+    string bChars(length, '\0');
+    copyStringChars(a, aChars.data());
+    copyStringChars(b, bChars.data());
+    return aChars == bChars;
+}
+
+// The same hash the string would get once flattened.
+uint32_t hashLazyString(Obj* text) {
+    text = skipFlattened(text);
+    if (text->type == OBJ_STRING) return ((ObjString*) text)->hash;
+    if (text->type == OBJ_STRING_VIEW) {
+        ObjStringView* view = (ObjStringView*) text;
+        return hashString(asCString(view->parent) + view->start, view->length);
+    }
+    uint32_t length = stringLength(text);
+    string chars(length, '\0');
+    copyStringChars(text, chars.data());
+    return hashString(chars.data(), length);
+}
+
 void* Memory::reallocate(void* pointer, size_t oldSize, size_t newSize){
     bytesAllocated += newSize - oldSize;
     if (newSize == 0){
+#ifdef GC_NO_POOL_ALLOCATOR
         free(pointer);
+#else
+        pool.reallocate(pointer, oldSize, 0);
+#endif
         return nullptr;
     }
 
     if (enable && newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC  // TODO: also always run on array push even if no resize?
-        collectGarbage();
-#else
-        if (bytesAllocated > nextGC) {
-            collectGarbage();
-        }
-#endif
+        bytesSinceMinorGC += newSize - oldSize;
+        collectIfNeeded();
     }
 
+#ifdef GC_NO_POOL_ALLOCATOR
     void* result = realloc(pointer, newSize);
+#else
+    void* result = pool.reallocate(pointer, oldSize, newSize);
+#endif
     if (result == nullptr) {
         cerr << "Failed to reallocate from " << oldSize << " to " << newSize << endl;
-        free(pointer);
         exit(1);
     }
 
     return result;
 }
 
+static inline uint64_t nowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Memory::collectIfNeeded() {
+#ifdef GC_INCREMENTAL
+    if (gcPhase != GC_IDLE) {
+#ifndef DEBUG_STRESS_GC
+        if (bytesSinceMinorGC < GC_STEP_SIZE) return;
+#endif
+        bytesSinceMinorGC = 0;
+        incrementalStep();
+        return;
+    }
+#endif
+
+#ifdef DEBUG_STRESS_GC  // TODO: also always run on array push even if no resize?
+    static int stressCount = 0;
+    bool full = ++stressCount % 8 == 0;
+    bool young = !full;
+#else
+    bool full = bytesAllocated > nextGC;
+    bool young = bytesSinceMinorGC > GC_NURSERY_SIZE;
+#endif
+
+    if (full) {
+#ifdef GC_INCREMENTAL
+        startIncrementalGC();
+#else
+        collectGarbage();
+#endif
+    } else if (young) {
+        collectYoungGarbage();
+    }
+}
+
 void Memory::collectGarbage() {
 #ifdef DEBUG_LOG_GC
     cerr << "-- gc begin\n";
     size_t before = bytesAllocated;
 #endif
+    uint64_t start = nowMicros();
+    fullCollections++;
 
     markRoots();
     traceReferences();
     strings->removeUnmarkedKeys();
+    forgetRemembered();
     sweep();
+    sweepYoung();
 
     nextGC = bytesAllocated * GC_HEAP_GROW_FACTOR;
+    bytesSinceMinorGC = 0;
+    recordPause(start);
 
 #ifdef DEBUG_LOG_GC
     cerr << "-- gc end\n";
@@ -327,6 +726,36 @@ void Memory::collectGarbage() {
 #endif
 }
 
+// Only frees objects allocated since the last collection. Anything they can reach from the old generation
+// must have gone through a write barrier, so tracing from the roots and the remembered set finds every survivor.
+void Memory::collectYoungGarbage() {
+#ifdef DEBUG_LOG_GC
+    cerr << "-- minor gc begin\n";
+    size_t before = bytesAllocated;
+#endif
+    uint64_t start = nowMicros();
+    youngCollections++;
+
+    isMinorGC = true;
+    markRoots();
+    for (Obj* object : rememberedSet) {
+        grayStack.push_back(object);  // already black as far as this collection cares, just need to trace its children
+    }
+    forgetRemembered();
+    traceReferences();
+    strings->removeUnmarkedKeys();
+    sweepYoung();
+    isMinorGC = false;
+
+    bytesSinceMinorGC = 0;
+    recordPause(start);
+
+#ifdef DEBUG_LOG_GC
+    cerr << "-- minor gc end\n";
+    fprintf(stderr, "   collected %zu bytes (from %zu to %zu)\n", before - bytesAllocated, before, bytesAllocated);
+#endif
+}
+
 void Memory::markRoots() {
     for (Value* slot=stack;slot<stackTop;slot++) {
         markValue(*slot);
@@ -340,6 +769,9 @@ void Memory::markRoots() {
 
     markTable(*natives);
     markObject((Obj*) init);
+    for (ObjString* single : singleChars) {
+        markObject((Obj*) single);
+    }
 
     // TODO: dont think i need this so the field can be on the vm.
     //       the closures you call are always in the first stack slot so its fine.
@@ -348,66 +780,236 @@ void Memory::markRoots() {
 //    }
 }
 
+// Marks the roots and then lets the mutator run. Each allocation does a little more work in incrementalStep.
+// Objects allocated during marking start white in the nursery and are only kept if finishMarking finds them.
+void Memory::startIncrementalGC() {
+#ifdef DEBUG_LOG_GC
+    cerr << "-- incremental gc begin\n";
+#endif
+    uint64_t start = nowMicros();
+    fullCollections++;
+    gcPhase = GC_MARKING;
+    bytesSinceMinorGC = 0;
+    markRoots();
+    recordPause(start);
+}
+
+// Traces gray objects or sweeps until the pause budget is used up.
+void Memory::incrementalStep() {
+    uint64_t start = nowMicros();
+#ifdef DEBUG_STRESS_GC
+    int checkEvery = 1;  // one piece of work per allocation so the mutator runs in between as much as possible
+#else
+    int checkEvery = 64;
+#endif
+
+    int work = 0;
+    while (gcPhase != GC_IDLE) {
+        if (gcPhase == GC_MARKING) {
+            if (grayStack.empty()) {
+                finishMarking();
+            } else {
+                Obj* object = grayStack.back();
+                grayStack.pop_back();
+                blacken(object);
+            }
+        } else {
+            sweepOne();
+        }
+
+        work++;
+        if (work % checkEvery == 0 && nowMicros() - start >= maxPauseMicros) break;
+    }
+    recordPause(start);
+}
+
+// The stack, open upvalues and natives change without a write barrier, so they get scanned again before the
+// marking can be trusted. Anything the heap points at that could have been missed went through incrementalBarrier.
+// If that finds new objects they're traced incrementally like the rest, but only a few times so the cycle can't
+// chase a mutator that keeps allocating forever.
+void Memory::finishMarking() {
+    markRoots();
+    if (!grayStack.empty() && ++remarkCount < 4) return;
+    remarkCount = 0;
+    traceReferences();
+    strings->removeUnmarkedKeys();
+    forgetRemembered();
+
+    sweepCursor = &objects;
+    condemnedYoung = youngObjects;
+    youngObjects = nullptr;
+    gcPhase = GC_SWEEPING;
+}
+
+void Memory::sweepOne() {
+    if (sweepCursor != nullptr) {
+        Obj* object = *sweepCursor;
+        if (object == nullptr) {
+            sweepCursor = nullptr;
+        } else if (object->isMarked) {
+            object->isMarked = false;
+            sweepCursor = &object->next;
+        } else {
+            *sweepCursor = object->next;
+            freeObject(object);
+        }
+        return;
+    }
+
+    // Done with the old generation so it's safe to push promoted objects on the front.
+    if (condemnedYoung != nullptr) {
+        Obj* object = condemnedYoung;
+        condemnedYoung = object->next;
+        if (object->isMarked) {
+            object->isMarked = false;
+            object->isOld = true;
+            object->next = objects;
+            objects = object;
+        } else {
+            freeObject(object);
+        }
+        return;
+    }
+
+    gcPhase = GC_IDLE;
+    nextGC = bytesAllocated * GC_HEAP_GROW_FACTOR;
+    bytesSinceMinorGC = 0;
+#ifdef DEBUG_LOG_GC
+    cerr << "-- incremental gc end\n";
+    fprintf(stderr, "   heap is %zu bytes, next at %zu\n", bytesAllocated, nextGC);
+#endif
+}
+
+// While marking, a black object must never point at a white one, so shade the target (Dijkstra's barrier).
+// While sweeping, objects from the condemned nursery become old without anyone noticing the young
+// objects stored in them, so remember every owner and let the next minor collection sort it out.
+void Memory::incrementalBarrier(Obj* owner, Obj* target) {
+    if (gcPhase == GC_MARKING) {
+        if (owner->isMarked) markObject(target);
+    } else if (!owner->isRemembered && !target->isOld) {
+        owner->isRemembered = true;
+        rememberedSet.push_back(owner);
+    }
+}
+
 void Memory::traceReferences() {
     while (!grayStack.empty()) {
         Obj* object = grayStack.back();
         grayStack.pop_back();
+        blacken(object);
+    }
+}
+
+void Memory::blacken(Obj* object) {
 #ifdef DEBUG_LOG_GC
-        fprintf(stderr, "%p blacken ", (void*)object);
-        printValue(OBJ_VAL(object), &cerr);
-        cerr << endl;
+    fprintf(stderr, "%p blacken ", (void*)object);
+    printValue(OBJ_VAL(object), &cerr);
+    cerr << endl;
 #endif
-        switch (object->type) {
-            case OBJ_STRING:
-            case OBJ_NATIVE:
-                break;
-
-            case OBJ_FUNCTION: {
-                auto* function = (ObjFunction*) object;
-                markObject((Obj*) function->name);
-                for (int i=0;i<function->chunk->getConstantsSize();i++){
-                    markValue(function->chunk->getConstant(i));
-                }
-                break;
-            }
-            case OBJ_CLOSURE: {
-                auto* closure = (ObjClosure*) object;
-                markObject((Obj*) closure->function);
-                for (int i=0;i<closure->upvalues.count;i++){
-                    markObject((Obj*) closure->upvalues[i]);
-                }
-                break;
-            }
-            case OBJ_UPVALUE: {
-                auto* val = (ObjUpvalue*) object;
-                markValue(val->closed);
-                break;
+    switch (object->type) {
+        case OBJ_STRING:
+        case OBJ_NATIVE:
+            break;
+
+        case OBJ_FUNCTION: {
+            auto* function = (ObjFunction*) object;
+            markObject((Obj*) function->name);
+            for (int i=0;i<function->chunk->getConstantsSize();i++){
+                markValue(function->chunk->getConstant(i));
             }
-            case OBJ_CLASS: {
-                auto* val = (ObjClass*) object;
-                markObject((Obj*) val->name);
-                markTable(*val->methods);
-                break;
+            // Caches hold strong references so a freed shape's address can't be reused and hit a stale entry.
+            for (int i=0;i<function->chunk->getInlineCacheCount();i++){
+                InlineCache* cache = function->chunk->getInlineCache(i);
+                markObject((Obj*) cache->shape);
+                markObject((Obj*) cache->method);
             }
-            case OBJ_INSTANCE: {
-                auto* val = (ObjInstance*) object;
-                markObject((Obj*) val->klass);
-                markTable(*val->fields);
-                break;
+            break;
+        }
+        case OBJ_CLOSURE: {
+            auto* closure = (ObjClosure*) object;
+            markObject((Obj*) closure->function);
+            for (int i=0;i<closure->upvalues.count;i++){
+                markObject((Obj*) closure->upvalues[i]);
             }
-            case OBJ_BOUND_METHOD: {
-                auto* val = (ObjBoundMethod*) object;
-                markObject((Obj*) val->method);
-                markValue(val->receiver);
-                break;
+            break;
+        }
+        case OBJ_UPVALUE: {
+            auto* val = (ObjUpvalue*) object;
+            markValue(val->closed);
+            break;
+        }
+        case OBJ_CLASS: {
+            auto* val = (ObjClass*) object;
+            markObject((Obj*) val->name);
+            markTable(*val->methods);
+            markObject((Obj*) val->rootShape);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            auto* val = (ObjInstance*) object;
+            markObject((Obj*) val->klass);
+            if (val->shape == nullptr) {
+                markTable(*val->dictionary);
+            } else {
+                markObject((Obj*) val->shape);
+                for (uint32_t i=0;i<val->shape->fieldCount;i++){
+                    markValue(val->fields[i]);
+                }
             }
-            case OBJ_FREED: {
-                cerr << "ICE: marked already freed obj at " << (void*) object << endl;
-                break;
+            break;
+        }
+        case OBJ_SHAPE: {
+            // The whole tree stays alive as long as the class does.
+            auto* val = (ObjShape*) object;
+            markObject((Obj*) val->klass);
+            markObject((Obj*) val->parent);
+            markTable(*val->slots);
+            markTable(*val->transitions);
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            auto* val = (ObjBoundMethod*) object;
+            markObject((Obj*) val->method);
+            markValue(val->receiver);
+            break;
+        }
+        case OBJ_LIST: {
+            auto* val = (ObjList*) object;
+            for (uint32_t i=0;i<val->values.count;i++){
+                markValue(val->values[i]);
             }
-            default: {
-                cerr << "ICE: marked untagged obj at " << (void*) object << endl;
+            break;
+        }
+        case OBJ_MAP: {
+            ValueTable* table = ((ObjMap*) object)->table;
+            for (uint32_t i=0;i<table->capacity;i++){
+                ValueEntry* entry = table->entries + i;
+                if (!ValueTable::isEmpty(entry)) {
+                    markValue(entry->key);
+                    markValue(entry->value);
+                }
             }
+            break;
+        }
+        case OBJ_ROPE: {
+            auto* val = (ObjRope*) object;
+            markObject(val->left);
+            markObject(val->right);
+            markObject((Obj*) val->flat);
+            break;
+        }
+        case OBJ_STRING_VIEW: {
+            auto* val = (ObjStringView*) object;
+            markObject((Obj*) val->parent);
+            markObject((Obj*) val->flat);
+            break;
+        }
+        case OBJ_FREED: {
+            cerr << "ICE: marked already freed obj at " << (void*) object << endl;
+            break;
+        }
+        default: {
+            cerr << "ICE: marked untagged obj at " << (void*) object << endl;
         }
     }
 }
@@ -415,33 +1017,49 @@ void Memory::traceReferences() {
 void Memory::sweep() {
     Obj** prevDotNext= &objects;
     Obj* object = objects;
-    int markedCount = 0;
     while (object != nullptr) {
 #ifdef DEBUG_LOG_GC
         fprintf(stderr, "%p sweep\n", (void*)object);
 #endif
         if (object->isMarked) {
+            object->isMarked = false;
             prevDotNext = &object->next;
             object = object->next;
-            markedCount++;
         } else {
             *prevDotNext = object->next;
             freeObject(object);
             object = *prevDotNext;
         }
     }
+}
 
-    // TODO!: this sucks. instead just flip the expected flag each iteration
-    //        the constructor will need to know the right initial flag
-    object = objects;
+// Frees the whole nursery except what was marked, which gets promoted to the old generation.
+void Memory::sweepYoung() {
+    Obj* object = youngObjects;
     while (object != nullptr) {
-        object->isMarked = false;
-        object = object->next;
-        markedCount--;
+#ifdef DEBUG_LOG_GC
+        fprintf(stderr, "%p sweep young\n", (void*)object);
+#endif
+        Obj* next = object->next;
+        if (object->isMarked) {
+            object->isMarked = false;
+            object->isOld = true;
+            object->next = objects;
+            objects = object;
+        } else {
+            freeObject(object);
+        }
+        object = next;
     }
-    if (markedCount != 0) {
-        cerr << "markedCount=" << markedCount << endl;
+    youngObjects = nullptr;
+}
+
+// After a collection nothing is young so no old object can point to the nursery.
+void Memory::forgetRemembered() {
+    for (Obj* object : rememberedSet) {
+        object->isRemembered = false;
     }
+    rememberedSet.clear();
 }
 
 void Memory::markValue(Value value) {
@@ -451,6 +1069,7 @@ void Memory::markValue(Value value) {
 void Memory::markObject(Obj* object) {
     if (object == nullptr) return;
     if (object->isMarked) return;
+    if (isMinorGC && object->isOld) return;
 #ifdef DEBUG_LOG_GC
     fprintf(stderr, "%p mark ", (void*)object);
     printValue(OBJ_VAL(object), &cerr);
@@ -471,3 +1090,27 @@ void Memory::markTable(Table& table) {
         }
     }
 }
+
+void Memory::recordPause([[maybe_unused]] uint64_t startMicros) {
+#ifdef GC_PAUSE_HISTOGRAM
+    uint64_t pause = nowMicros() - startMicros;
+    int bucket = 0;
+    while (bucket < 31 && (1ull << bucket) <= pause) bucket++;
+    pauseCounts[bucket]++;
+    totalPauseMicros += pause;
+    if (pause > maxPauseSeen) maxPauseSeen = pause;
+#endif
+}
+
+void Memory::printPauseHistogram() {
+#ifdef GC_PAUSE_HISTOGRAM
+    uint64_t total = 0;
+    for (uint64_t count : pauseCounts) total += count;
+    fprintf(stderr, "GC pauses: %lu, total %lu us, max %lu us\n", total, totalPauseMicros, maxPauseSeen);
+    for (int i=0;i<32;i++){
+        if (pauseCounts[i] == 0) continue;
+        uint64_t low = i == 0 ? 0 : 1ull << (i - 1);
+        fprintf(stderr, "%10lu - %-10lu us: %8lu (%5.2f%%)\n", low, 1ull << i, pauseCounts[i], (double) pauseCounts[i] / (double) total * 100);
+    }
+#endif
+}
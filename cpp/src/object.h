@@ -5,6 +5,7 @@ class Memory;
 typedef struct Value Value;
 
 #include "common.h"
+#include "allocator.h"
 #include <vector>
 
 // TODO: Could rewrite as a class but for now i want to make sure i understand how it works without.
@@ -20,6 +21,13 @@ typedef struct Value Value;
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value)     isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_STRING_VIEW(value) isObjType(value, OBJ_STRING_VIEW)
+// A flat string, rope or view. Inline since the arithmetic opcodes check it on every string add.
+#define IS_ANY_STRING(value) (IS_OBJ(value) && (OBJ_TYPE(value) == OBJ_STRING || isLazyString(AS_OBJ(value))))
 
 #define AS_FUNCTION(value)       ((ObjFunction *)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
@@ -28,6 +36,11 @@ typedef struct Value Value;
 #define AS_CLASS(value)       ((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value)       ((ObjInstance*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value)       ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_SHAPE(value)       ((ObjShape*)AS_OBJ(value))
+#define AS_LIST(value)       ((ObjList*)AS_OBJ(value))
+#define AS_MAP(value)       ((ObjMap*)AS_OBJ(value))
+#define AS_ROPE(value)       ((ObjRope*)AS_OBJ(value))
+#define AS_STRING_VIEW(value)       ((ObjStringView*)AS_OBJ(value))
 
 
 #define ALLOCATE(type, length) (type*) reallocate(nullptr, 0, sizeof(type) * length)
@@ -44,7 +57,12 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_FREED,
-    OBJ_BOUND_METHOD
+    OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
+    OBJ_LIST,
+    OBJ_MAP,
+    OBJ_ROPE,
+    OBJ_STRING_VIEW
 } ObjType;
 
 typedef struct ObjString ObjString;
@@ -52,6 +70,18 @@ typedef struct Table Table;
 typedef struct Set Set;
 typedef struct ObjInstance ObjInstance;
 typedef struct ObjBoundMethod ObjBoundMethod;
+typedef struct ObjShape ObjShape;
+typedef struct ObjList ObjList;
+typedef struct ObjMap ObjMap;
+typedef struct ObjRope ObjRope;
+typedef struct ObjStringView ObjStringView;
+
+// An instance that needs more fields than this stops sharing shapes and keeps its own hash table instead.
+#define SHAPE_MAX_FIELDS 64
+
+// Joining strings into anything shorter than this copies them into a new string straight away.
+// Longer results are ropes, which are cheap to make but have to be flattened before most uses.
+#define ROPE_MIN_LENGTH 64
 
 struct Obj {
     ObjType type;
@@ -62,8 +92,15 @@ struct Obj {
     // That's easy enough that it's not worth the overhead of an extra pointer on every single Obj.
     struct Obj* next;  // TODO: what does the struct keyword do here?
     bool isMarked;
+    bool isOld;  // survived a collection so it lives in Memory::objects instead of the nursery
+    bool isRemembered;  // is in Memory::rememberedSet
 };
 
+// A rope or view. Something that acts like a string but isn't interned until it has to be.
+inline bool isLazyString(Obj* object) {
+    return object->type == OBJ_ROPE || object->type == OBJ_STRING_VIEW;
+}
+
 struct ObjArray {
     Obj obj;
     uint32_t length;
@@ -92,6 +129,11 @@ typedef struct {
     Chunk* chunk;
     ObjString* name;
     int upvalueCount;
+    int maxLocals;  // the most stack slots its locals use at once, including slot zero
+#ifdef VM_JIT
+    uint32_t hotness;  // calls plus loop iterations in the interpreter so far
+    struct JitCode* jit;  // null until it's hot
+#endif
 } ObjFunction;
 
 typedef Value (*NativeFn)(VM* vm, Value* args);
@@ -116,6 +158,10 @@ typedef struct ObjClass {
     Obj obj;
     ObjString* name;
     Table* methods;
+    ObjShape* rootShape;  // the shape of an instance with no fields. created by the first instance.
+    // The most fields any instance has needed so far. New instances reserve that many inline slots
+    // so the common case of every instance getting the same fields in init doesn't need a separate array.
+    uint32_t instanceFieldsHint;
 } ObjClass;
 
 
@@ -125,6 +171,10 @@ void printObject(Value value);
 void printObjectOwnedAddresses(Value value);
 uint32_t hashString(const char* chars, uint32_t length);
 void printObjectsList(Obj* head);
+uint32_t stringLength(Obj* text);
+void copyStringChars(Obj* text, char* dest);
+bool lazyStringsEqual(Obj* a, Obj* b);
+uint32_t hashLazyString(Obj* text);
 
 static void linkObjects(Obj** head, Obj* additional) {
     Obj* end = additional;
@@ -148,23 +198,58 @@ typedef struct {
 } CallFrame;
 
 class Table;
+class ValueTable;
 class Set;
 
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING
+} GCPhase;
+
 class Memory {
 public:
     // interned strings. prevents allocating separate memory for duplicated identical strings.
     Set* strings;
     Table* natives;
     // a linked list of all Values with heap allocated memory, so we can free them when we terminate.
+    // Only old objects live here. New ones start in <youngObjects> and move over if they survive a collection.
     Obj* objects;
+    Obj* youngObjects;
+    // Old objects that had a young object stored in them since the last collection.
+    // A minor collection doesn't trace the old generation, so these are treated as extra roots.
+    vector<Obj*> rememberedSet;
+    bool isMinorGC;
+    size_t bytesSinceMinorGC;
+
+    // State of an incremental full collection. Minor collections wait until it's finished.
+    GCPhase gcPhase;
+    uint32_t maxPauseMicros;
+    Obj** sweepCursor;  // the link to the next old object to sweep. null once the old generation is done.
+    Obj* condemnedYoung;  // the nursery as it was when marking finished. swept after the old generation.
+    int remarkCount;
+    // How many collections have started. Written out by lox -j.
+    uint64_t fullCollections = 0;
+    uint64_t youngCollections = 0;
+
+#ifdef GC_PAUSE_HISTOGRAM
+    // pauseCounts[i] is how many pauses took less than 2^i microseconds (and at least 2^(i-1)).
+    uint64_t pauseCounts[32];
+    uint64_t totalPauseMicros;
+    uint64_t maxPauseSeen;
+#endif
     ObjUpvalue* openUpvalues;
     vector<Obj*> grayStack;
     Value stack[STACK_MAX];  // working memory. my equivalent of registers
     Value* stackTop;  // where the next value will be inserted
     ObjString* init = nullptr;
+    ObjString* singleChars[256] = {};  // every one character string, made up front so indexing a string never allocates
 
     size_t bytesAllocated;
     size_t nextGC;
+#ifndef GC_NO_POOL_ALLOCATOR
+    SizeClassAllocator pool;
+#endif
 
     CallFrame frames[FRAMES_MAX];  // it annoys me to have a separate bonus stack instead of storing return addresses in the normal value stack
     int frameCount;
@@ -181,7 +266,24 @@ public:
     ObjUpvalue* newUpvalue(Value* function);
     ObjClass* newClass(ObjString* name);
     ObjInstance* newInstance(ObjClass* klass);
+    ObjShape* newShape(ObjClass* klass, ObjShape* parent);
+    ObjShape* shapeWithField(ObjShape* shape, ObjString* name);
+    void setField(ObjInstance* instance, ObjString* name, Value value);
+    void growFields(ObjInstance* instance, uint32_t minCapacity);
+    void makeDictionary(ObjInstance* instance);
     ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
+    ObjList* newList(Value* values, uint32_t count);
+    ObjMap* newMap();
+    ObjRope* newRope(Obj* left, Obj* right, uint32_t length);
+    ObjStringView* newStringView(ObjString* parent, uint32_t start, uint32_t length);
+    ObjString* flattenString(Obj* text);
+
+    // The string a rope or view stands for, so it can be used anywhere that expects an ObjString. Anything else is returned as it was.
+    // The rope or view must be reachable by the gc (on the stack is fine) since flattening allocates.
+    inline Value flatten(Value value) {
+        if (IS_OBJ(value) && isLazyString(AS_OBJ(value))) return OBJ_VAL(flattenString(AS_OBJ(value)));
+        return value;
+    }
     void markTable(Table& table);
     ObjNative* newNative(NativeFn function, uint8_t arity, ObjString* name);
     inline void freeStringChars(ObjString* string){
@@ -190,12 +292,47 @@ public:
 
     void* reallocate(void* pointer, size_t oldSize, size_t newSize);
     void collectGarbage();
+    void collectYoungGarbage();
+    void collectIfNeeded();
+    void startIncrementalGC();
+    void incrementalStep();
+    void finishMarking();
+    void sweepOne();
+    void incrementalBarrier(Obj* owner, Obj* target);
     void markRoots();
     void traceReferences();
+    void blacken(Obj* object);
     void sweep();
+    void sweepYoung();
+    void forgetRemembered();
+    void recordPause(uint64_t startMicros);
+    void printPauseHistogram();
     void markValue(Value value);
     void markObject(Obj* object);
 
+    // During a minor collection the old generation isn't traced so everything in it counts as alive.
+    inline bool isAlive(Obj* object) {
+        return object->isMarked || (isMinorGC && object->isOld);
+    }
+
+    // Must be called after storing <target> into <owner> unless <owner> was allocated since the last possible collection.
+    inline void writeBarrier(Obj* owner, Obj* target) {
+#ifdef GC_INCREMENTAL
+        if (gcPhase != GC_IDLE) {
+            if (target != nullptr) incrementalBarrier(owner, target);
+            return;
+        }
+#endif
+        if (owner->isOld && !owner->isRemembered && target != nullptr && !target->isOld) {
+            owner->isRemembered = true;
+            rememberedSet.push_back(owner);
+        }
+    }
+
+    inline void writeBarrier(Obj* owner, Value value) {
+        if (IS_OBJ(value)) writeBarrier(owner, AS_OBJ(value));
+    }
+
     void push(Value value){
         // TODO: bounds check
         *stackTop = value;
@@ -219,13 +356,84 @@ typedef struct ObjClosure {
     ArrayList<ObjUpvalue*> upvalues;
 } ObjClosure;
 
+// What [a, b, c] makes. Indexed like a string but mutable and grows with push().
+struct ObjList {
+    Obj obj;
+    ArrayList<Value> values;
+};
+
+// What {key: value} makes. Keys are compared like ==, so strings and numbers by value and other objects by identity.
+struct ObjMap {
+    Obj obj;
+    ValueTable* table;
+};
+
+// What + makes when the result is long. The two halves aren't copied until something needs the characters
+// in one place (indexing, hashing, ==), then <flat> caches the interned string and the halves are dropped.
+// So a loop that keeps adding to a string is linear instead of copying everything so far on every step.
+struct ObjRope {
+    Obj obj;
+    uint32_t length;
+    Obj* left;  // an ObjString or ObjRope. null once flattened
+    Obj* right;
+    ObjString* flat;  // null until flattened
+};
+
+// What a slice of a string makes. Points into <parent> instead of copying, so walking a long string a piece at a time
+// doesn't hash and intern every piece. Only flattened (copied out and interned) if it's hashed or compared.
+struct ObjStringView {
+    Obj obj;
+    uint32_t length;
+    uint32_t start;
+    ObjString* parent;  // always flat. null once flattened
+    ObjString* flat;
+};
+
+// The first character of a flat string or view. A rope has to be flattened first.
+inline const char* stringChars(Obj* text) {
+    if (text->type == OBJ_STRING_VIEW) return asCString(((ObjStringView*) text)->parent) + ((ObjStringView*) text)->start;
+    return asCString((ObjString*) text);
+}
+
+// A flattened rope or view is just a slower way to get to its string.
+inline Obj* skipFlattened(Obj* text) {
+    ObjString* flat = nullptr;
+    if (text->type == OBJ_ROPE) flat = ((ObjRope*) text)->flat;
+    else if (text->type == OBJ_STRING_VIEW) flat = ((ObjStringView*) text)->flat;
+    return flat == nullptr ? text : (Obj*) flat;
+}
+
+// A hidden class. Says which index in ObjInstance::fields holds each field name.
+// Shapes form a tree per class. Adding a field follows (or creates) a transition to a child shape,
+// so instances that add the same fields in the same order end up sharing one shape.
+struct ObjShape {
+    Obj obj;
+    ObjClass* klass;
+    ObjShape* parent;
+    uint32_t fieldCount;
+    Table* slots;  // name -> index of every field in this shape
+    Table* transitions;  // name -> the shape with that field added
+};
+
 struct ObjInstance {
     Obj obj;
     ObjClass* klass;
-    // TODO: this doesnt need the level of indirection. ive just gotten myself in a hole by being bad at c++ when I started
-    Table* fields;
+    // nullptr once the instance has fallen back to dictionary mode.
+    ObjShape* shape;
+    // Indexed by shape->slots. Points to the inline slots allocated after the struct, unless it outgrew them.
+    Value* fields;
+    uint32_t capacity;
+    uint32_t inlineCapacity;
+    Table* dictionary;  // only used in dictionary mode
+
+    inline Value* inlineFields() {
+        return (Value*) (this + 1);
+    }
 };
 
+bool getField(ObjInstance* instance, ObjString* name, Value* valueOut);
+int getFieldSlot(ObjInstance* instance, ObjString* name);
+
 
 struct ObjBoundMethod {
     Obj obj;
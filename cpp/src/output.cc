@@ -0,0 +1,45 @@
+#include "output.h"
+#include <cstring>
+
+OutputBuffer::OutputBuffer(FILE* file) : file(file) {
+    buffer = new char[OUTPUT_BUFFER_SIZE];
+    setp(buffer, buffer + OUTPUT_BUFFER_SIZE);
+}
+
+OutputBuffer::~OutputBuffer() {
+    sync();
+    delete[] buffer;
+}
+
+void OutputBuffer::writeBuffered() {
+    size_t length = pptr() - pbase();
+    if (length > 0) fwrite(buffer, 1, length, file);
+    setp(buffer, buffer + OUTPUT_BUFFER_SIZE);
+}
+
+// Only called when the buffer is full. Every other character is written straight into it by the stream.
+OutputBuffer::int_type OutputBuffer::overflow(int_type c) {
+    writeBuffered();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+// Anything that doesn't fit goes straight to the file rather than being copied through the buffer in pieces.
+std::streamsize OutputBuffer::xsputn(const char* text, std::streamsize count) {
+    if (count <= epptr() - pptr()) {
+        memcpy(pptr(), text, count);
+        pbump((int) count);
+        return count;
+    }
+    writeBuffered();
+    if (count < OUTPUT_BUFFER_SIZE) return xsputn(text, count);
+    return (std::streamsize) fwrite(text, 1, count, file);
+}
+
+int OutputBuffer::sync() {
+    writeBuffered();
+    return fflush(file) == 0 ? 0 : -1;
+}
@@ -0,0 +1,28 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include <cstdio>
+#include <streambuf>
+#include "common.h"
+
+// What the native vm prints to. It collects output and writes it to the file in one go when the buffer fills
+// or when it's flushed (a runtime error, flush() in lox, reading input or the script finishing).
+// Going through cout with endl would call write() for every print.
+class OutputBuffer : public std::streambuf {
+public:
+    explicit OutputBuffer(FILE* file);
+    ~OutputBuffer() override;
+
+protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char* text, std::streamsize count) override;
+    int sync() override;
+
+private:
+    FILE* file;
+    char* buffer;
+
+    void writeBuffered();
+};
+
+#endif
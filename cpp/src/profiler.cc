@@ -0,0 +1,157 @@
+#include "profiler.h"
+#include "vm.h"
+#include <algorithm>
+#include <csignal>
+#include <unordered_set>
+#include <vector>
+#ifndef __EMSCRIPTEN__
+#include <sys/time.h>
+#endif
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+#define HAS_PERF_EVENTS
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+std::atomic<int> SamplingProfiler::pendingTicks(0);
+bool SamplingProfiler::running = false;
+
+static_assert(sizeof(std::atomic<int>) == sizeof(int) && std::atomic<int>::is_always_lock_free, "the jit reads pendingTicks as a plain int");
+
+static void onProfileSignal(int) {
+    SamplingProfiler::pendingTicks.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool SamplingProfiler::start(int samplesPerSecond) {
+#ifdef __EMSCRIPTEN__
+    return false;
+#else
+    struct sigaction action = {};
+    action.sa_handler = onProfileSignal;
+    action.sa_flags = SA_RESTART;  // so reading input or writing output doesn't fail with EINTR
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, nullptr) != 0) return false;
+
+    struct itimerval timer = {};
+    timer.it_interval.tv_usec = 1000000 / samplesPerSecond;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) return false;
+    running = true;
+    return true;
+#endif
+}
+
+void SamplingProfiler::stop() {
+#ifndef __EMSCRIPTEN__
+    struct itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    signal(SIGPROF, SIG_IGN);
+#endif
+    running = false;
+}
+
+// The running frame's ip is the instruction it's about to do. The others are just past the call they're waiting on.
+void SamplingProfiler::sample(VM* vm) {
+    int ticks = pendingTicks.exchange(0, std::memory_order_relaxed);
+    if (ticks == 0) return;
+
+    string stack;
+    for (int i = 0; i < vm->gc.frameCount; i++) {
+        CallFrame* frame = &vm->gc.frames[i];
+        ObjFunction* function = frame->closure->function;
+        bool top = i == vm->gc.frameCount - 1;
+        int offset = (int) ((top ? vm->ip : frame->ip) - function->chunk->getCodePtr()) - (top ? 0 : 1);
+
+        if (i > 0) stack += ';';
+        stack += function->name == nullptr ? "script" : (char*) function->name->array.contents;
+        stack += ':';
+        stack += to_string(function->chunk->getLineNumber(offset));
+    }
+    stacks[stack] += ticks;
+    totalTicks += ticks;
+}
+
+bool SamplingProfiler::write(const char* path) {
+    vector<pair<string, uint64_t>> sorted(stacks.begin(), stacks.end());
+    sort(sorted.begin(), sorted.end());
+
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) return false;
+    for (auto& entry : sorted) {
+        fprintf(file, "%s %llu\n", entry.first.c_str(), (unsigned long long) entry.second);
+    }
+    bool failed = ferror(file);
+    if (fclose(file) != 0 || failed) return false;
+
+    // Self is samples where the function was running, total where it was anywhere on the stack.
+    unordered_map<string, pair<uint64_t, uint64_t>> functions;
+    for (auto& entry : sorted) {
+        unordered_set<string> seen;
+        size_t start = 0;
+        while (start < entry.first.size()) {
+            size_t end = entry.first.find(';', start);
+            if (end == string::npos) end = entry.first.size();
+            string name = entry.first.substr(start, entry.first.rfind(':', end - 1) - start);
+            if (seen.insert(name).second) functions[name].second += entry.second;
+            if (end == entry.first.size()) functions[name].first += entry.second;
+            start = end + 1;
+        }
+    }
+    vector<pair<string, pair<uint64_t, uint64_t>>> bySelf(functions.begin(), functions.end());
+    sort(bySelf.begin(), bySelf.end(), [](auto& a, auto& b) { return a.second.first > b.second.first; });
+
+    fprintf(stderr, "%llu samples written to %s\n", (unsigned long long) totalTicks, path);
+    if (totalTicks == 0) return true;
+    fprintf(stderr, "%7s %7s  %s\n", "self", "total", "function");
+    for (size_t i = 0; i < bySelf.size() && i < 10; i++) {
+        fprintf(stderr, "%6.1f%% %6.1f%%  %s\n", 100.0 * bySelf[i].second.first / totalTicks,
+                100.0 * bySelf[i].second.second / totalTicks, bySelf[i].first.c_str());
+    }
+    return true;
+}
+
+#ifdef HAS_PERF_EVENTS
+// Counts user space only. The group leader starts disabled so both counters are switched on together.
+static int openCounter(uint64_t config, int group) {
+    struct perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+bool HardwareCounters::start() {
+#ifdef HAS_PERF_EVENTS
+    cyclesFd = openCounter(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (cyclesFd < 0) return false;
+    instructionsFd = openCounter(PERF_COUNT_HW_INSTRUCTIONS, cyclesFd);
+    if (instructionsFd < 0) return false;
+    ioctl(cyclesFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(cyclesFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void HardwareCounters::stop() {
+#ifdef HAS_PERF_EVENTS
+    if (instructionsFd < 0) return;
+    ioctl(cyclesFd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    available = read(cyclesFd, &cycles, sizeof(cycles)) == sizeof(cycles)
+             && read(instructionsFd, &instructions, sizeof(instructions)) == sizeof(instructions);
+#endif
+}
+
+HardwareCounters::~HardwareCounters() {
+#ifdef HAS_PERF_EVENTS
+    if (instructionsFd >= 0) close(instructionsFd);
+    if (cyclesFd >= 0) close(cyclesFd);
+#endif
+}
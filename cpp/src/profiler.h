@@ -0,0 +1,56 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include "common.h"
+
+class VM;
+
+// Samples what a script is doing on a SIGPROF timer (lox -p path) and writes the stacks it saw in the collapsed format
+// that flamegraph.pl, inferno and speedscope read: one line per distinct stack, the frames from the script down joined
+// by ';' then the number of samples. Each frame is the function and the line it was on, like fib:12.
+//
+// The signal handler only counts ticks. Walking the frames from inside it could catch a call half set up,
+// so VM::run checks the count where the frames and ip are always up to date (a frame starting or resuming, and loops)
+// and records the stack there for however many ticks were waiting. So time in straight line code is charged to the
+// next call, return or loop, which is almost always in the same function on the same or the next line.
+class SamplingProfiler {
+public:
+    static std::atomic<int> pendingTicks;
+    static bool running;  // the jit adds the same check to loops while this is set
+
+    // Returns false if the timer couldn't be set up.
+    bool start(int samplesPerSecond);
+    void stop();
+    void sample(VM* vm);
+
+    // Returns false if the file couldn't be written. Prints the functions that took the most time to stderr.
+    bool write(const char* path);
+
+private:
+    unordered_map<string, uint64_t> stacks;
+    uint64_t totalTicks = 0;
+};
+
+// The cpu's own count of cycles and instructions while the script runs, through perf_event_open.
+// Reading them costs a system call so they only cover the whole run, not each instruction.
+// Only on Linux, and only where the kernel lets a process count itself (see /proc/sys/kernel/perf_event_paranoid).
+class HardwareCounters {
+public:
+    bool available = false;
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+
+    ~HardwareCounters();
+    // Returns false if the counters aren't available.
+    bool start();
+    void stop();
+
+private:
+    int cyclesFd = -1;
+    int instructionsFd = -1;
+};
+
+#endif
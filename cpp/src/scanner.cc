@@ -6,6 +6,7 @@ Scanner::Scanner(char* src){
     start = src;
     current = start;
     line = 0;
+    startCol = 1;
     nextLine();
 }
 
@@ -21,6 +22,7 @@ void Scanner::nextLine(){
 Token Scanner::scanToken() {
     skipWhitespace();
     start = current;
+    startCol = col + 2;
 
     if (isAtEnd()) return makeToken(TOKEN_EOF);
     char c = advance();
@@ -214,7 +216,7 @@ Token Scanner::errorToken(const char *message) const {
     token.start = message;
     token.length = (int)strlen(message);
     token.line = line;
-    token.col = col;
+    token.col = startCol;
     return token;
 }
 
@@ -224,7 +226,7 @@ Token Scanner::makeToken(TokenType type) {
     token.start = start;
     token.length = (int)(current - start);
     token.line = line;
-    token.col = col;
+    token.col = startCol;
     return token;
 }
 
@@ -31,7 +31,7 @@ typedef struct {
     const char* start;
     int length;
     int line;
-    int col;
+    int col;  // where the token starts, counting from 1
 } Token;
 
 class Scanner {
@@ -43,7 +43,8 @@ private:
     char* start;
     char* current;
     int line;
-    int col;
+    int col;  // of the last character read. -1 at the start of a line.
+    int startCol;
 
     void nextLine();
     void skipWhitespace();
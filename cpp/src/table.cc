@@ -1,24 +1,88 @@
 #include "table.h"
 
+#ifdef TABLE_SWISS
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#endif
+
 #define TABLE_MAX_LOAD 0.75
 // Note: staying a power of 2 is important
+#ifdef TABLE_SWISS
+#define GROUP_WIDTH 16
+#define GROW_CAPACITY(old) (old == 0 ? GROUP_WIDTH : old * 2)
+#else
 #define GROW_CAPACITY(old) (old == 0 ? 8 : old * 2)
+#endif
+
+#ifdef TABLE_SWISS
+// The only control bytes with the high bit set. A full entry's is 7 bits of its hash.
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xFE
+
+#define CONTROL_HASH(hash) ((uint8_t) ((hash) & 0x7F))
+// The rest of the hash picks the group to start at, so the 7 bits in the control byte are independent of it.
+#define GROUP_HASH(hash) ((hash) >> 7)
+
+// Bit i is set if group[i] == value, for the 16 control bytes of a group.
+static inline uint32_t matchByte(const uint8_t* group, uint8_t value) {
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128((const __m128i*) group);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char) value)));
+#else
+    uint32_t mask = 0;
+    for (int i=0;i<GROUP_WIDTH;i++){
+        if (group[i] == value) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Bit i is set if group[i] is empty or deleted.
+static inline uint32_t matchAvailable(const uint8_t* group) {
+#ifdef __SSE2__
+    return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group));
+#else
+    uint32_t mask = 0;
+    for (int i=0;i<GROUP_WIDTH;i++){
+        if (group[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
 
-Table::Table(Memory& gc) : gc(gc) {
+static inline size_t allocationSize(uint32_t capacity) {
+    return (sizeof(Entry) + 1) * capacity;
+}
+#endif
+
+Table::Table(Memory& gc, Obj* owner) : gc(gc), owner(owner) {
     count = 0;
     capacity = 0;
     entries = nullptr;
     maxEntries = 0;
+#ifdef TABLE_SWISS
+    control = nullptr;
+#endif
 }
 
 Table::~Table() {
-    gc.FREE_ARRAY(Entry, entries, capacity);
+    freeEntries();
     count = 0;
     capacity = 0;
     entries = nullptr;
     maxEntries = 0;
 }
 
+void Table::freeEntries() {
+#ifdef TABLE_SWISS
+    gc.reallocate(entries, allocationSize(capacity), 0);
+    control = nullptr;
+#else
+    gc.FREE_ARRAY(Entry, entries, capacity);
+#endif
+}
+
 // returns true if the key was not already in the table. false if it was in the table and its value was replaced.
 bool Table::set(ObjString *key, Value value) {
     Entry* entry = findEntry(key);
@@ -38,6 +102,13 @@ bool Table::setEntry(Entry* entry, ObjString *key, Value value){
     }
     entry->key = key;
     entry->value = value;
+#ifdef TABLE_SWISS
+    control[entry - entries] = CONTROL_HASH(key->hash);
+#endif
+    if (owner != nullptr) {
+        gc.writeBarrier(owner, (Obj*) key);
+        gc.writeBarrier(owner, value);
+    }
     return isNewKey;
 }
 
@@ -49,24 +120,102 @@ bool Table::get(ObjString *key, Value *valueOut) {
     return true;
 }
 
-// does not decrement count because the tombstone is still there and should be included in load.
 bool Table::remove(ObjString *key) {
     if (count == 0) return false;
     Entry* entry = findEntry(key);
     if (isEmpty(entry)) return false;
+    removeEntry(entry);
+    return true;
+}
+
+// does not decrement count because the tombstone is still there and should be included in load.
+void Table::removeEntry(Entry* entry) {
     entry->key = nullptr;
+#ifdef TABLE_SWISS
+    // A probe only goes past a group with no empty entries in it. If this one has any, nothing can
+    // be relying on this entry to keep going, so it can just be empty instead of a tombstone.
+    uint32_t index = (uint32_t) (entry - entries);
+    if (matchByte(control + (index & ~(GROUP_WIDTH - 1)), CONTROL_EMPTY) != 0) {
+        control[index] = CONTROL_EMPTY;
+        entry->value = NIL_VAL();
+        count--;
+        return;
+    }
+    control[index] = CONTROL_DELETED;
+#endif
     entry->value = BOOL_VAL(true);
-    return true;
 }
 
 void Table::removeAll(){
-    gc.FREE_ARRAY(Entry, entries, capacity);
+    freeEntries();
     maxEntries = 0;
     count = 0;
     capacity = 0;
     entries = nullptr;
 }
 
+#ifdef TABLE_SWISS
+
+// Checks one group of 16 at a time. The triangular steps between groups visit every one of them
+// since there's a power of 2, and there's always an empty entry somewhere since the load is below 1.
+Entry* Table::findEntry(ObjString *key){
+    if (capacity == 0) adjustCapacity();
+    uint32_t groupMask = capacity / GROUP_WIDTH - 1;
+    uint32_t group = GROUP_HASH(key->hash) & groupMask;
+    uint8_t hashByte = CONTROL_HASH(key->hash);
+    Entry* available = nullptr;
+
+    for (uint32_t step = 1;; step++){
+        uint8_t* groupControl = control + group * GROUP_WIDTH;
+        Entry* groupEntries = entries + group * GROUP_WIDTH;
+        for (uint32_t matches = matchByte(groupControl, hashByte); matches != 0; matches &= matches - 1){
+            Entry* slot = groupEntries + __builtin_ctz(matches);
+            if (slot->key == key) return slot;  // since strings are interned, this equality check works.
+        }
+        if (available == nullptr) {
+            uint32_t free = matchAvailable(groupControl);
+            if (free != 0) available = groupEntries + __builtin_ctz(free);
+        }
+        if (matchByte(groupControl, CONTROL_EMPTY) != 0) return available;
+
+        group = (group + step) & groupMask;
+    }
+}
+
+void Table::adjustCapacity() {
+    Entry* oldEntries = entries;
+    uint32_t oldCapacity = capacity;
+
+    // The allocation can run the gc, which needs to see the old entries until they've been moved.
+    uint32_t newCapacity = GROW_CAPACITY(oldCapacity);
+    Entry* newEntries = (Entry*) gc.reallocate(nullptr, 0, allocationSize(newCapacity));
+    capacity = newCapacity;
+    entries = newEntries;
+    control = (uint8_t*) (entries + capacity);
+    for (uint32_t i=0;i<capacity;i++){
+        setEmpty(entries + i);
+    }
+    memset(control, CONTROL_EMPTY, capacity);
+
+    int newCount = 0;
+    for (uint32_t i=0;i<oldCapacity;i++){
+        Entry* original = oldEntries + i;
+        if (isEmpty(original)) continue;
+
+        newCount++;
+        Entry* slot = findEntry(original->key);
+        slot->key = original->key;
+        slot->value = original->value;
+        control[slot - entries] = CONTROL_HASH(original->key->hash);
+    }
+
+    gc.reallocate(oldEntries, allocationSize(oldCapacity), 0);
+    count = newCount;
+    maxEntries = (int) (capacity * TABLE_MAX_LOAD);
+}
+
+#else
+
 Entry* Table::findEntry(ObjString *key){
     if (capacity == 0) adjustCapacity();
     return findEntry(entries, capacity, key);
@@ -124,6 +273,8 @@ void Table::adjustCapacity() {
     maxEntries = (int) (newCapacity * TABLE_MAX_LOAD);
 }
 
+#endif
+
 // Uses slow equality on the keys to ensure deduplication.
 // But values pointing to the old ones aren't reset so maybe this is a terrible system.
 void Table::safeAddAll(const Table& from) {
@@ -169,6 +320,39 @@ bool Table::contains(ObjString *key) {
 // The keys used in a table should always be put through a hash set using this method.
 // returns true if the string is already a key in the table.
 // <outEntry> is set to either the entry containing the value or the best one to put it in if not found.
+#ifdef TABLE_SWISS
+bool Table::safeFindEntry(const char* chars, uint32_t length, uint32_t hash, Entry** outEntry){
+    if (capacity == 0) adjustCapacity();
+    uint32_t groupMask = capacity / GROUP_WIDTH - 1;
+    uint32_t group = GROUP_HASH(hash) & groupMask;
+    uint8_t hashByte = CONTROL_HASH(hash);
+    Entry* available = nullptr;
+
+    for (uint32_t step = 1;; step++){
+        uint8_t* groupControl = control + group * GROUP_WIDTH;
+        Entry* groupEntries = entries + group * GROUP_WIDTH;
+        for (uint32_t matches = matchByte(groupControl, hashByte); matches != 0; matches &= matches - 1){
+            Entry* slot = groupEntries + __builtin_ctz(matches);
+            if (slot->key->array.length-1 == length &&
+                    slot->key->hash == hash &&
+                    memcmp(slot->key->array.contents, chars, length) == 0) {
+                *outEntry = slot;
+                return true;
+            }
+        }
+        if (available == nullptr) {
+            uint32_t free = matchAvailable(groupControl);
+            if (free != 0) available = groupEntries + __builtin_ctz(free);
+        }
+        if (matchByte(groupControl, CONTROL_EMPTY) != 0) {
+            *outEntry = available;
+            return false;
+        }
+
+        group = (group + step) & groupMask;
+    }
+}
+#else
 bool Table::safeFindEntry(const char* chars, uint32_t length, uint32_t hash, Entry** outEntry){
     if (capacity == 0) adjustCapacity();
     uint32_t index = hash & (capacity - 1);
@@ -192,6 +376,7 @@ bool Table::safeFindEntry(const char* chars, uint32_t length, uint32_t hash, Ent
         index = (index + 1) & (capacity - 1);
     }
 }
+#endif
 
 void Table::printContents() const {
     cout << "   HashTable count=" << count << " capacity=" << capacity << endl;
@@ -222,13 +407,118 @@ void Table::printContents() const {
 void Table::removeUnmarkedKeys() {
     for (uint32_t i=0;i<capacity;i++){
         Entry* entry = entries + i;
-        if (!isEmpty(entry) && !entry->key->array.obj.isMarked) {
+        if (!isEmpty(entry) && !gc.isAlive((Obj*) entry->key)) {
 #ifdef DEBUG_LOG_GC
             printf("%p table drop ", (void*)entry->key);
             printValue(OBJ_VAL(entry->key));
             cout << endl;
 #endif
-            remove(entry->key);  // TODO: dont need to re-find the entry
+            removeEntry(entry);
+        }
+    }
+}
+
+ValueTable::ValueTable(Memory& gc, Obj* owner) : gc(gc), owner(owner) {
+    count = 0;
+    size = 0;
+    capacity = 0;
+    entries = nullptr;
+    maxEntries = 0;
+}
+
+ValueTable::~ValueTable() {
+    gc.FREE_ARRAY(ValueEntry, entries, capacity);
+    count = 0;
+    size = 0;
+    capacity = 0;
+    entries = nullptr;
+    maxEntries = 0;
+}
+
+// returns true if the key was not already in the table. false if it was in the table and its value was replaced.
+bool ValueTable::set(Value key, Value value) {
+    if (capacity == 0) adjustCapacity();
+    ValueEntry* entry = findEntry(entries, capacity, key);
+    bool isNewKey = isEmpty(entry);
+    if (isNewKey) {
+        if (IS_NIL(entry->value)) {  // not reusing a tombstone
+            if (count + 1 > maxEntries) {
+                adjustCapacity();
+                entry = findEntry(entries, capacity, key);
+            }
+            count++;
+        }
+        size++;
+    }
+    entry->key = key;
+    entry->value = value;
+    gc.writeBarrier(owner, key);
+    gc.writeBarrier(owner, value);
+    return isNewKey;
+}
+
+bool ValueTable::get(Value key, Value* valueOut) {
+    if (size == 0) return false;
+    ValueEntry* entry = findEntry(entries, capacity, key);
+    if (isEmpty(entry)) return false;
+    *valueOut = entry->value;
+    return true;
+}
+
+// Leaves a tombstone that still counts towards the load, like Table::remove.
+bool ValueTable::remove(Value key) {
+    if (size == 0) return false;
+    ValueEntry* entry = findEntry(entries, capacity, key);
+    if (isEmpty(entry)) return false;
+    entry->key = NIL_VAL();
+    entry->value = BOOL_VAL(true);
+    size--;
+    return true;
+}
+
+ValueEntry* ValueTable::findEntry(ValueEntry* firstInTable, uint32_t tableCapacity, Value key) {
+    uint32_t index = hashValue(key) & (tableCapacity - 1);
+    ValueEntry* tombstone = nullptr;
+
+    for (;;){
+        ValueEntry* slot = firstInTable + index;
+        if (isEmpty(slot)){
+            if (IS_NIL(slot->value)){  // actually empty
+                return tombstone == nullptr ? slot : tombstone;
+            } else {  // tombstone
+                if (tombstone == nullptr) tombstone = slot;
+            }
+        } else if (valuesEqual(slot->key, key)){
+            return slot;
         }
+
+        index = (index + 1) & (tableCapacity - 1);
+    }
+}
+
+// Tombstones aren't copied over so this can leave the table with the same capacity, just cleaned up.
+void ValueTable::adjustCapacity() {
+    ValueEntry* oldEntries = entries;
+    uint32_t oldCapacity = capacity;
+    uint32_t newCapacity = size + 1 > oldCapacity * TABLE_MAX_LOAD / 2 ? GROW_CAPACITY(oldCapacity) : oldCapacity;
+
+    ValueEntry* newEntries = (ValueEntry*) gc.reallocate(nullptr, 0, sizeof(ValueEntry) * newCapacity);
+    for (uint32_t i=0;i<newCapacity;i++){
+        newEntries[i].key = NIL_VAL();
+        newEntries[i].value = NIL_VAL();
     }
-}
\ No newline at end of file
+
+    for (uint32_t i=0;i<oldCapacity;i++){
+        ValueEntry* original = oldEntries + i;
+        if (isEmpty(original)) continue;
+        ValueEntry* slot = findEntry(newEntries, newCapacity, original->key);
+        slot->key = original->key;
+        slot->value = original->value;
+    }
+
+    gc.FREE_ARRAY(ValueEntry, oldEntries, oldCapacity);
+    entries = newEntries;
+    capacity = newCapacity;
+    count = size;
+    maxEntries = (uint32_t) (newCapacity * TABLE_MAX_LOAD);
+}
@@ -14,19 +14,26 @@ typedef struct {
 
 class Table {
 public:
-    Table(Memory& gc);
+    Table(Memory& gc, Obj* owner = nullptr);
     ~Table();
 
     uint32_t count;
     uint32_t capacity;
     Entry* entries;
     uint32_t maxEntries;
+#ifdef TABLE_SWISS
+    // One byte per entry, in the same allocation just after them. The low 7 bits of the key's hash if the entry is full,
+    // otherwise CONTROL_EMPTY or CONTROL_DELETED. Empty and deleted entries still have a null key so isEmpty works either way.
+    uint8_t* control;
+#endif
 
     Memory& gc;
+    Obj* owner;  // the object this table belongs to, for the gc's write barrier. null for tables the gc treats as roots.
 
     bool set(ObjString* key, Value value);
     void adjustCapacity();
     void safeAddAll(const Table& from);
+    void addAll(const Table &from);
     bool get(ObjString* key, Value* valueOut);
     bool remove(ObjString* key);
     bool contains(ObjString* key);
@@ -43,8 +50,12 @@ public:
     }
 
 protected:
+#ifndef TABLE_SWISS
     // TODO: why is this static?
     static Entry* findEntry(Entry* firstInTable, uint32_t tableCapacity, ObjString *key);
+#endif
+    void removeEntry(Entry* entry);
+    void freeEntries();
 
     // The key is a pointer to the object, we don't own the object's memory, so just discarding our reference to it is fine.
     // The value is an actual instance of the struct since they're always passed by value. If it's not an Obj, discarding it doesn't matter.
@@ -56,8 +67,45 @@ protected:
     }
 
     bool safeSet(ObjString *key, Value value);
+};
 
-    void addAll(const Table &from);
+typedef struct {
+    Value key;
+    Value value;
+} ValueEntry;
+
+// The same open addressing as Table but any Value can be a key, for ObjMap.
+// A nil key marks an empty slot (or a tombstone, if the value is true) so nil can't be a real key.
+// Neither can NaN since it never equals itself and could never be found again.
+class ValueTable {
+public:
+    ValueTable(Memory& gc, Obj* owner);
+    ~ValueTable();
+
+    uint32_t count;  // includes tombstones, for the load factor
+    uint32_t size;  // just the keys that are really there
+    uint32_t capacity;
+    ValueEntry* entries;
+    uint32_t maxEntries;
+
+    Memory& gc;
+    Obj* owner;  // for the gc's write barrier
+
+    bool set(Value key, Value value);
+    bool get(Value key, Value* valueOut);
+    bool remove(Value key);
+    void adjustCapacity();
+
+    static inline bool isEmpty(ValueEntry* entry){
+        return IS_NIL(entry->key);
+    }
+
+    static inline bool isValidKey(Value key){
+        return !IS_NIL(key) && !(IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key));
+    }
+
+protected:
+    static ValueEntry* findEntry(ValueEntry* firstInTable, uint32_t tableCapacity, Value key);
 };
 
 class Set : public Table {
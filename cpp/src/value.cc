@@ -1,26 +1,59 @@
 #include "value.h"
 #include "object.h"
+#include <charconv>
+#include <cmath>
+
+// The same text as printf's %.10g, which is what the tests expect, without parsing a format string every time.
+// to_chars is built on Ryu so the digits come out without the long arithmetic printf does.
+// Whole numbers are what scripts print most and those are just an integer conversion.
+static size_t formatNumber(double number, char* buffer, size_t size) {
+    if (std::fabs(number) < 1e10 && number == (double) (int64_t) number && !(number == 0 && std::signbit(number))) {
+        return std::to_chars(buffer, buffer + size, (int64_t) number).ptr - buffer;
+    }
+    return std::to_chars(buffer, buffer + size, number, std::chars_format::general, 10).ptr - buffer;
+}
 
 void printValue(Value value, ostream* output){
-    switch (value.type) {
-        case VAL_BOOL:
-            *output << (AS_BOOL(value) ? "true" : "false");
-            break;
-        case VAL_NUMBER:
-            char buf[1024];
-            snprintf(buf, 1024, "%.10g", AS_NUMBER(value));
-            *output << buf;
-            break;
-        case VAL_NIL:
-            *output << "nil";
-            break;
-        case VAL_OBJ:
-            printObject(value, output);
-            break;
-        case VAL_NATIVE_POINTER:
-            *output << "<native-ptr>";
-            break;
+    if (IS_BOOL(value)) {
+        *output << (AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NUMBER(value)) {
+        char buffer[32];
+        output->write(buffer, formatNumber(AS_NUMBER(value), buffer, sizeof(buffer)));
+    } else if (IS_NIL(value)) {
+        *output << "nil";
+    } else if (IS_OBJ(value)) {
+        printObject(value, output);
+    } else {
+        *output << "<native-ptr>";
+    }
+}
+
+// Mixes the bits so keys that only differ in their high bits (most doubles, neighbouring addresses) don't pile up in the same slots.
+static uint32_t hashBits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t) bits;
+}
+
+// Has to agree with valuesEqual, so 0 and -0 hash the same. Strings use the hash they were interned with,
+// and ropes and views the one they will be. Any other object is its own key so its address is fine.
+uint32_t hashValue(Value value) {
+    if (IS_OBJ(value)) {
+        Obj* object = AS_OBJ(value);
+        if (object->type == OBJ_STRING) return ((ObjString*) object)->hash;
+        if (isLazyString(object)) return hashLazyString(object);
+        return hashBits((uint64_t) (uintptr_t) object);
+    }
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        if (number == 0) number = 0;
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return hashBits(bits);
     }
+    if (IS_BOOL(value)) return AS_BOOL(value) ? 3 : 2;
+    return 1;  // nil
 }
 
 void printValue(Value value){
@@ -38,6 +71,14 @@ void debugPrintValueArray(Value *startPtr, Value *endPtr) {
 }
 
 bool valuesEqual(Value right, Value left) {
+#ifdef NAN_BOXING
+    // Numbers still need a real float comparison so NaN != NaN and 0 == -0.
+    // Everything else is equal iff the bits are. Since all strings are interned, that works for them too.
+    // Ropes and views are the exception until they're flattened.
+    if (IS_NUMBER(right) && IS_NUMBER(left)) return AS_NUMBER(right) == AS_NUMBER(left);
+    if (right.bits == left.bits) return true;
+    return IS_OBJ(right) && IS_OBJ(left) && (isLazyString(AS_OBJ(right)) || isLazyString(AS_OBJ(left))) && lazyStringsEqual(AS_OBJ(right), AS_OBJ(left));
+#else
     if (right.type != left.type) return false;
 
     // Book: cant just memcmp() the structs cause there's padding so garbage bites
@@ -50,9 +91,12 @@ bool valuesEqual(Value right, Value left) {
             return true;
         case VAL_OBJ: {
             // Since all strings are interned, it's safe to just compare memory addresses. 
-            return AS_STRING(right) == AS_STRING(left);
+            // A rope or view has to compare characters unless it's been flattened.
+            if (AS_OBJ(right) == AS_OBJ(left)) return true;
+            return (isLazyString(AS_OBJ(right)) || isLazyString(AS_OBJ(left))) && lazyStringsEqual(AS_OBJ(right), AS_OBJ(left));
         }
         default:
             return false;
     }
+#endif
 }
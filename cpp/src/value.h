@@ -2,8 +2,70 @@
 #define clox_value_h
 
 #include "common.h"
+#include <cstring>
 
 
+typedef struct Obj Obj;
+typedef struct Value Value;
+
+#ifdef NAN_BOXING
+
+// A double has 11 exponent bits, and if they're all set (plus the quiet bit) it's a NaN that leaves the other 51 bits unused.
+// Real NaNs produced by arithmetic only ever use the one canonical bit pattern,
+// so anything else with those bits set can be a different type of value hiding in the mantissa.
+// Pointers only use the low 48 bits so they fit with the sign bit as the tag. nil/true/false are small tags in the low bits.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1
+#define TAG_FALSE 2
+#define TAG_TRUE  3
+
+struct Value {
+    uint64_t bits;
+};
+
+static inline Value numToValue(double num) {
+    Value value;
+    memcpy(&value.bits, &num, sizeof(double));
+    return value;
+}
+
+static inline double valueToNum(Value value) {
+    double num;
+    memcpy(&num, &value.bits, sizeof(double));
+    return num;
+}
+
+#define FALSE_VAL         ((Value){QNAN | TAG_FALSE})
+#define TRUE_VAL          ((Value){QNAN | TAG_TRUE})
+
+// c type -> Value
+#define BOOL_VAL(value)   ((value) ? TRUE_VAL : FALSE_VAL)
+
+#define NIL_VAL()         ((Value){QNAN | TAG_NIL})
+
+#define NUMBER_VAL(value) numToValue(value)
+
+#define OBJ_VAL(object)   ((Value){SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object)})
+
+// Value -> c type
+#define AS_BOOL(value)    ((value).bits == TRUE_VAL.bits)
+#define AS_NUMBER(value)  valueToNum(value)
+#define AS_OBJ(value)     ((Obj*)(uintptr_t)((value).bits & ~(SIGN_BIT | QNAN)))
+#define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
+
+// false and true only differ in the lowest bit.
+#define IS_BOOL(value)    (((value).bits | 1) == TRUE_VAL.bits)
+#define IS_NIL(value)     ((value).bits == NIL_VAL().bits)
+#define IS_NUMBER(value)  (((value).bits & QNAN) != QNAN)
+// One branch instead of two for the quickened arithmetic in VM::run.
+#define BOTH_NUMBERS(a, b) (IS_NUMBER(a) & IS_NUMBER(b))
+#define IS_OBJ(value)     (((value).bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
+
+#else
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
@@ -12,9 +74,6 @@ typedef enum {
     VAL_NATIVE_POINTER
 } ValueType;
 
-typedef struct Obj Obj;
-typedef struct Value Value;
-
 union ValueData {
     bool boolean;
     double number;
@@ -47,12 +106,17 @@ struct Value {
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+// One branch instead of two for the quickened arithmetic in VM::run.
+#define BOTH_NUMBERS(a, b) ((((a).type ^ VAL_NUMBER) | ((b).type ^ VAL_NUMBER)) == 0)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
 
+#endif
+
 void printValue(Value value);
 void printValue(Value value, ostream* output);
 void debugPrintValueArray(Value* startPtr, Value* endPtr);
 bool valuesEqual(Value right, Value left);  // might need to move this back to the vm when equality needs runtime info
+uint32_t hashValue(Value value);
 
 #endif
\ No newline at end of file
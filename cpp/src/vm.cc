@@ -1,8 +1,13 @@
 #include "vm.h"
 #include "compiler/compiler.h"
 #include "common.h"
+#include <algorithm>
 #include <cmath>
+#include <sstream>
 #include "natives.h"
+#ifdef VM_PROFILING_CYCLES
+#include <x86intrin.h>
+#endif
 
 #define FORMAT_RUNTIME_ERROR(format, ...)     \
         fprintf(stderr, format, __VA_ARGS__); \
@@ -10,18 +15,54 @@
 
 
 #ifdef VM_PROFILING
-long VM::instructionTimeTotal[256] = {};
-int VM::instructionCount[256] = {};
+uint64_t VM::instructionCount[256] = {};
+uint64_t VM::instructionPairCount[256][256] = {};
+#ifdef VM_PROFILING_CYCLES
+uint64_t VM::instructionCycles[256] = {};
+#endif
+#endif
+
+#ifdef VM_OPCODE_NGRAMS
+uint64_t VM::opcodePairCounts[256][256] = {};
+unordered_map<uint32_t, uint64_t> VM::opcodeTripleCounts;
+uint32_t VM::recentOpcodes = 0;
 #endif
 
-VM::VM() : compiler(Compiler(gc)) {
+#ifdef VM_INLINE_CACHE_STATS
+long VM::inlineCacheHits = 0;
+long VM::inlineCacheMisses = 0;
+#define CACHE_HIT() inlineCacheHits++
+#define CACHE_MISS() inlineCacheMisses++
+#else
+#define CACHE_HIT()
+#define CACHE_MISS()
+#endif
+
+VM::VM() : compiler(Compiler(gc)), stdoutBuffer(stdout), stdoutStream(&stdoutBuffer) {
     resetStack();
     gc.objects = nullptr;
+    gc.youngObjects = nullptr;
+    gc.isMinorGC = false;
+    gc.bytesSinceMinorGC = 0;
+    gc.gcPhase = GC_IDLE;
+#ifdef DEBUG_STRESS_GC
+    gc.maxPauseMicros = 0;
+#else
+    gc.maxPauseMicros = GC_MAX_PAUSE_US;
+#endif
+    gc.sweepCursor = nullptr;
+    gc.condemnedYoung = nullptr;
+    gc.remarkCount = 0;
+#ifdef GC_PAUSE_HISTOGRAM
+    memset(gc.pauseCounts, 0, sizeof(gc.pauseCounts));
+    gc.totalPauseMicros = 0;
+    gc.maxPauseSeen = 0;
+#endif
     gc.natives = new Table(gc);
     gc.strings = new Set(gc);
     gc.frameCount = 0;
 
-    out = &cout;
+    out = &stdoutStream;
     err = &cerr;
     exitCode = 0;
     gc.openUpvalues = nullptr;
@@ -33,8 +74,19 @@ VM::VM() : compiler(Compiler(gc)) {
     defineNative("time", LoxNatives::time, 0);
     defineNative("input", LoxNatives::input, 0);
     defineNative("eval", LoxNatives::eval, 1);
+    defineNative("push", LoxNatives::push, 2);
+    defineNative("pop", LoxNatives::pop, 1);
+    defineNative("len", LoxNatives::len, 1);
+    defineNative("has", LoxNatives::has, 2);
+    defineNative("delete", LoxNatives::deleteKey, 2);
+    defineNative("keys", LoxNatives::keys, 1);
+    defineNative("flush", LoxNatives::flush, 0);
 
     gc.init = gc.copyString("init", 4);
+    for (int i=0;i<256;i++){
+        char c = (char) i;
+        gc.singleChars[i] = gc.copyString(&c, 1);
+    }
 }
 
 VM::~VM() {
@@ -55,7 +107,13 @@ bool VM::loadFromSource(char* src) {
     gc.enable = false;
     ObjFunction* function = compiler.compile(src);
     if (function == nullptr) return false;
+    loadFunction(function);
+    return true;
+}
 
+// Makes an already compiled script (from the compiler or a .loxc file) the current frame.
+void VM::loadFunction(ObjFunction* function) {
+    gc.enable = false;
     push(OBJ_VAL(function));
     ObjClosure* closure = gc.newClosure(function);
     pop();
@@ -68,7 +126,6 @@ bool VM::loadFromSource(char* src) {
     call(closure, 0);
 
     gc.enable = true;
-    return true;
 }
 
 Value VM::produceFunction(char* src) {
@@ -98,6 +155,11 @@ inline int VM::stackHeight(){
     return (int) (gc.stackTop - gc.stack);
 }
 
+// GCC merges the identical indirect jumps at the end of every handler back into one shared jump,
+// which undoes threaded dispatch. Clang keeps them separate by default.
+#if defined(VM_COMPUTED_GOTO) && !defined(__clang__)
+__attribute__((optimize("no-crossjumping")))
+#endif
 InterpretResult VM::run() {
     CallFrame frame;
     Chunk* chunk;
@@ -106,10 +168,34 @@ InterpretResult VM::run() {
             chunk = frame.closure->function->chunk;            \
             ip = frame.ip;                            \
 
+    // Hands the current frame to its machine code, if there is any for ip, until that reaches something it leaves to the interpreter.
+    // Called wherever a frame starts or resumes running and on loops. <hot> is added to the function's count towards compiling it.
+    #ifdef VM_JIT
+    #define RUN_JIT(hot)                                                                     \
+            {                                                                              \
+                ObjFunction* function = frame.closure->function;                           \
+                if (function->jit == nullptr && (function->hotness += hot) >= VM_JIT_THRESHOLD) { \
+                    function->jit = jitCompile(function);                                  \
+                }                                                                          \
+                if (function->jit != nullptr) ip = jitRun(function->jit, &gc.stackTop, frame, this, ip); \
+            }
+    #else
+    #define RUN_JIT(hot)
+    #endif
+
+    // RUN_JIT, and where SamplingProfiler's ticks are turned into samples since the frames and ip are up to date here.
+    #define SAFEPOINT(hot)                                                                   \
+            if (SamplingProfiler::pendingTicks.load(std::memory_order_relaxed) != 0 && profiler != nullptr) { \
+                profiler->sample(this);                                                    \
+            }                                                                              \
+            RUN_JIT(hot)
+
     #define READ_BYTE() (*(ip++))
     #define READ_CONSTANT() chunk->getConstant(READ_BYTE())
     #define READ_STRING() (AS_STRING(READ_CONSTANT()))
     #define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+    #define READ_WIDE() (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+    #define OPERAND_STRING() (AS_STRING(chunk->getConstant(operand)))
     #define STACK_BASE() (frame.slots)
 
     #ifdef VM_SAFE_MODE
@@ -133,24 +219,208 @@ InterpretResult VM::run() {
                 return INTERPRET_RUNTIME_ERROR;             \
             }
 
+    // valuesEqual can compare a rope or view's characters but flattening it first means doing that again is a pointer check.
+    #define FLATTEN_STRING(slot)                                            \
+            if (IS_OBJ(slot) && isLazyString(AS_OBJ(slot))) slot = OBJ_VAL(gc.flattenString(AS_OBJ(slot)));
+
     #define ASSERT_SEQUENCE(value, message)                 \
-            if (!IS_STRING(value)){                         \
+            if (!IS_ANY_STRING(value) && !IS_LIST(value)){\
                 runtimeError(message);                      \
                 return INTERPRET_RUNTIME_ERROR;             \
             }
 
-    #define BINARY_OP(op_code, c_op, resultCast) \
-            case op_code: {                      \
+    // Quickening. The generic arithmetic handlers rewrite their own opcode to the _NUM (or _STR) form for the operand
+    // types they just saw so the next run only has to check one tag. When a quickened form sees other types it puts
+    // the generic opcode back and runs that instead. Either form is always correct, so code shared by many closures,
+    // or already compiled by the jit, never needs to know which one it's holding.
+    #define QUICKEN(op_code) ip[-1] = op_code;
+    #define DEQUICKEN(op_code)          \
+            {                           \
+                ip[-1] = op_code;       \
+                ip--;                   \
+                NEXT();                 \
+            }
+
+    // <expression> can use the numbers <left> and <right>.
+    #define BINARY_OP(op_code, quick_code, expression) \
+            CASE(op_code): {                     \
                  ASSERT_POP(2)                   \
                  ASSERT_NUMBER(peek(0), "Operands must be numbers.")           \
-                 ASSERT_NUMBER(peek(1), string("Operands must be numbers."))    \
-                 Value right = pop();            \
-                 Value left = pop();             \
-                 push(resultCast(AS_NUMBER(left) c_op AS_NUMBER(right)));                           \
-                 break;                          \
+                 ASSERT_NUMBER(peek(1), "Operands must be numbers.")           \
+                 QUICKEN(quick_code)             \
+                 double right = AS_NUMBER(pop());  \
+                 double left = AS_NUMBER(pop());   \
+                 push(expression);               \
+                 NEXT();                         \
+            }                                    \
+            CASE(quick_code): {                  \
+                 ASSERT_POP(2)                   \
+                 if (!BOTH_NUMBERS(peek(0), peek(1))) DEQUICKEN(op_code)  \
+                 double right = AS_NUMBER(pop());  \
+                 double left = AS_NUMBER(pop());   \
+                 push(expression);               \
+                 NEXT();                         \
             }
 
+    // Each handler ends with NEXT(). With the switch, that's a break back to the top of the loop.
+    // With computed goto, it reads the next opcode and jumps straight to its handler,
+    // so the loop and switch are only entered once to run the first instruction.
+    #ifdef VM_COMPUTED_GOTO
+    static void* dispatchTable[256];
+    if (dispatchTable[0] == nullptr) {
+        for (void*& target : dispatchTable) {
+            target = &&label_default;
+        }
+        #define TARGET(op) dispatchTable[op] = &&label_##op;
+        TARGET(OP_GET_CONSTANT)
+        TARGET(OP_NIL)
+        TARGET(OP_TRUE)
+        TARGET(OP_FALSE)
+        TARGET(OP_EQUAL)
+        TARGET(OP_GREATER)
+        TARGET(OP_LESS)
+        TARGET(OP_ADD)
+        TARGET(OP_SUBTRACT)
+        TARGET(OP_MULTIPLY)
+        TARGET(OP_DIVIDE)
+        TARGET(OP_NEGATE)
+        TARGET(OP_NOT)
+        TARGET(OP_RETURN)
+        TARGET(OP_EXPONENT)
+        TARGET(OP_PRINT)
+        TARGET(OP_POP)
+        TARGET(OP_POP_MANY)
+        TARGET(OP_DEBUG_BREAK_POINT)
+        TARGET(OP_EXIT_VM)
+        TARGET(OP_ACCESS_INDEX)
+        TARGET(OP_SLICE_INDEX)
+        TARGET(OP_GET_LENGTH)
+        TARGET(OP_SET_INDEX)
+        TARGET(OP_BUILD_LIST)
+        TARGET(OP_BUILD_MAP)
+        TARGET(OP_GET_LOCAL)
+        TARGET(OP_SET_LOCAL)
+        TARGET(OP_LOAD_INLINE_CONSTANT)
+        TARGET(OP_JUMP)
+        TARGET(OP_LOOP)
+        TARGET(OP_JUMP_IF_FALSE)
+        TARGET(OP_CALL)
+        TARGET(OP_CLOSURE)
+        TARGET(OP_GET_UPVALUE)
+        TARGET(OP_SET_UPVALUE)
+        TARGET(OP_CLOSE_UPVALUE)
+        TARGET(OP_CLASS)
+        TARGET(OP_SET_PROPERTY)
+        TARGET(OP_GET_PROPERTY)
+        TARGET(OP_METHOD)
+        TARGET(OP_INVOKE)
+        TARGET(OP_INHERIT)
+        TARGET(OP_GET_SUPER)
+        TARGET(OP_SUPER_INVOKE)
+        TARGET(OP_NOT_EQUAL)
+        TARGET(OP_LESS_EQUAL)
+        TARGET(OP_GREATER_EQUAL)
+        TARGET(OP_SET_LOCAL_POP)
+        TARGET(OP_GET_LOCALS)
+        TARGET(OP_ADD_LOCAL_CONSTANT)
+        TARGET(OP_SUBTRACT_LOCAL_CONSTANT)
+        TARGET(OP_POP_JUMP_IF_FALSE)
+        TARGET(OP_POP_JUMP_IF_TRUE)
+        TARGET(OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE)
+        TARGET(OP_ADD_NUM)
+        TARGET(OP_ADD_STR)
+        TARGET(OP_SUBTRACT_NUM)
+        TARGET(OP_MULTIPLY_NUM)
+        TARGET(OP_DIVIDE_NUM)
+        TARGET(OP_GREATER_NUM)
+        TARGET(OP_LESS_NUM)
+        TARGET(OP_LESS_EQUAL_NUM)
+        TARGET(OP_GREATER_EQUAL_NUM)
+        TARGET(OP_GET_CONSTANT_LONG)
+        TARGET(OP_JUMP_LONG)
+        TARGET(OP_LOOP_LONG)
+        TARGET(OP_JUMP_IF_FALSE_LONG)
+        TARGET(OP_POP_JUMP_IF_FALSE_LONG)
+        TARGET(OP_POP_JUMP_IF_TRUE_LONG)
+        TARGET(OP_WIDE)
+        #ifdef VM_REGISTERS
+        TARGET(OP_R_MOVE)
+        TARGET(OP_R_LOAD_CONSTANT)
+        TARGET(OP_R_LOAD_NIL)
+        TARGET(OP_R_LOAD_BOOL)
+        TARGET(OP_R_GET_UPVALUE)
+        TARGET(OP_R_SET_UPVALUE)
+        TARGET(OP_R_NEGATE)
+        TARGET(OP_R_NOT)
+        TARGET(OP_R_ADD)
+        TARGET(OP_R_ADD_K)
+        TARGET(OP_R_SUBTRACT)
+        TARGET(OP_R_SUBTRACT_K)
+        TARGET(OP_R_MULTIPLY)
+        TARGET(OP_R_MULTIPLY_K)
+        TARGET(OP_R_DIVIDE)
+        TARGET(OP_R_DIVIDE_K)
+        TARGET(OP_R_EQUAL)
+        TARGET(OP_R_EQUAL_K)
+        TARGET(OP_R_NOT_EQUAL)
+        TARGET(OP_R_NOT_EQUAL_K)
+        TARGET(OP_R_LESS)
+        TARGET(OP_R_LESS_K)
+        TARGET(OP_R_GREATER)
+        TARGET(OP_R_GREATER_K)
+        TARGET(OP_R_LESS_EQUAL)
+        TARGET(OP_R_LESS_EQUAL_K)
+        TARGET(OP_R_GREATER_EQUAL)
+        TARGET(OP_R_GREATER_EQUAL_K)
+        TARGET(OP_R_JUMP_IF_FALSE)
+        TARGET(OP_R_JUMP_IF_TRUE)
+        TARGET(OP_R_RETURN)
+        TARGET(OP_R_SET_TOP)
+        #endif
+        #undef TARGET
+    }
+
+    #define CASE(op) case op: label_##op
+    #define CASE_DEFAULT default: label_default
+    #ifdef VM_PROFILING
+    #define NEXT() do { instruction = READ_BYTE(); PROFILE_INSTRUCTION() goto *dispatchTable[instruction]; } while (false)
+    #else
+    #define NEXT() goto *dispatchTable[instruction = READ_BYTE()]
+    #endif
+    #else
+    #define CASE(op) case op
+    #define CASE_DEFAULT default
+    #define NEXT() break
+    #endif
+
+    byte instruction;
+    #ifdef VM_PROFILING
+    // Counts the instruction that was just read. The cycles since the last dispatch go to the one before it,
+    // which covers its handler and the dispatch that followed.
+    int previousInstruction = -1;
+    #ifdef VM_PROFILING_CYCLES
+    uint64_t lastDispatch = __rdtsc();
+    #define PROFILE_CYCLES()                                          \
+            uint64_t now = __rdtsc();                                 \
+            instructionCycles[previousInstruction] += now - lastDispatch; \
+            lastDispatch = now;
+    #else
+    #define PROFILE_CYCLES()
+    #endif
+    #define PROFILE_INSTRUCTION()                                     \
+            instructionCount[instruction]++;                          \
+            if (previousInstruction >= 0) {                           \
+                instructionPairCount[previousInstruction][instruction]++; \
+                PROFILE_CYCLES()                                      \
+            }                                                         \
+            previousInstruction = instruction;
+    #endif
+    // The first operand of the instructions OP_WIDE can go before. Their handlers read it into here and then start at
+    // a label which OP_WIDE jumps to instead once it's read the wide one. <wide> only matters to OP_CLOSURE.
+    uint32_t operand;
+    bool wide;
     CACHE_FRAME()
+    SAFEPOINT(1)
     for (;;){
         #ifdef VM_DEBUG_TRACE_EXECUTION
         if (!Debugger::silent) {
@@ -164,15 +434,23 @@ InterpretResult VM::run() {
         // printDebugInfo();
         #endif
 
+        instruction = READ_BYTE();
         #ifdef VM_PROFILING
-        auto loopStart = std::chrono::high_resolution_clock::now();
+        PROFILE_INSTRUCTION()
         #endif
 
-        byte instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_ADD:
+        switch (instruction) {
+            CASE(OP_ADD):
                 ASSERT_POP(2)
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))){
+                if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {
+                    QUICKEN(OP_ADD_STR)
+                } else if (BOTH_NUMBERS(peek(0), peek(1))) {
+                    QUICKEN(OP_ADD_NUM)
+                }
+            // Superinstructions that fall back to a generic add come straight here. Their last byte isn't an opcode to rewrite.
+            addValues:
+                ASSERT_POP(2)
+                if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))){
                     concatenate();
                 } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))){
                     Value right = pop();
@@ -182,32 +460,261 @@ InterpretResult VM::run() {
                     runtimeError("Operands must be two numbers or two strings.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
-            BINARY_OP(OP_SUBTRACT, -, NUMBER_VAL)
-            BINARY_OP(OP_MULTIPLY, *, NUMBER_VAL)
-            BINARY_OP(OP_DIVIDE, /, NUMBER_VAL)
-            BINARY_OP(OP_GREATER, >, BOOL_VAL)
-            BINARY_OP(OP_LESS, <, BOOL_VAL)
-            case OP_GET_CONSTANT:
+                NEXT();
+            CASE(OP_ADD_NUM): {
+                ASSERT_POP(2)
+                if (!BOTH_NUMBERS(peek(0), peek(1))) DEQUICKEN(OP_ADD)
+                double right = AS_NUMBER(pop());
+                double left = AS_NUMBER(pop());
+                push(NUMBER_VAL(left + right));
+                NEXT();
+            }
+            CASE(OP_ADD_STR):
+                ASSERT_POP(2)
+                if (!(IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1)))) DEQUICKEN(OP_ADD)
+                concatenate();
+                NEXT();
+            BINARY_OP(OP_SUBTRACT, OP_SUBTRACT_NUM, NUMBER_VAL(left - right))
+            BINARY_OP(OP_MULTIPLY, OP_MULTIPLY_NUM, NUMBER_VAL(left * right))
+            BINARY_OP(OP_DIVIDE, OP_DIVIDE_NUM, NUMBER_VAL(left / right))
+            BINARY_OP(OP_GREATER, OP_GREATER_NUM, BOOL_VAL(left > right))
+            BINARY_OP(OP_LESS, OP_LESS_NUM, BOOL_VAL(left < right))
+            // Not the same as <= and >= because of NaN. Matches the GREATER; NOT and LESS; NOT they replaced.
+            BINARY_OP(OP_LESS_EQUAL, OP_LESS_EQUAL_NUM, BOOL_VAL(!(left > right)))
+            BINARY_OP(OP_GREATER_EQUAL, OP_GREATER_EQUAL_NUM, BOOL_VAL(!(left < right)))
+            CASE(OP_GET_CONSTANT):
                 push(READ_CONSTANT());
-                break;
-            case OP_GET_LOCAL: {
-                char offset = READ_BYTE();
+                NEXT();
+            CASE(OP_GET_LOCAL): {
+                uint8_t offset = READ_BYTE();
                 ASSERT_PEEK(offset)
                 push(STACK_BASE()[offset]);
-                break;
+                NEXT();
             }
-            case OP_SET_LOCAL: {
-                char offset = READ_BYTE();
+            CASE(OP_SET_LOCAL): {
+                uint8_t offset = READ_BYTE();
                 ASSERT_PEEK(offset)
                 STACK_BASE()[offset] = peek(0);
                 // Since an assignment is an expression, it shouldn't pop the stack, so they can chain.
                 // If it was used as a statement, a separate OP_POP will be added automatically.
                 // To avoid a special case we want to make sure that every valid expression adds exactly one thing to the stack.
-                break;
+                NEXT();
+            }
+
+            // The superinstructions below start with the opcode the compiler replaced and read the operands of the
+            // whole sequence from where they were. See Compiler::fuseSuperinstructions.
+            CASE(OP_SET_LOCAL_POP): {  // a, POP
+                uint8_t offset = ip[0];
+                ASSERT_PEEK(offset)
+                STACK_BASE()[offset] = pop();
+                ip += 2;
+                NEXT();
+            }
+            CASE(OP_GET_LOCALS): {  // a, GET_LOCAL, b
+                ASSERT_PEEK(ip[0])
+                ASSERT_PEEK(ip[2])
+                push(STACK_BASE()[ip[0]]);
+                push(STACK_BASE()[ip[2]]);
+                ip += 3;
+                NEXT();
+            }
+            CASE(OP_ADD_LOCAL_CONSTANT): {  // a, GET_CONSTANT, k, ADD
+                ASSERT_PEEK(ip[0])
+                Value left = STACK_BASE()[ip[0]];
+                Value right = chunk->getConstant(ip[2]);
+                ip += 4;
+                if (IS_NUMBER(left) && IS_NUMBER(right)) {
+                    push(NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right)));
+                    NEXT();
+                }
+                push(left);
+                push(right);
+                goto addValues;
+            }
+            CASE(OP_SUBTRACT_LOCAL_CONSTANT): {  // a, GET_CONSTANT, k, SUBTRACT
+                ASSERT_PEEK(ip[0])
+                Value left = STACK_BASE()[ip[0]];
+                Value right = chunk->getConstant(ip[2]);
+                ip += 4;
+                ASSERT_NUMBER(left, "Operands must be numbers.")
+                ASSERT_NUMBER(right, "Operands must be numbers.")
+                push(NUMBER_VAL(AS_NUMBER(left) - AS_NUMBER(right)));
+                NEXT();
+            }
+            CASE(OP_LESS_LOCAL_CONSTANT_JUMP_IF_FALSE): {  // a, GET_CONSTANT, k, LESS, POP_JUMP_IF_FALSE, distance
+                ASSERT_PEEK(ip[0])
+                Value left = STACK_BASE()[ip[0]];
+                Value right = chunk->getConstant(ip[2]);
+                uint16_t distance = (uint16_t)((ip[5] << 8) | ip[6]);
+                ip += 7;
+                ASSERT_NUMBER(left, "Operands must be numbers.")
+                ASSERT_NUMBER(right, "Operands must be numbers.")
+                if (!(AS_NUMBER(left) < AS_NUMBER(right))) ip += distance;
+                NEXT();
+            }
+            #ifdef VM_REGISTERS
+            // Register instructions from Compiler::translateToRegisters. Operands are slots relative to the frame, destination first.
+            #define REGISTER(index) STACK_BASE()[ip[index]]
+            #define REGISTER_BINARY_OP(op_code, expression)                        \
+                    CASE(op_code): {                                               \
+                        Value left = REGISTER(1);                                  \
+                        Value right = REGISTER(2);                                 \
+                        ASSERT_NUMBER(right, "Operands must be numbers.")          \
+                        ASSERT_NUMBER(left, "Operands must be numbers.")           \
+                        REGISTER(0) = expression;                                  \
+                        ip += 3;                                                   \
+                        NEXT();                                                    \
+                    }                                                              \
+                    CASE(op_code##_K): {                                           \
+                        Value left = REGISTER(1);                                  \
+                        Value right = chunk->getConstant(ip[2]);                   \
+                        ASSERT_NUMBER(right, "Operands must be numbers.")          \
+                        ASSERT_NUMBER(left, "Operands must be numbers.")           \
+                        REGISTER(0) = expression;                                  \
+                        ip += 3;                                                   \
+                        NEXT();                                                    \
+                    }
+
+            REGISTER_BINARY_OP(OP_R_SUBTRACT, NUMBER_VAL(AS_NUMBER(left) - AS_NUMBER(right)))
+            REGISTER_BINARY_OP(OP_R_MULTIPLY, NUMBER_VAL(AS_NUMBER(left) * AS_NUMBER(right)))
+            REGISTER_BINARY_OP(OP_R_DIVIDE, NUMBER_VAL(AS_NUMBER(left) / AS_NUMBER(right)))
+            REGISTER_BINARY_OP(OP_R_LESS, BOOL_VAL(AS_NUMBER(left) < AS_NUMBER(right)))
+            REGISTER_BINARY_OP(OP_R_GREATER, BOOL_VAL(AS_NUMBER(left) > AS_NUMBER(right)))
+            REGISTER_BINARY_OP(OP_R_LESS_EQUAL, BOOL_VAL(!(AS_NUMBER(left) > AS_NUMBER(right))))
+            REGISTER_BINARY_OP(OP_R_GREATER_EQUAL, BOOL_VAL(!(AS_NUMBER(left) < AS_NUMBER(right))))
+            #undef REGISTER_BINARY_OP
+
+            CASE(OP_R_ADD):
+            CASE(OP_R_ADD_K): {
+                Value left = REGISTER(1);
+                Value right = instruction == OP_R_ADD ? REGISTER(2) : chunk->getConstant(ip[2]);
+                Value* dest = &REGISTER(0);
+                Value* scratch = &REGISTER(3);
+                ip += 4;
+                if (IS_NUMBER(left) && IS_NUMBER(right)) {
+                    *dest = NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right));
+                    NEXT();
+                }
+                if (!IS_ANY_STRING(left) || !IS_ANY_STRING(right)) {
+                    runtimeError("Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                // The compiler made sure every slot below scratch holds a real value. Cover the operands too so the gc sees them all.
+                Value* top = gc.stackTop;
+                scratch[0] = left;
+                scratch[1] = right;
+                if (gc.stackTop < scratch + 2) gc.stackTop = scratch + 2;
+                concatenate(scratch);
+                *dest = scratch[0];
+                gc.stackTop = top;
+                NEXT();
+            }
+            CASE(OP_R_EQUAL):
+                REGISTER(0) = BOOL_VAL(valuesEqual(REGISTER(1), REGISTER(2)));
+                ip += 3;
+                NEXT();
+            CASE(OP_R_EQUAL_K):
+                REGISTER(0) = BOOL_VAL(valuesEqual(REGISTER(1), chunk->getConstant(ip[2])));
+                ip += 3;
+                NEXT();
+            CASE(OP_R_NOT_EQUAL):
+                REGISTER(0) = BOOL_VAL(!valuesEqual(REGISTER(1), REGISTER(2)));
+                ip += 3;
+                NEXT();
+            CASE(OP_R_NOT_EQUAL_K):
+                REGISTER(0) = BOOL_VAL(!valuesEqual(REGISTER(1), chunk->getConstant(ip[2])));
+                ip += 3;
+                NEXT();
+            CASE(OP_R_MOVE):
+                REGISTER(0) = REGISTER(1);
+                ip += 2;
+                NEXT();
+            CASE(OP_R_LOAD_CONSTANT):
+                REGISTER(0) = chunk->getConstant(ip[1]);
+                ip += 2;
+                NEXT();
+            CASE(OP_R_LOAD_NIL):
+                REGISTER(0) = NIL_VAL();
+                ip += 1;
+                NEXT();
+            CASE(OP_R_LOAD_BOOL):
+                REGISTER(0) = BOOL_VAL(ip[1] != 0);
+                ip += 2;
+                NEXT();
+            CASE(OP_R_GET_UPVALUE):
+                REGISTER(0) = *frame.closure->upvalues[ip[1]]->location;
+                ip += 2;
+                NEXT();
+            CASE(OP_R_SET_UPVALUE): {
+                ObjUpvalue* upvalue = frame.closure->upvalues[ip[0]];
+                Value value = REGISTER(1);
+                *upvalue->location = value;
+                gc.writeBarrier((Obj*) upvalue, value);
+                ip += 2;
+                NEXT();
             }
-            case OP_ACCESS_INDEX: {
+            CASE(OP_R_NEGATE): {
+                Value value = REGISTER(1);
+                ASSERT_NUMBER(value, "Operand must be a number.")
+                REGISTER(0) = NUMBER_VAL(-AS_NUMBER(value));
+                ip += 2;
+                NEXT();
+            }
+            CASE(OP_R_NOT):
+                REGISTER(0) = BOOL_VAL(isFalsy(REGISTER(1)));
+                ip += 2;
+                NEXT();
+            CASE(OP_R_JUMP_IF_FALSE): {
+                Value condition = REGISTER(0);
+                uint16_t distance = (uint16_t)((ip[1] << 8) | ip[2]);
+                ip += 3;
+                if (isFalsy(condition)) ip += distance;
+                NEXT();
+            }
+            CASE(OP_R_JUMP_IF_TRUE): {
+                Value condition = REGISTER(0);
+                uint16_t distance = (uint16_t)((ip[1] << 8) | ip[2]);
+                ip += 3;
+                if (!isFalsy(condition)) ip += distance;
+                NEXT();
+            }
+            CASE(OP_R_RETURN):
+                // Everything in the frame is about to be thrown away so it's fine to put the value anywhere.
+                push(REGISTER(0));
+                goto returnFromFrame;
+            CASE(OP_R_SET_TOP):
+                gc.stackTop = STACK_BASE() + READ_BYTE();
+                NEXT();
+            #undef REGISTER
+            #endif
+            CASE(OP_ACCESS_INDEX): {
                 ASSERT_POP(2)
+                // An in bounds index into a list or string doesn't need anything accessSequenceIndex does.
+                if (IS_NUMBER(peek(0)) && IS_OBJ(peek(1)) && OBJ_TYPE(peek(1)) == OBJ_LIST) {
+                    ObjList* list = AS_LIST(peek(1));
+                    int index = AS_NUMBER(peek(0));
+                    if ((uint32_t) index < list->values.count) {
+                        gc.stackTop--;
+                        gc.stackTop[-1] = list->values.data[index];
+                        NEXT();
+                    }
+                }
+                if (IS_NUMBER(peek(0)) && IS_OBJ(peek(1)) && OBJ_TYPE(peek(1)) == OBJ_STRING) {
+                    ObjString* str = AS_STRING(peek(1));
+                    int index = AS_NUMBER(peek(0));
+                    if ((uint32_t) index < str->array.length - 1) {
+                        gc.stackTop--;
+                        gc.stackTop[-1] = OBJ_VAL(gc.singleChars[(uint8_t) asCString(str)[index]]);
+                        NEXT();
+                    }
+                }
+                if (IS_MAP(peek(1))) {
+                    Value result;
+                    if (!accessMapKey(AS_MAP(peek(1)), peek(0), &result)) return INTERPRET_RUNTIME_ERROR;
+                    gc.stackTop--;
+                    gc.stackTop[-1] = result;
+                    NEXT();
+                }
                 ASSERT_NUMBER(peek(0), "Array index must be an integer.")
                 ASSERT_SEQUENCE(peek(1), "Slice target must be a sequence")
                 int index = AS_NUMBER(pop());
@@ -217,9 +724,9 @@ InterpretResult VM::run() {
                 pop();
                 if (success) push(result);
                 else return INTERPRET_RUNTIME_ERROR;
-                break;
+                NEXT();
             }
-            case OP_SLICE_INDEX: {
+            CASE(OP_SLICE_INDEX): {
                 ASSERT_POP(3)
                 ASSERT_NUMBER(peek(0), "Slice end index must be an integer.")
                 ASSERT_NUMBER(peek(1), "Slice start index must be an integer.")
@@ -232,9 +739,60 @@ InterpretResult VM::run() {
                 pop();
                 if (success) push(result);
                 else return INTERPRET_RUNTIME_ERROR;
-                break;
+                NEXT();
+            }
+            CASE(OP_SET_INDEX): {
+                ASSERT_POP(3)
+                if (IS_NUMBER(peek(1)) && IS_OBJ(peek(2)) && OBJ_TYPE(peek(2)) == OBJ_LIST) {
+                    ObjList* list = AS_LIST(peek(2));
+                    int index = AS_NUMBER(peek(1));
+                    if ((uint32_t) index < list->values.count) {
+                        Value value = peek(0);
+                        list->values.data[index] = value;
+                        gc.writeBarrier((Obj*) list, value);
+                        gc.stackTop -= 2;
+                        gc.stackTop[-1] = value;
+                        NEXT();
+                    }
+                }
+                if (IS_MAP(peek(2))) {
+                    // Stays on the stack while the table grows so the gc can find it.
+                    if (!assignMapKey(AS_MAP(peek(2)), peek(1), peek(0))) return INTERPRET_RUNTIME_ERROR;
+                    gc.stackTop[-3] = gc.stackTop[-1];
+                    gc.stackTop -= 2;
+                    NEXT();
+                }
+                ASSERT_NUMBER(peek(1), "Array index must be an integer.")
+                ASSERT_SEQUENCE(peek(2), "Index assignment target must be a list or map.")
+                Value value = pop();
+                int index = AS_NUMBER(pop());
+                Value array = pop();
+                if (!assignSequenceIndex(array, index, value)) return INTERPRET_RUNTIME_ERROR;
+                push(value);
+                NEXT();
             }
-            case OP_GET_LENGTH: {
+            CASE(OP_BUILD_LIST): {
+                int count = READ_BYTE();
+                ASSERT_POP(count)
+                ObjList* list = gc.newList(gc.stackTop - count, count);
+                gc.stackTop -= count;
+                push(OBJ_VAL(list));
+                NEXT();
+            }
+            CASE(OP_BUILD_MAP): {
+                int count = READ_BYTE();
+                ASSERT_POP(2 * count)
+                ObjMap* map = gc.newMap();
+                push(OBJ_VAL(map));  // for gc while the table grows
+                Value* pairs = gc.stackTop - 1 - 2 * count;
+                for (int i=0;i<count;i++){
+                    if (!assignMapKey(map, pairs[2 * i], pairs[2 * i + 1])) return INTERPRET_RUNTIME_ERROR;
+                }
+                gc.stackTop -= 2 * count + 1;
+                push(OBJ_VAL(map));
+                NEXT();
+            }
+            CASE(OP_GET_LENGTH): {
                 ASSERT_POP(1)
                 int stackOffset = READ_BYTE();
                 ASSERT_SEQUENCE(peek(stackOffset), "Length target must be a sequence")
@@ -242,28 +800,31 @@ InterpretResult VM::run() {
                 double result = getSequenceLength(array);
                 if (result == -1) return INTERPRET_RUNTIME_ERROR;
                 else push(NUMBER_VAL(result));
-                break;
+                NEXT();
             }
-            case OP_EXPONENT: {
+            CASE(OP_EXPONENT): {
                 ASSERT_POP(2)
                 ASSERT_NUMBER(peek(0), "Right operand to '**' must be a number.")
                 ASSERT_NUMBER(peek(1), "Left operand to '**' must be a number.")
                 Value right = pop();
                 Value left = pop();
                 push(NUMBER_VAL(pow(AS_NUMBER(left), AS_NUMBER(right))));
-                break;
+                NEXT();
             }
-            case OP_NEGATE:
+            CASE(OP_NEGATE):
                 ASSERT_NUMBER(peek(0), "Operand must be a number.")
                 push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_PRINT:
+                NEXT();
+            CASE(OP_PRINT):
                 ASSERT_POP(1)
                 printValue(pop(), out);
-                *out << endl;  // TODO: have a way to print without forcing the new line but should still generally push that for convince.
+                *out << '\n';  // TODO: have a way to print without forcing the new line but should still generally push that for convince.
                 afterPrint();
-                break;
-            case OP_RETURN: {
+                NEXT();
+            CASE(OP_RETURN): {
+            #ifdef VM_REGISTERS
+            returnFromFrame:  // OP_R_RETURN pushes its value and comes here
+            #endif
                 ASSERT_POP(1)
                 Value value = pop();  // get the return value
 
@@ -283,11 +844,15 @@ InterpretResult VM::run() {
                 gc.stackTop = frame.slots;  // move the stack back to the first slot. pops the value that was called, any args passed and any function getLocals.
                 CACHE_FRAME()  // point the ip back to the caller's code
                 push(value);  // put the return value back on the stack
-                break;
+                SAFEPOINT(0)
+                NEXT();
             }
-            case OP_CLOSURE: {
+            CASE(OP_CLOSURE):
+                operand = READ_BYTE();
+                wide = false;
+            makeClosure: {
                 ASSERT_POP(1)
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                ObjFunction* function = AS_FUNCTION(chunk->getConstant(operand));
                 push(OBJ_VAL(function));  // for gc
                 ObjClosure* closure = gc.newClosure(function);
                 pop();
@@ -297,86 +862,114 @@ InterpretResult VM::run() {
                 closure->upvalues.growExact(function->upvalueCount, gc);
                 for (int i=0;i<function->upvalueCount;i++) {
                     uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
+                    uint32_t index = wide ? READ_WIDE() : READ_BYTE();
                     if (isLocal) {
                         closure->upvalues.push(captureUpvalue(frame.slots + index), gc);
                     } else {
                         closure->upvalues.push(frame.closure->upvalues[index], gc);
                     }
+                    // Capturing can allocate, so the closure might not be young anymore.
+                    gc.writeBarrier((Obj*) closure, (Obj*) closure->upvalues[i]);
                 }
-                break;
+                NEXT();
             }
-            case OP_CLOSE_UPVALUE: {
+            CASE(OP_CLOSE_UPVALUE): {
                 closeUpvalues(gc.stackTop - 1);
                 pop();
-                break;
+                NEXT();
             }
-            case OP_GET_UPVALUE: {
+            CASE(OP_GET_UPVALUE): {
                 uint8_t slot = READ_BYTE();
                 push(*frame.closure->upvalues[slot]->location);
-                break;
+                NEXT();
             }
-            case OP_SET_UPVALUE: {
+            CASE(OP_SET_UPVALUE): {
                 uint8_t slot = READ_BYTE();
-                *frame.closure->upvalues[slot]->location = peek(0);
-                break;
+                ObjUpvalue* upvalue = frame.closure->upvalues[slot];
+                *upvalue->location = peek(0);
+                gc.writeBarrier((Obj*) upvalue, peek(0));
+                NEXT();
             }
-            case OP_NIL:
+            CASE(OP_NIL):
                 push(NIL_VAL());
-                break;
-            case OP_TRUE:
+                NEXT();
+            CASE(OP_TRUE):
                 push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
+                NEXT();
+            CASE(OP_FALSE):
                 push(BOOL_VAL(false));
-                break;
-            case OP_NOT:
+                NEXT();
+            CASE(OP_NOT):
                 push(BOOL_VAL(isFalsy(pop())));
-                break;
-            case OP_EQUAL:
+                NEXT();
+            CASE(OP_EQUAL):
+                FLATTEN_STRING(gc.stackTop[-1])
+                FLATTEN_STRING(gc.stackTop[-2])
                 push(BOOL_VAL(valuesEqual(pop(), pop())));
-                break;
-            case OP_POP:
+                NEXT();
+            CASE(OP_NOT_EQUAL):
+                FLATTEN_STRING(gc.stackTop[-1])
+                FLATTEN_STRING(gc.stackTop[-2])
+                push(BOOL_VAL(!valuesEqual(pop(), pop())));
+                NEXT();
+            CASE(OP_POP):
                 ASSERT_POP(1)
                 pop();
-                break;
-            case OP_POP_MANY: {
+                NEXT();
+            CASE(OP_POP_MANY): {
                 int count = READ_BYTE();
                 ASSERT_POP(count)
                 gc.stackTop -= count;
-                break;
+                NEXT();
             }
-            case OP_JUMP_IF_FALSE: {
+            CASE(OP_JUMP_IF_FALSE): {
                 uint16_t distance = READ_SHORT();
                 if (isFalsy(peek(0))) ip += distance;
-                break;
+                NEXT();
             }
-            case OP_JUMP: {
+            CASE(OP_POP_JUMP_IF_FALSE): {
+                ASSERT_POP(1)
+                uint16_t distance = READ_SHORT();
+                if (isFalsy(pop())) ip += distance;
+                NEXT();
+            }
+            CASE(OP_POP_JUMP_IF_TRUE): {
+                ASSERT_POP(1)
+                uint16_t distance = READ_SHORT();
+                if (!isFalsy(pop())) ip += distance;
+                NEXT();
+            }
+            CASE(OP_JUMP): {
                 uint16_t distance = READ_SHORT();
                 ip += distance;
-                break;
+                NEXT();
             }
-            case OP_LOOP: {
+            CASE(OP_LOOP): {
                 uint16_t distance = READ_SHORT();
                 ip -= distance;
-                break;
+                SAFEPOINT(1)
+                NEXT();
             }
-            case OP_CALL: {
+            CASE(OP_CALL): {
                 int argCount = READ_BYTE();
                 ASSERT_POP(argCount + 1)
                 if (!callValue(peek(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 CACHE_FRAME()
-
-                break;
+                SAFEPOINT(1)
+                NEXT();
             }
-            case OP_CLASS: {
-                ObjString* name = READ_STRING();
+            CASE(OP_CLASS):
+                operand = READ_BYTE();
+            makeClass: {
+                ObjString* name = OPERAND_STRING();
                 push(OBJ_VAL(gc.newClass(name)));
-                break;
+                NEXT();
             }
-            case OP_SET_PROPERTY: {
+            CASE(OP_SET_PROPERTY):
+                operand = READ_BYTE();
+            setProperty: {
                 Value val = peek();
                 Value inst = peek(1);
                 if (!IS_INSTANCE(inst)) {
@@ -384,15 +977,18 @@ InterpretResult VM::run() {
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                AS_INSTANCE(inst)->fields->set(READ_STRING(), val);
+                ObjString* name = OPERAND_STRING();
+                gc.setField(AS_INSTANCE(inst), name, val);
 
                 pop();
                 pop();
                 push(val);  // assignment is an expression.
-                break;
+                NEXT();
             }
 
-            case OP_GET_PROPERTY: {
+            CASE(OP_GET_PROPERTY):
+                operand = READ_BYTE();
+            getProperty: {
                 Value instVal = peek();
                 if (!IS_INSTANCE(instVal)) {
                     runtimeError("Only instances have fields.");
@@ -400,15 +996,34 @@ InterpretResult VM::run() {
                 }
                 ObjInstance* inst = AS_INSTANCE(instVal);
 
-                ObjString* name = READ_STRING();
+                ObjString* name = OPERAND_STRING();
+                InlineCache* cache = chunk->getInlineCache(READ_SHORT());
                 Value val;
-                bool foundField = inst->fields->get(name, &val);
+                if (cache->shape == inst->shape && inst->shape != nullptr) {
+                    CACHE_HIT();
+                    if (cache->method == nullptr) {
+                        pop();
+                        push(inst->fields[cache->fieldSlot]);
+                        NEXT();
+                    } else {
+                        ObjBoundMethod* method = gc.newBoundMethod(instVal, cache->method);
+                        pop();
+                        push(OBJ_VAL(method));
+                        NEXT();
+                    }
+                }
+                CACHE_MISS();
+
+                bool foundField = findField(inst, name, cache, &val);
                 if (foundField) {
                     pop();
                     push(val);
                 } else {
                     bool foundMethod = inst->klass->methods->get(name, &val);
                     if (foundMethod) {
+                        cache->shape = inst->shape;
+                        cache->method = AS_CLOSURE(val);
+                        rememberCache(cache);
                         ObjBoundMethod* method = gc.newBoundMethod(instVal, AS_CLOSURE(val));
                         pop();
                         push(OBJ_VAL(method));
@@ -417,22 +1032,27 @@ InterpretResult VM::run() {
                         return INTERPRET_RUNTIME_ERROR;
                     }
                 }
-                break;
+                NEXT();
             }
 
-            case OP_METHOD: {
+            CASE(OP_METHOD):
+                operand = READ_BYTE();
+            addMethod: {
                 ASSERT_POP(2);
-                ObjString* name = READ_STRING();
+                ObjString* name = OPERAND_STRING();
                 Value func = peek();
                 ObjClass* klass = AS_CLASS(peek(1));
                 klass->methods->set(name, func);
                 pop(); // don't need the method closure anymore
-                break;
+                NEXT();
             }
 
-            case OP_INVOKE: {
-                ObjString* name = READ_STRING();
+            CASE(OP_INVOKE):
+                operand = READ_BYTE();
+            invoke: {
+                ObjString* name = OPERAND_STRING();
                 int argCount = READ_BYTE();
+                InlineCache* cache = chunk->getInlineCache(READ_SHORT());
                 ASSERT_POP(argCount + 1);
                 Value receiver = peek(argCount);
 
@@ -443,10 +1063,27 @@ InterpretResult VM::run() {
 
                 ObjInstance* inst = AS_INSTANCE(receiver);
 
-                // You're allowed to store a function in a field and call it, so must check.
-                // Fields can shadow methods, so it takes two look ups in the common case (sad).
+                // The shape fixes which fields exist, so a hit already knows whether a field shadows the method.
                 Value field;
-                bool foundField = inst->fields->get(name, &field);
+                bool foundField;
+                if (cache->shape == inst->shape && inst->shape != nullptr) {
+                    CACHE_HIT();
+                    if (cache->method != nullptr) {
+                        if (!call(cache->method, argCount)) {
+                            return INTERPRET_RUNTIME_ERROR;
+                        }
+                        CACHE_FRAME()
+                        SAFEPOINT(1)
+                        NEXT();
+                    }
+                    field = inst->fields[cache->fieldSlot];
+                    foundField = true;
+                } else {
+                    // You're allowed to store a function in a field and call it, so must check.
+                    CACHE_MISS();
+                    foundField = findField(inst, name, cache, &field);
+                }
+
                 if (foundField) {
                     gc.stackTop[-argCount - 1] = field;  // this is where the function lives when you do a normal call. But I think nothing relies on that?
                     if (!callValue(field, argCount)) {
@@ -454,17 +1091,25 @@ InterpretResult VM::run() {
                     }
                 } else {
                     ObjClass* klass = inst->klass;
-                    if (!invokeFromClass(klass, name, argCount)) {
+                    Value methodClosure;
+                    if (!klass->methods->get(name, &methodClosure)) {
                         runtimeError("Method not found");
                         return INTERPRET_RUNTIME_ERROR;
                     }
+                    cache->shape = inst->shape;
+                    cache->method = AS_CLOSURE(methodClosure);
+                    rememberCache(cache);
+                    if (!call(AS_CLOSURE(methodClosure), argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
                 }
 
                 CACHE_FRAME()
-                break;
+                SAFEPOINT(1)
+                NEXT();
             }
 
-            case OP_INHERIT: {
+            CASE(OP_INHERIT): {
                 ASSERT_POP(2)
                 Table* subClassMethods = AS_CLASS(peek())->methods;
                 if (!IS_CLASS(peek(1))) {
@@ -474,13 +1119,15 @@ InterpretResult VM::run() {
                 Table* superMethods = AS_CLASS(peek(1))->methods;
                 subClassMethods->safeAddAll(*superMethods);
                 pop();  // subclass. leaves the super class at the top of the stack, it becomes a variable.
-                break;
+                NEXT();
             }
-            case OP_GET_SUPER: {
+            CASE(OP_GET_SUPER):
+                operand = READ_BYTE();
+            getSuper: {
                 ASSERT_POP(2);
                 Value superVal = peek();
                 Value thisVal = peek(1);
-                ObjString* name = READ_STRING();
+                ObjString* name = OPERAND_STRING();
 
                 // TODO: shared bindMethod function with normal method access.
                 Value unbound;
@@ -495,10 +1142,12 @@ InterpretResult VM::run() {
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                break;
+                NEXT();
             }
-            case OP_SUPER_INVOKE: {
-                ObjString* name = READ_STRING();
+            CASE(OP_SUPER_INVOKE):
+                operand = READ_BYTE();
+            superInvoke: {
+                ObjString* name = OPERAND_STRING();
                 int argCount = READ_BYTE();
                 ASSERT_POP(argCount + 1 + 1);
                 ObjClass* superClass = AS_CLASS(pop());
@@ -515,27 +1164,95 @@ InterpretResult VM::run() {
                 }
 
                 CACHE_FRAME()
-                break;
+                SAFEPOINT(1)
+                NEXT();
             }
-            case OP_EXIT_VM:  // used to exit the repl or return from debugger.
+            CASE(OP_EXIT_VM):  // used to exit the repl or return from debugger.
                 return INTERPRET_EXIT;
 
-            case OP_LOAD_INLINE_CONSTANT:
+            CASE(OP_GET_CONSTANT_LONG):
+                push(chunk->getConstant(READ_WIDE()));
+                NEXT();
+            CASE(OP_JUMP_LONG): {
+                uint32_t distance = READ_WIDE();
+                ip += distance;
+                NEXT();
+            }
+            CASE(OP_LOOP_LONG): {
+                uint32_t distance = READ_WIDE();
+                ip -= distance;
+                SAFEPOINT(1)
+                NEXT();
+            }
+            CASE(OP_JUMP_IF_FALSE_LONG): {
+                uint32_t distance = READ_WIDE();
+                if (isFalsy(peek(0))) ip += distance;
+                NEXT();
+            }
+            CASE(OP_POP_JUMP_IF_FALSE_LONG): {
+                ASSERT_POP(1)
+                uint32_t distance = READ_WIDE();
+                if (isFalsy(pop())) ip += distance;
+                NEXT();
+            }
+            CASE(OP_POP_JUMP_IF_TRUE_LONG): {
+                ASSERT_POP(1)
+                uint32_t distance = READ_WIDE();
+                if (!isFalsy(pop())) ip += distance;
+                NEXT();
+            }
+            CASE(OP_WIDE): {
+                byte op = READ_BYTE();
+                operand = READ_WIDE();
+                wide = true;
+                switch (op) {
+                    case OP_GET_LOCAL:
+                        ASSERT_PEEK(operand)
+                        push(STACK_BASE()[operand]);
+                        break;
+                    case OP_SET_LOCAL:
+                        ASSERT_PEEK(operand)
+                        STACK_BASE()[operand] = peek(0);
+                        break;
+                    case OP_GET_UPVALUE:
+                        push(*frame.closure->upvalues[operand]->location);
+                        break;
+                    case OP_SET_UPVALUE: {
+                        ObjUpvalue* upvalue = frame.closure->upvalues[operand];
+                        *upvalue->location = peek(0);
+                        gc.writeBarrier((Obj*) upvalue, peek(0));
+                        break;
+                    }
+                    case OP_CLOSURE: goto makeClosure;
+                    case OP_CLASS: goto makeClass;
+                    case OP_METHOD: goto addMethod;
+                    case OP_GET_PROPERTY: goto getProperty;
+                    case OP_SET_PROPERTY: goto setProperty;
+                    case OP_INVOKE: goto invoke;
+                    case OP_GET_SUPER: goto getSuper;
+                    case OP_SUPER_INVOKE: goto superInvoke;
+                    default:
+                        FORMAT_RUNTIME_ERROR("Opcode '%d' can't be wide. Index in chunk: %d.", op, (int) (ip - chunk->getCodePtr() - 5));
+                        return INTERPRET_RUNTIME_ERROR;
+                }
+                NEXT();
+            }
+            CASE(OP_LOAD_INLINE_CONSTANT):
                 loadInlineConstant();
-                break;
-            case OP_DEBUG_BREAK_POINT:  // TODO: enter repl?
+                NEXT();
+            CASE(OP_DEBUG_BREAK_POINT):  // TODO: enter repl?
                 printDebugInfo();
-                break;
-            default: {
+                NEXT();
+            CASE_DEFAULT: {
                 FORMAT_RUNTIME_ERROR("Unrecognised opcode '%d'. Index in chunk: %d. Size of chunk: %d ", instruction, ip - currentChunk()->getCodePtr() - 1, currentChunk()->getCodeSize());
                 return INTERPRET_RUNTIME_ERROR;
             }
         }
 
-        #ifdef VM_PROFILING
-        auto loopEnd = std::chrono::high_resolution_clock::now();
-        instructionTimeTotal[instruction] += std::chrono::duration_cast<std::chrono::nanoseconds>(loopEnd - loopStart).count();
-        instructionCount[instruction]++;
+        #ifdef VM_OPCODE_NGRAMS
+        recentOpcodes = ((recentOpcodes << 8) | instruction) & 0xFFFFFF;
+        opcodePairCounts[(recentOpcodes >> 8) & 0xFF][instruction]++;
+        opcodeTripleCounts[recentOpcodes]++;
         #endif
     }
 
@@ -543,10 +1260,21 @@ InterpretResult VM::run() {
     #undef READ_CONSTANT
     #undef ASSERT_NUMBER
     #undef BINARY_OP
+    #undef QUICKEN
+    #undef DEQUICKEN
     #undef READ_STRING
     #undef ASSERT_SEQUENCE
     #undef ASSERT_POP
     #undef READ_SHORT
+    #undef READ_WIDE
+    #undef OPERAND_STRING
+    #undef CASE
+    #undef CASE_DEFAULT
+    #undef NEXT
+    #undef RUN_JIT
+    #undef SAFEPOINT
+    #undef PROFILE_INSTRUCTION
+    #undef PROFILE_CYCLES
 }
 
 
@@ -561,6 +1289,29 @@ bool VM::invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
     return false;
 }
 
+// Looks up a field through the instance's shape and points the cache at the slot it was found in.
+// Instances in dictionary mode have no shape to key the cache on so they always take this path.
+bool VM::findField(ObjInstance* inst, ObjString* name, InlineCache* cache, Value* valueOut) {
+    if (inst->shape == nullptr) return inst->dictionary->get(name, valueOut);
+
+    int slot = getFieldSlot(inst, name);
+    if (slot == -1) return false;
+
+    cache->shape = inst->shape;
+    cache->method = nullptr;
+    cache->fieldSlot = slot;
+    rememberCache(cache);
+    *valueOut = inst->fields[slot];
+    return true;
+}
+
+// Caches belong to the current function's chunk so filling one is a store into that function.
+inline void VM::rememberCache(InlineCache* cache) {
+    Obj* function = (Obj*) gc.frames[gc.frameCount - 1].closure->function;
+    gc.writeBarrier(function, (Obj*) cache->shape);
+    gc.writeBarrier(function, (Obj*) cache->method);
+}
+
 ObjUpvalue* VM::captureUpvalue(Value* local){
 #ifdef VM_DEBUG_TRACE_EXECUTION
     cerr << "[Capture]: ";
@@ -601,22 +1352,33 @@ void VM::closeUpvalues(Value* last) {
         // Steak the value and point to yourself instead of the stack.
         gc.openUpvalues->closed = *gc.openUpvalues->location;
         gc.openUpvalues->location = &gc.openUpvalues->closed;
+        gc.writeBarrier((Obj*) gc.openUpvalues, gc.openUpvalues->closed);
         gc.openUpvalues = gc.openUpvalues->next;
     }
 }
 
 void VM::runtimeError(const string& message){
+    flushOutput();  // so the error comes after what the script printed before it
     *err << message << endl;
     printStackTrace(err);
 }
 
+// For natives to report bad arguments. The call fails with this message instead of returning what the native did.
+Value VM::nativeError(const string& message){
+    runtimeError(message);
+    nativeFailed = true;
+    return NIL_VAL();
+}
+
 void VM::printStackTrace(ostream* output){
     for (int i = gc.frameCount - 1; i >= 0; i--) {
         CallFrame* frame = &gc.frames[i];
         ObjFunction* function = frame->closure->function;
-        int instructionOffset = (int) (frame->ip - function->chunk->getCodePtr() - 1);
-        int line = function->chunk->getLineNumber(instructionOffset);
-        *output << "[line " << line << "] in ";
+        // The running frame's ip is only written back to it on calls.
+        byte* frameIp = i == gc.frameCount - 1 ? ip : frame->ip;
+        int instructionOffset = (int) (frameIp - function->chunk->getCodePtr() - 1);
+        SourcePosition position = function->chunk->getPosition(instructionOffset);
+        *output << "[line " << position.line << ", column " << position.column << "] in ";
         if (function->name == nullptr) {
             *output << "script" << endl;
         } else {
@@ -631,38 +1393,63 @@ bool VM::isFalsy(Value value){
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Joins the two strings on top of the stack. They stay there until the result is allocated so the gc can find them.
 void VM::concatenate(){
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));   // gc
+    concatenate(gc.stackTop - 2);
+    pop();
+}
+
+// Joins the strings, ropes or views in <operands> and <operands + 1> (which must be below gc.stackTop) and puts the result in the first.
+// Only short results are copied. Anything longer is a rope that points at the two halves.
+void VM::concatenate(Value* operands){
+    Obj* a = skipFlattened(AS_OBJ(operands[0]));
+    Obj* b = skipFlattened(AS_OBJ(operands[1]));
+    uint32_t aLength = stringLength(a);
+    uint32_t bLength = stringLength(b);
+    uint32_t length = aLength + bLength;
+
+    if (bLength == 0) {
+        operands[0] = OBJ_VAL(a);
+        return;
+    }
+    if (aLength == 0) {
+        operands[0] = OBJ_VAL(b);
+        return;
+    }
+    if (length >= ROPE_MIN_LENGTH) {
+        operands[0] = OBJ_VAL(gc.newRope(a, b, length));
+        return;
+    }
 
-    uint32_t length = a->array.length-1 + b->array.length-1;
     char* chars = (char*) gc.reallocate(nullptr, 0, sizeof(char) * (length+1));
-    memcpy(chars, a->array.contents, a->array.length - 1);
-    memcpy(chars + a->array.length - 1, b->array.contents, b->array.length - 1);
+    copyStringChars(a, chars);
+    copyStringChars(b, chars + aLength);
     chars[length] = '\0';
 
-    ObjString* result = gc.takeString(chars, length);
-    pop();
-    pop();
-    push(OBJ_VAL(result));
+    operands[0] = OBJ_VAL(gc.takeString(chars, length));
 }
 
 void VM::freeObjects(){
-    Obj* object = gc.objects;
-    while (object != nullptr) {
-        Obj* next = object->next;
-        gc.freeObject(object);
-        object = next;
+    for (Obj* object : {gc.objects, gc.youngObjects, gc.condemnedYoung}) {
+        while (object != nullptr) {
+            Obj* next = object->next;
+            gc.freeObject(object);
+            object = next;
+        }
     }
     gc.objects = nullptr;
+    gc.youngObjects = nullptr;
+    gc.condemnedYoung = nullptr;
 }
 
 void VM::printDebugInfo() {
+    flushOutput();
     Chunk* chunk = gc.frames[gc.frameCount - 1].closure->function->chunk;
     cout << "Current Chunk Constants:" << endl;
     chunk->printConstantsArray();
     cout << "Allocated Heap Objects:" << endl;
     printObjectsList(gc.objects);
+    printObjectsList(gc.youngObjects);
     cout << "Current Stack:" << endl;
     debugPrintValueArray(gc.stack, gc.stackTop);
     cout << "Index in chunk: " << (ip - chunk->getCodePtr() - 1) << ". Length of chunk: " << chunk->getCodeSize()  << "." << endl;
@@ -713,15 +1500,30 @@ void VM::loadInlineConstant(){
     }
 }
 
+// <array> must be reachable by the gc since a rope is flattened first.
+// Every one character string already exists so indexing a string never allocates.
 bool VM::accessSequenceIndex(Value array, int index, Value* result){
-    if (IS_STRING(array)){
-        ObjString* str = AS_STRING(array);
-        uint32_t realIndex = index < 0 ? str->array.length - 1 + index : index;
-        if (realIndex >= str->array.length-1){
+    if (IS_ANY_STRING(array)){
+        // A view is read in place. Only a rope has to be flattened to find a character in it.
+        if (OBJ_TYPE(array) == OBJ_ROPE) array = gc.flatten(array);
+        Obj* text = skipFlattened(AS_OBJ(array));
+        uint32_t length = stringLength(text);
+        uint32_t realIndex = index < 0 ? length + index : index;
+        if (realIndex >= length){
+            array = gc.flatten(array);
             FORMAT_RUNTIME_ERROR("Index '%d' out of bounds for string '%s'.", index, AS_CSTRING(array));
-            return INTERPRET_RUNTIME_ERROR;
+            return false;
+        }
+        *result = OBJ_VAL(gc.singleChars[(uint8_t) stringChars(text)[realIndex]]);
+        return true;
+    } else if (IS_LIST(array)){
+        ObjList* list = AS_LIST(array);
+        uint32_t realIndex = index < 0 ? list->values.count + index : index;
+        if (realIndex >= list->values.count){
+            FORMAT_RUNTIME_ERROR("Index '%d' out of bounds for list of length %u.", index, list->values.count);
+            return false;
         }
-        *result = OBJ_VAL(gc.copyString(AS_CSTRING(array) + realIndex, 1));
+        *result = list->values[realIndex];
         return true;
     } else {
         runtimeError("Unrecognised sequence type");
@@ -729,26 +1531,102 @@ bool VM::accessSequenceIndex(Value array, int index, Value* result){
     }
 }
 
+// <key> must be reachable by the gc since a rope is flattened first.
+bool VM::accessMapKey(ObjMap* map, Value key, Value* result){
+    key = gc.flatten(key);
+    if (map->table->get(key, result)) return true;
+    ostringstream message;
+    message << "Key '";
+    printValue(key, &message);
+    message << "' is not in the map.";
+    runtimeError(message.str());
+    return false;
+}
+
+// <key> and <value> must be reachable by the gc since the table might grow.
+// A rope key is flattened so the map doesn't keep all its pieces alive.
+bool VM::assignMapKey(ObjMap* map, Value key, Value value){
+    key = gc.flatten(key);
+    if (!ValueTable::isValidKey(key)) {
+        runtimeError(IS_NIL(key) ? "Map key can't be nil." : "Map key can't be NaN.");
+        return false;
+    }
+    map->table->set(key, value);
+    return true;
+}
+
+// Strings are immutable so only lists can be assigned to.
+bool VM::assignSequenceIndex(Value array, int index, Value value){
+    if (IS_LIST(array)){
+        ObjList* list = AS_LIST(array);
+        uint32_t realIndex = index < 0 ? list->values.count + index : index;
+        if (realIndex >= list->values.count){
+            FORMAT_RUNTIME_ERROR("Index '%d' out of bounds for list of length %u.", index, list->values.count);
+            return false;
+        }
+        list->values[realIndex] = value;
+        gc.writeBarrier((Obj*) list, value);
+        return true;
+    } else if (IS_ANY_STRING(array)){
+        runtimeError("Can't assign to an index of a string.");
+        return false;
+    } else {
+        runtimeError("Unrecognised sequence type");
+        return false;
+    }
+}
+
+// <array> must be reachable by the gc since a rope is flattened first.
 bool VM::accessSequenceSlice(Value array, int startIndex, int endIndex, Value* result){
-    if (IS_STRING(array)){
-        ObjString* str = AS_STRING(array);
-        uint32_t realEndIndex = endIndex < 0 ? str->array.length - 1 + endIndex : endIndex;
-        uint32_t realStartIndex = startIndex < 0 ? str->array.length - 1 + startIndex : startIndex;
-        if (realEndIndex > str->array.length - 1){
+    if (IS_ANY_STRING(array)){
+        if (OBJ_TYPE(array) == OBJ_ROPE) array = gc.flatten(array);
+        Obj* text = skipFlattened(AS_OBJ(array));
+        uint32_t length = stringLength(text);
+        uint32_t realEndIndex = endIndex < 0 ? length + endIndex : endIndex;
+        uint32_t realStartIndex = startIndex < 0 ? length + startIndex : startIndex;
+        if (realEndIndex > length){
+            array = gc.flatten(array);
             FORMAT_RUNTIME_ERROR("Index '%u' out of bounds for string '%s'.", endIndex, AS_CSTRING(array));
-            return INTERPRET_RUNTIME_ERROR;
+            return false;
         }
-        if (realStartIndex >= str->array.length - 1){
+        if (realStartIndex >= length){
+            array = gc.flatten(array);
             FORMAT_RUNTIME_ERROR("Index '%u' out of bounds for string '%s'.", startIndex, AS_CSTRING(array));
-            return INTERPRET_RUNTIME_ERROR;
+            return false;
         }
         if (realEndIndex <= realStartIndex) {
             FORMAT_RUNTIME_ERROR("Invalid sequence slice. Start: '%d' (inclusive), End: '%d' (exclusive).", realStartIndex, realEndIndex);
-            return INTERPRET_RUNTIME_ERROR;
+            return false;
         }
 
-        ObjString* newString = gc.copyString(AS_CSTRING(array) + realStartIndex, (int) (realEndIndex - realStartIndex));
-        *result = OBJ_VAL(newString);
+        // The slice points into the original's characters instead of copying them. A view of a view shares its parent.
+        uint32_t sliceLength = realEndIndex - realStartIndex;
+        if (sliceLength == 1) {
+            *result = OBJ_VAL(gc.singleChars[(uint8_t) stringChars(text)[realStartIndex]]);
+        } else if (sliceLength == length) {
+            *result = OBJ_VAL(text);
+        } else if (text->type == OBJ_STRING_VIEW) {
+            ObjStringView* view = (ObjStringView*) text;
+            *result = OBJ_VAL(gc.newStringView(view->parent, view->start + realStartIndex, sliceLength));
+        } else {
+            *result = OBJ_VAL(gc.newStringView((ObjString*) text, realStartIndex, sliceLength));
+        }
+        return true;
+    } else if (IS_LIST(array)){
+        // Unlike strings, an empty slice is fine so xs[1:] of a one item list is [].
+        ObjList* list = AS_LIST(array);
+        uint32_t realEndIndex = endIndex < 0 ? list->values.count + endIndex : endIndex;
+        uint32_t realStartIndex = startIndex < 0 ? list->values.count + startIndex : startIndex;
+        if (realEndIndex > list->values.count){
+            FORMAT_RUNTIME_ERROR("Index '%d' out of bounds for list of length %u.", endIndex, list->values.count);
+            return false;
+        }
+        if (realStartIndex > realEndIndex) {
+            FORMAT_RUNTIME_ERROR("Invalid sequence slice. Start: '%d' (inclusive), End: '%d' (exclusive).", realStartIndex, realEndIndex);
+            return false;
+        }
+
+        *result = OBJ_VAL(gc.newList(list->values.data + realStartIndex, realEndIndex - realStartIndex));
         return true;
     } else {
         runtimeError("Unrecognised sequence type");
@@ -757,9 +1635,10 @@ bool VM::accessSequenceSlice(Value array, int startIndex, int endIndex, Value* r
 }
 
 double VM::getSequenceLength(Value array){
-    if (IS_STRING(array)){
-        ObjString* str = AS_STRING(array);
-        return str->array.length - 1;
+    if (IS_ANY_STRING(array)){
+        return stringLength(AS_OBJ(array));
+    } else if (IS_LIST(array)){
+        return AS_LIST(array)->values.count;
     } else {
         runtimeError("Unrecognised sequence type");
         return -1;
@@ -768,76 +1647,160 @@ double VM::getSequenceLength(Value array){
 
 void VM::printTimeByInstruction(){
     #ifdef VM_PROFILING
-        cerr << "VM Time per Instruction Type" << endl;
-        long totalTime = 0;
-        long totalLoops = 0;
+        uint64_t totalCount = 0;
+        uint64_t totalCycles = 0;
         for (int i=0;i<256;i++){
-            totalTime += instructionTimeTotal[i];
-            totalLoops += instructionCount[i];
+            totalCount += instructionCount[i];
+            #ifdef VM_PROFILING_CYCLES
+            totalCycles += instructionCycles[i];
+            #endif
+        }
+        if (totalCount == 0) return;
+
+        cerr << "VM Instructions by Type" << endl;
+        for (int i=-1;i<256;i++){
+            uint64_t count = i < 0 ? totalCount : instructionCount[i];
+            if (count == 0) continue;
+            fprintf(stderr, "%25s: %12llu times (%6.2f%%)", i < 0 ? "total" : Chunk::opcodeNames[i].c_str(),
+                    (unsigned long long) count, (double) count / (double) totalCount * 100);
+            #ifdef VM_PROFILING_CYCLES
+            uint64_t cycles = i < 0 ? totalCycles : instructionCycles[i];
+            fprintf(stderr, " %14llu cycles (%6.2f%%) %8.1f each", (unsigned long long) cycles,
+                    (double) cycles / (double) totalCycles * 100, (double) cycles / (double) count);
+            #endif
+            fprintf(stderr, "\n");
         }
-        fprintf(stderr, "%25s: %10ld ns (%.2f%%) for %7ld times (%5.2f%%)\n","total", totalTime, 100.0, totalLoops, 100.0);
+    #endif
+}
 
+// One JSON object for tools like tests/bench.py to compare runs with (lox -j path). gc is always there. The rest is only what
+// this build counted: opcodes and pairs with VM_PROFILING (cycles with VM_PROFILING_CYCLES), and hardware if perf_event_open worked.
+bool VM::writeStats(const char* path, const HardwareCounters& hardware){
+    FILE* file = fopen(path, "w");
+    if (file == nullptr) return false;
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"gc\": {\"full\": %llu, \"young\": %llu, \"heap_bytes\": %llu},\n", (unsigned long long) gc.fullCollections,
+            (unsigned long long) gc.youngCollections, (unsigned long long) gc.bytesAllocated);
+    if (hardware.available) {
+        fprintf(file, "  \"hardware\": {\"cycles\": %llu, \"instructions\": %llu}", (unsigned long long) hardware.cycles,
+                (unsigned long long) hardware.instructions);
+    } else {
+        fprintf(file, "  \"hardware\": null");
+    }
+
+    #ifdef VM_PROFILING
+        fprintf(file, ",\n  \"opcodes\": {");
+        const char* separator = "\n";
         for (int i=0;i<256;i++){
-            if (instructionCount[i] > 0) {
-                double percentTime = (double) instructionTimeTotal[i] / (double) totalTime * 100;
-                double percentLoops = (double) instructionCount[i] / (double) totalLoops * 100;
-                fprintf(stderr, "%25s: %10ld ns (%6.1f%%) for %7d times (%5.2f%%)\n", Chunk::opcodeNames[i].c_str(), instructionTimeTotal[i], percentTime, instructionCount[i], percentLoops);
+            if (instructionCount[i] == 0) continue;
+            fprintf(file, "%s    \"%s\": {\"count\": %llu", separator, Chunk::opcodeNames[i].c_str(), (unsigned long long) instructionCount[i]);
+            #ifdef VM_PROFILING_CYCLES
+            fprintf(file, ", \"cycles\": %llu", (unsigned long long) instructionCycles[i]);
+            #endif
+            fprintf(file, "}");
+            separator = ",\n";
+        }
+        fprintf(file, "\n  },\n  \"pairs\": [");
+
+        // Most frequent first, since that's what picking superinstructions starts from.
+        vector<pair<uint64_t, int>> pairs;
+        for (int i=0;i<256*256;i++){
+            if (instructionPairCount[i / 256][i % 256] > 0) pairs.emplace_back(instructionPairCount[i / 256][i % 256], i);
+        }
+        sort(pairs.begin(), pairs.end(), [](auto& a, auto& b) { return a.first > b.first; });
+        separator = "\n";
+        for (auto& entry : pairs) {
+            fprintf(file, "%s    [\"%s\", \"%s\", %llu]", separator, Chunk::opcodeNames[entry.second / 256].c_str(),
+                    Chunk::opcodeNames[entry.second % 256].c_str(), (unsigned long long) entry.first);
+            separator = ",\n";
+        }
+        fprintf(file, "\n  ]");
+    #endif
+
+    fprintf(file, "\n}\n");
+    bool failed = ferror(file);
+    return fclose(file) == 0 && !failed;
+}
+
+// One line per sequence so tests/ngrams.py can add up the counts from every benchmark.
+void VM::printOpcodeNgrams(){
+    #ifdef VM_OPCODE_NGRAMS
+        // The first instruction has nothing before it so it's counted after OP_INVALID, which isn't a real pair.
+        for (int a=OP_INVALID + 1;a<256;a++){
+            for (int b=0;b<256;b++){
+                if (opcodePairCounts[a][b] == 0) continue;
+                fprintf(stderr, "ngram %llu %s %s\n", (unsigned long long) opcodePairCounts[a][b], Chunk::opcodeNames[a].c_str(), Chunk::opcodeNames[b].c_str());
             }
         }
+        for (auto& entry : opcodeTripleCounts) {
+            // The first couple of instructions don't have a full triple before them.
+            if (entry.first <= 0xFFFF) continue;
+            fprintf(stderr, "ngram %llu %s %s %s\n", (unsigned long long) entry.second, Chunk::opcodeNames[entry.first >> 16].c_str(),
+                    Chunk::opcodeNames[(entry.first >> 8) & 0xFF].c_str(), Chunk::opcodeNames[entry.first & 0xFF].c_str());
+        }
+    #endif
+}
+
+void VM::printInlineCacheStats(){
+    #ifdef VM_INLINE_CACHE_STATS
+        long total = inlineCacheHits + inlineCacheMisses;
+        double percentHits = total == 0 ? 0 : (double) inlineCacheHits / (double) total * 100;
+        fprintf(stderr, "Inline caches: %ld hits, %ld misses (%.2f%% hit rate)\n", inlineCacheHits, inlineCacheMisses, percentHits);
     #endif
 }
 
 bool VM::callValue(Value value, int argCount) {
-    switch (value.type) {
-        case VAL_OBJ:
-            switch (AS_OBJ(value)->type) {
-                case OBJ_CLOSURE:
-                    return call(AS_CLOSURE(value), argCount);
-                case OBJ_BOUND_METHOD: {
-                    auto bound = AS_BOUND_METHOD(value);
-                    // Insert the bound receiver, in the stack slot reserved for `this`.
-                    // Overwrites the ObjBoundMethod we just called, which is fine because inst->klass->methods means the gc can still find it.
-                    gc.stackTop[-argCount - 1] = bound->receiver;
-                    return call(bound->method, argCount);
+    if (IS_OBJ(value)) {
+        switch (AS_OBJ(value)->type) {
+            case OBJ_CLOSURE:
+                return call(AS_CLOSURE(value), argCount);
+            case OBJ_BOUND_METHOD: {
+                auto bound = AS_BOUND_METHOD(value);
+                // Insert the bound receiver, in the stack slot reserved for `this`.
+                // Overwrites the ObjBoundMethod we just called, which is fine because inst->klass->methods means the gc can still find it.
+                gc.stackTop[-argCount - 1] = bound->receiver;
+                return call(bound->method, argCount);
+            }
+            case OBJ_NATIVE: {
+                ObjNative* func = AS_NATIVE(value);
+                if (func->arity != argCount) {
+                    FORMAT_RUNTIME_ERROR("Function call requires %d arguments, cannot pass %d.", func->arity, argCount);
+                    return false;
                 }
-                case OBJ_NATIVE: {
-                    ObjNative* func = AS_NATIVE(value);
-                    if (func->arity != argCount) {
-                        FORMAT_RUNTIME_ERROR("Function call requires %d arguments, cannot pass %d.", func->arity, argCount);
-                        return false;
-                    }
-                    Value result = func->function(this, gc.stackTop - argCount);
-                    gc.stackTop -= argCount + 1;  // +1 for the object being called
-                    push(result);
-                    gc.frames[gc.frameCount - 1].ip = ip;
-                    return true;
+                Value result = func->function(this, gc.stackTop - argCount);
+                if (nativeFailed) {
+                    nativeFailed = false;
+                    return false;
                 }
-                case OBJ_CLASS: {
-                    ObjClass* klass = AS_CLASS(value);
-                    // Replace the first slot (class value) with the instance, it will be used as the `this` value in the constructor.
-                    gc.stackTop[-argCount - 1] = OBJ_VAL(gc.newInstance(klass));
-
-                    Value init;
-                    if (klass->methods->get(gc.init, &init)) {
-                        // This will pop off all the args when it returns, leaving just the instance.
-                        return call(AS_CLOSURE(init), argCount);
-                    } else if (argCount != 0) {
-                        // Not resetting ip, but quitting vm.
-                        FORMAT_RUNTIME_ERROR("Expected 0 arguments but got %d.", argCount);
-                        return false;
-                    } else {
-                        gc.frames[gc.frameCount - 1].ip = ip;  // Frame gets reloaded to handle real functions.
-                        return true;
-                    }
+                gc.stackTop -= argCount + 1;  // +1 for the object being called
+                push(result);
+                gc.frames[gc.frameCount - 1].ip = ip;
+                return true;
+            }
+            case OBJ_CLASS: {
+                ObjClass* klass = AS_CLASS(value);
+                // Replace the first slot (class value) with the instance, it will be used as the `this` value in the constructor.
+                gc.stackTop[-argCount - 1] = OBJ_VAL(gc.newInstance(klass));
+
+                Value init;
+                if (klass->methods->get(gc.init, &init)) {
+                    // This will pop off all the args when it returns, leaving just the instance.
+                    return call(AS_CLOSURE(init), argCount);
+                } else if (argCount != 0) {
+                    // Not resetting ip, but quitting vm.
+                    FORMAT_RUNTIME_ERROR("Expected 0 arguments but got %d.", argCount);
+                    return false;
+                } else {
+                    gc.frames[gc.frameCount - 1].ip = ip;  // Frame gets reloaded to handle real functions.
+                    return true;
                 }
-                case OBJ_FUNCTION:
-                    runtimeError("ICE. No direct function call. Must wrap with closure.");
-                default:
-                    break;
             }
-            break;
-        default:
-            break;
+            case OBJ_FUNCTION:
+                runtimeError("ICE. No direct function call. Must wrap with closure.");
+            default:
+                break;
+        }
     }
     runtimeError("Can only call functions and classes.");
     return false;
@@ -851,6 +1814,12 @@ bool VM::call(ObjClosure* closure, int argCount){
         return false;
     }
 
+    // Every frame fits in its even share of the stack unless it has more locals than a byte can index.
+    if (function->maxLocals > UINT8_MAX && stackHeight() + function->maxLocals + UINT8_MAX > STACK_MAX){
+        runtimeError("Stack overflow.");
+        return false;
+    }
+
     if (argCount != function->arity) {
         FORMAT_RUNTIME_ERROR("Expected %d arguments but got %d.", function->arity, argCount);
         return false;
@@ -877,7 +1846,13 @@ void VM::defineNative(const string& name, NativeFn function, int arity) {
 }
 
 void VM::afterPrint() {
+    if (lineBuffered) flushOutput();
+}
 
+void VM::flushOutput() {
+    out->flush();
 }
 
-#undef FORMAT_RUNTIME_ERROR
\ No newline at end of file
+#undef FORMAT_RUNTIME_ERROR
+#undef CACHE_HIT
+#undef CACHE_MISS
\ No newline at end of file
@@ -6,7 +6,11 @@
 #include "value.h"
 #include "compiler/compiler.h"
 #include "table.h"
+#include "jit.h"
+#include "output.h"
+#include "profiler.h"
 #include <chrono>
+#include <unordered_map>
 #include "common.h"
 
 typedef enum {
@@ -27,6 +31,7 @@ public:
 
     InterpretResult interpret(char* src);
     bool loadFromSource(char *src);
+    void loadFunction(ObjFunction* function);
     void printDebugInfo();
 
     InterpretResult run();
@@ -37,13 +42,33 @@ public:
     }
 
     #ifdef VM_PROFILING
-    static long instructionTimeTotal[256];
-    static int instructionCount[256];
+    static uint64_t instructionCount[256];
+    static uint64_t instructionPairCount[256][256];  // [first][second]
+    #ifdef VM_PROFILING_CYCLES
+    static uint64_t instructionCycles[256];
+    #endif
+    #endif
+
+    #ifdef VM_OPCODE_NGRAMS
+    // How many times each pair and triple of opcodes ran back to back. Used to pick superinstructions.
+    static uint64_t opcodePairCounts[256][256];
+    static unordered_map<uint32_t, uint64_t> opcodeTripleCounts;
+    static uint32_t recentOpcodes;
+    #endif
+
+    #ifdef VM_INLINE_CACHE_STATS
+    static long inlineCacheHits;
+    static long inlineCacheMisses;
     #endif
 
     static void printTimeByInstruction();
+    // Returns false if the file couldn't be written.
+    bool writeStats(const char* path, const HardwareCounters& hardware);
+    static void printInlineCacheStats();
+    static void printOpcodeNgrams();
     ObjString* produceString(const string& str);
     Value produceFunction(char *src);
+    Value nativeError(const string& message);
 
     Memory gc;
 
@@ -55,6 +80,14 @@ public:
     ostream* out;
     ostream* err;
 
+    // Where out points unless something (like WebVm) replaces it.
+    OutputBuffer stdoutBuffer;
+    ostream stdoutStream;
+    // Write out everything after each print instead of when the buffer fills. For the repl and terminals.
+    bool lineBuffered = false;
+
+    SamplingProfiler* profiler = nullptr;  // set while lox -p is sampling
+
     void resetStack();
     void push(Value value);
     Value pop();
@@ -68,11 +101,13 @@ public:
     }
 
     virtual void runtimeError(const string &message);
+    bool nativeFailed = false;  // set by nativeError so callValue knows not to use the result
     void printStackTrace(ostream* output);
 
     static bool isFalsy(Value value);
 
     void concatenate();
+    void concatenate(Value* operands);
     void freeObjects();
 
     int stackHeight();
@@ -81,6 +116,12 @@ public:
 
     bool accessSequenceIndex(Value array, int index, Value *result);
 
+    bool assignSequenceIndex(Value array, int index, Value value);
+
+    bool accessMapKey(ObjMap* map, Value key, Value* result);
+
+    bool assignMapKey(ObjMap* map, Value key, Value value);
+
     bool accessSequenceSlice(Value array, int startIndex, int endIndex, Value *result);
 
     double getSequenceLength(Value array);
@@ -97,8 +138,11 @@ public:
     ObjUpvalue* captureUpvalue(Value* local);
     void closeUpvalues(Value* last);
     bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount);
+    bool findField(ObjInstance* inst, ObjString* name, InlineCache* cache, Value* valueOut);
+    void rememberCache(InlineCache* cache);
 
     virtual void afterPrint();
+    virtual void flushOutput();
 };
 
 #endif
\ No newline at end of file
@@ -11,6 +11,7 @@ EM_JS(void, js_vm_print, (const char* ptr, unsigned long len, bool isErr), {});
 
 
 void jsPrint(std::stringstream& out, bool isErr) {
+    if (out.tellp() <= 0) return;
     string s = out.str();  // TODO: copying here is stupid.
     js_vm_print(s.c_str(), s.length(), isErr);
     out.str("");
@@ -22,6 +23,7 @@ class WebVm: public VM {
 public:
     std::stringstream outBuffer;
     std::stringstream errBuffer;
+    double lastPrintTime = 0;
 
     WebVm(): VM() {
         out = &outBuffer;
@@ -29,8 +31,17 @@ public:
         compiler.err = &errBuffer;
     }
 
+    // Each message to the page costs far more than the print, so lines are sent in batches.
+    // Still often enough that a long running script shows its progress.
     void afterPrint() override {
+        if (outBuffer.tellp() >= WEB_PRINT_BATCH_SIZE || emscripten_get_now() - lastPrintTime >= WEB_PRINT_INTERVAL_MS) {
+            flushOutput();
+        }
+    }
+
+    void flushOutput() override {
         jsPrint(outBuffer, false);
+        lastPrintTime = emscripten_get_now();
     }
 
     void runtimeError(const string& message) override {
@@ -49,6 +60,7 @@ extern "C" {
     void lox_run_src(char* src) {
         if (vm.loadFromSource(src)) {
             vm.run();
+            vm.flushOutput();
         } else {
             jsPrint(vm.errBuffer, true);
         }
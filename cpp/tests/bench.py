@@ -1,7 +1,40 @@
+import argparse
+import json
 import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
 
-lox_path = "out/lox"
-tests_dir = ["tests/craftinginterpreters/test/benchmark"]
+# Times each benchmark and compares the results with a saved baseline. Exits with 1 if any got worse by more than the threshold.
+# make bench runs it. Without --lox it builds out/bench/lox and out/bench_counts/lox with the fixed flags from the Makefile first.
+#
+# For each benchmark it does a few warmup runs and then --runs timed ones and records:
+#  - the median, standard deviation and fastest of the wall clock times
+#  - the peak resident memory of the process (from wait4, the per-process getrusage)
+#  - how many full and young collections the gc did (from lox -j)
+#  - how many bytecode instructions ran, from one more run of the VM_PROFILING build. That doesn't change from run to run
+#    so it catches a slower instruction sequence even when the timing noise would hide it.
+#  - how many cpu instructions ran, if perf_event_open is allowed
+#
+#   python3 tests/bench.py                  # run everything, compare with out/bench/baseline.json if there is one
+#   python3 tests/bench.py --save-baseline  # and then make these results the baseline
+#   python3 tests/bench.py fib zoo          # only benchmarks with one of these in their name
+
+tests_dir = ["tests/craftinginterpreters/test/benchmark", "tests/benchmark"]
+
+parser = argparse.ArgumentParser()
+parser.add_argument("filters", nargs="*", help="only run benchmarks whose file name contains one of these")
+parser.add_argument("--lox", help="the build to time instead of building out/bench/lox")
+parser.add_argument("--counts", help="a VM_PROFILING build to count bytecode instructions with")
+parser.add_argument("--runs", type=int, default=10)
+parser.add_argument("--warmup", type=int, default=2)
+parser.add_argument("--output", default="out/bench/results.json")
+parser.add_argument("--baseline", default="out/bench/baseline.json")
+parser.add_argument("--save-baseline", action="store_true", help="copy the results over the baseline once they're written")
+parser.add_argument("--threshold", type=float, default=0.05, help="how much worse than the baseline counts as a regression")
+args = parser.parse_args()
 
 # Cope with being run from tests subdir.
 if not os.path.exists("Makefile"):
@@ -10,20 +43,136 @@ if not os.path.exists("Makefile"):
         print("Makefile not found.")
         exit(1)
 
-os.system("make native")
+lox_path = args.lox
+counts_path = args.counts
+if lox_path is None:
+    if os.system("make bench_build > /dev/null") != 0:
+        print("Build failed.")
+        exit(1)
+    lox_path = "out/bench/lox"
+    counts_path = counts_path or "out/bench_counts/lox"
 
-for tests in tests_dir:
-    for root, dirs, files in os.walk(tests):
-        for filename in files:
-            if not filename.endswith(".lox"):
-                continue
 
-            path = root + "/" + filename
-            print("RUN", path)
+# Returns the seconds it took, the peak rss in KB and what lox -j wrote, or None if the script failed.
+def run_once(lox: str, path: str, stats_path: str):
+    start = time.perf_counter()
+    process = subprocess.Popen([lox, "-s", "-j", stats_path, path], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    _, status, usage = os.wait4(process.pid, 0)
+    elapsed = time.perf_counter() - start
+    process.returncode = os.waitstatus_to_exitcode(status)
+    if process.returncode != 0:
+        return None
+    with open(stats_path) as f:
+        stats = json.load(f)
+    # Linux reports ru_maxrss in KB and macOS in bytes.
+    rss = usage.ru_maxrss // 1024 if sys.platform == "darwin" else usage.ru_maxrss
+    return elapsed, rss, stats
+
+
+def bytecode_instructions(path: str, stats_path: str):
+    if counts_path is None:
+        return None
+    result = run_once(counts_path, path, stats_path)
+    if result is None or "opcodes" not in result[2]:
+        return None
+    return sum(opcode["count"] for opcode in result[2]["opcodes"].values())
+
+
+def measure(path: str, stats_path: str):
+    for _ in range(args.warmup):
+        if run_once(lox_path, path, stats_path) is None:
+            return None
+
+    times, rss, instructions = [], [], []
+    stats = None
+    for _ in range(args.runs):
+        result = run_once(lox_path, path, stats_path)
+        if result is None:
+            return None
+        times.append(result[0])
+        rss.append(result[1])
+        stats = result[2]
+        if stats["hardware"] is not None:
+            instructions.append(stats["hardware"]["instructions"])
+
+    return {
+        "median": statistics.median(times),
+        "stddev": statistics.stdev(times) if len(times) > 1 else 0.0,
+        "min": min(times),
+        "times": times,
+        "peak_rss_kb": max(rss),
+        "gc_full": stats["gc"]["full"],
+        "gc_young": stats["gc"]["young"],
+        "cpu_instructions": statistics.median(instructions) if instructions else None,
+        "bytecode_instructions": bytecode_instructions(path, stats_path),
+    }
+
+
+results = {}
+failed = []
+print("%-26s %9s %8s %9s %9s %6s %6s %14s" % ("benchmark", "median", "stddev", "min", "rss", "full", "young", "bytecode"))
+with tempfile.TemporaryDirectory() as directory:
+    stats_path = os.path.join(directory, "stats.json")
+    for tests in tests_dir:
+        for root, dirs, files in os.walk(tests):
+            for filename in sorted(files):
+                if not filename.endswith(".lox") or (args.filters and not any(f in filename for f in args.filters)):
+                    continue
+
+                result = measure(os.path.join(root, filename), stats_path)
+                if result is None:
+                    print("%-26s failed" % filename)
+                    failed.append(filename)
+                    continue
+                results[filename] = result
+                print("%-26s %8.3fs %7.3fs %8.3fs %7dKB %6d %6d %14s" % (
+                    filename, result["median"], result["stddev"], result["min"], result["peak_rss_kb"],
+                    result["gc_full"], result["gc_young"], result["bytecode_instructions"]))
+
+os.makedirs(os.path.dirname(args.output) or ".", exist_ok=True)
+commit = subprocess.run(["git", "rev-parse", "--short", "HEAD"], capture_output=True, text=True).stdout.strip()
+report = {"commit": commit, "runs": args.runs, "benchmarks": results}
+with open(args.output, "w") as f:
+    json.dump(report, f, indent=2)
+print("Results written to " + args.output)
+
+
+def show(key: str, value) -> str:
+    return "%.3fs" % value if key == "median" else "%d" % value
+
+
+# Time only counts as a regression if it's also outside the noise of both runs.
+# The instruction counts are exact so any change past the threshold is real.
+regressions = []
+if os.path.exists(args.baseline) and os.path.abspath(args.baseline) != os.path.abspath(args.output):
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    print("\nCompared with " + args.baseline + " (" + baseline.get("commit", "?") + ")")
+    for name, result in results.items():
+        old = baseline["benchmarks"].get(name)
+        if old is None:
+            continue
+        changes = []
+        for key in ["median", "peak_rss_kb", "bytecode_instructions", "cpu_instructions"]:
+            if result.get(key) is None or not old.get(key):
+                continue
+            ratio = result[key] / old[key]
+            changes.append("%s %+.1f%%" % (key, (ratio - 1) * 100))
+            noise = 2 * (result["stddev"] + old["stddev"]) if key == "median" else 0
+            if ratio > 1 + args.threshold and result[key] - old[key] > noise:
+                regressions.append("%s: %s went from %s to %s" % (name, key, show(key, old[key]), show(key, result[key])))
+        print("%-26s %s" % (name, ", ".join(changes)))
 
-            process = os.popen(lox_path + " " + path)
-            output = process.read()
-            result_flag = process.close()
-            exitcode = 0 if result_flag is None else result_flag >> 8
+if args.save_baseline:
+    os.makedirs(os.path.dirname(args.baseline) or ".", exist_ok=True)
+    with open(args.baseline, "w") as f:
+        json.dump(report, f, indent=2)
+    print("Saved as the baseline.")
 
-            print(output)
+if regressions:
+    print("\n%d regression(s) past %.0f%%:" % (len(regressions), args.threshold * 100))
+    for regression in regressions:
+        print("  " + regression)
+if failed:
+    print("\nFailed: " + ", ".join(failed))
+exit(1 if regressions or failed else 0)
@@ -0,0 +1,49 @@
+import os
+import subprocess
+import time
+
+# Runs each benchmark with the normal stack code and with VM_REGISTERS and prints the times side by side.
+# Builds a separate copy of the vm for the register one so it doesn't disturb out/lox.
+
+build_dir = "out/registers"
+binaries = {"stack": "out/lox", "registers": build_dir + "/lox"}
+tests_dir = ["tests/craftinginterpreters/test/benchmark", "tests/benchmark"]
+runs = 3
+
+# Cope with being run from tests subdir.
+if not os.path.exists("Makefile"):
+    os.chdir("..")
+    if not os.path.exists("Makefile"):
+        print("Makefile not found.")
+        exit(1)
+
+if os.system("make native > /dev/null") != 0 or \
+        os.system('make native BUILD_DIR=' + build_dir + ' RELEASE_FLAGS="-O3 -DVM_REGISTERS" > /dev/null') != 0:
+    print("Build failed.")
+    exit(1)
+
+
+# Best of a few runs so one slow run doesn't decide it.
+def best_time(lox_path: str, path: str) -> float:
+    best = None
+    for _ in range(runs):
+        start = time.perf_counter()
+        result = subprocess.run([lox_path, "-s", path], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        elapsed = time.perf_counter() - start
+        if result.returncode != 0:
+            return float("nan")
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+print("%-30s %10s %10s %8s" % ("benchmark", "stack", "registers", "speedup"))
+for tests in tests_dir:
+    for root, dirs, files in os.walk(tests):
+        for filename in sorted(files):
+            if not filename.endswith(".lox"):
+                continue
+
+            path = root + "/" + filename
+            stack = best_time(binaries["stack"], path)
+            registers = best_time(binaries["registers"], path)
+            print("%-30s %9.3fs %9.3fs %7.2fx" % (filename, stack, registers, stack / registers))
@@ -0,0 +1,55 @@
+import os
+import sys
+
+# Finds the opcode sequences that run most often across the benchmarks. Used to pick superinstructions.
+# Builds a separate copy of the vm with VM_OPCODE_NGRAMS so it doesn't disturb out/lox.
+# Each benchmark's counts are scaled to a share of its own instructions so a long one can't drown out the rest.
+
+build_dir = "out/ngrams"
+lox_path = build_dir + "/lox"
+tests_dir = ["tests/craftinginterpreters/test/benchmark", "tests/benchmark"]
+show = int(sys.argv[1]) if len(sys.argv) > 1 else 20
+
+# Cope with being run from tests subdir.
+if not os.path.exists("Makefile"):
+    os.chdir("..")
+    if not os.path.exists("Makefile"):
+        print("Makefile not found.")
+        exit(1)
+
+if os.system('make native BUILD_DIR=' + build_dir + ' RELEASE_FLAGS="-O3 -DVM_OPCODE_NGRAMS" > /dev/null') != 0:
+    print("Build failed.")
+    exit(1)
+
+shares = {2: {}, 3: {}}
+benchmarks = 0
+for tests in tests_dir:
+    for root, dirs, files in os.walk(tests):
+        for filename in sorted(files):
+            if not filename.endswith(".lox"):
+                continue
+
+            path = root + "/" + filename
+            print("RUN", path, file=sys.stderr)
+            process = os.popen(lox_path + " -s " + path + " 2>&1 >/dev/null")
+            counts = {2: {}, 3: {}}
+            for line in process.read().splitlines():
+                parts = line.split()
+                if len(parts) < 4 or parts[0] != "ngram":
+                    continue
+                sequence = tuple(parts[2:])
+                counts[len(sequence)][sequence] = int(parts[1])
+            process.close()
+
+            benchmarks += 1
+            for n in counts:
+                total = sum(counts[n].values())
+                for sequence, count in counts[n].items():
+                    shares[n][sequence] = shares[n].get(sequence, 0) + count / total
+
+for n in shares:
+    print("Top", show, "opcode", "pairs" if n == 2 else "triples", "(average % of instructions per benchmark)")
+    ranked = sorted(shares[n].items(), key=lambda item: -item[1])
+    for sequence, share in ranked[:show]:
+        print("%6.2f%%  %s" % (share / benchmarks * 100, " ".join(sequence)))
+    print()
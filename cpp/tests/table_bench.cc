@@ -0,0 +1,93 @@
+#include <chrono>
+#include <vector>
+#include "vm.h"
+
+// Times the operations the vm does on a Table (insert, get, interning lookups and the gc dropping dead keys)
+// at a few load factors. Built twice by make bench_table, once with TABLE_SWISS, so the two layouts can be compared.
+
+using Clock = std::chrono::steady_clock;
+
+static const uint32_t CAPACITY = 65536;
+static const int REPEATS = 20;
+
+static double nanosPerOp(Clock::time_point start, uint64_t ops) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / (double) ops;
+}
+
+static std::vector<ObjString*> makeKeys(Memory& gc, const char* prefix, uint32_t count) {
+    std::vector<ObjString*> keys;
+    char buffer[32];
+    for (uint32_t i=0;i<count;i++){
+        int length = snprintf(buffer, sizeof(buffer), "%s%u", prefix, i);
+        keys.push_back(gc.copyString(buffer, length));
+    }
+    return keys;
+}
+
+static void fill(Table& table, std::vector<ObjString*>& keys, uint32_t count) {
+    for (uint32_t i=0;i<count;i++){
+        table.set(keys[i], NUMBER_VAL((double) i));
+    }
+}
+
+int main() {
+    VM vm;
+    Memory& gc = vm.gc;
+    uint32_t counts[] = {CAPACITY * 3 / 8 + 1, CAPACITY / 2, CAPACITY * 5 / 8, CAPACITY * 3 / 4};
+    std::vector<ObjString*> keys = makeKeys(gc, "key", CAPACITY);
+    std::vector<ObjString*> missing = makeKeys(gc, "missing", CAPACITY);
+
+#ifdef TABLE_SWISS
+    printf("swiss table (ns/op)\n");
+#else
+    printf("linear probing table (ns/op)\n");
+#endif
+    printf("%6s %8s %8s %8s %8s %8s\n", "load", "insert", "hit", "miss", "intern", "sweep");
+
+    double sink = 0;
+    for (uint32_t count : counts) {
+        double insert = 0, hit = 0, miss = 0, intern = 0, sweep = 0;
+        for (int repeat=0;repeat<REPEATS;repeat++){
+            Table table(gc);
+            Clock::time_point start = Clock::now();
+            fill(table, keys, count);
+            insert += nanosPerOp(start, count);
+
+            Value value;
+            start = Clock::now();
+            for (uint32_t i=0;i<count;i++){
+                table.get(keys[i], &value);
+                sink += AS_NUMBER(value);
+            }
+            hit += nanosPerOp(start, count);
+
+            start = Clock::now();
+            for (uint32_t i=0;i<count;i++){
+                sink += table.get(missing[i], &value);
+            }
+            miss += nanosPerOp(start, count);
+
+            start = Clock::now();
+            for (uint32_t i=0;i<count;i++){
+                Entry* entry;
+                ObjString* key = keys[i];
+                sink += table.safeFindEntry((char*) key->array.contents, key->array.length - 1, key->hash, &entry);
+            }
+            intern += nanosPerOp(start, count);
+
+            // Half the keys survive, like a gc clearing the string table.
+            for (uint32_t i=0;i<count;i++){
+                ((Obj*) keys[i])->isMarked = i % 2 == 0;
+            }
+            start = Clock::now();
+            table.removeUnmarkedKeys();
+            sweep += nanosPerOp(start, table.capacity);
+            sink += table.count;
+        }
+        printf("%6.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n", (double) count / CAPACITY,
+               insert / REPEATS, hit / REPEATS, miss / REPEATS, intern / REPEATS, sweep / REPEATS);
+    }
+
+    for (ObjString* key : keys) ((Obj*) key)->isMarked = false;
+    return sink == -1;
+}
@@ -1,7 +1,9 @@
 # This is a simpler version of https://github.com/munificent/craftinginterpreters/blob/master/tool/bin/test.dart
 import os
+import sys
 
-lox_path = "out/lox_debug"
+# Pass the path of a different build to test that instead. Otherwise out/lox_debug is rebuilt first.
+lox_path = sys.argv[1] if len(sys.argv) > 1 else "out/lox_debug"
 tests_dir = ["tests/craftinginterpreters/test", "tests/case"]
 skip_files = [
     # My implementation doesn't have special treatment for global variables.
@@ -90,7 +92,8 @@ if not os.path.exists("Makefile"):
         print("Makefile not found.")
         exit(1)
 
-os.system("make debug")
+if len(sys.argv) <= 1:
+    os.system("make debug")
 
 for tests in tests_dir:
     for root, dirs, files in os.walk(tests):
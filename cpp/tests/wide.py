@@ -0,0 +1,121 @@
+import os
+import subprocess
+import sys
+import tempfile
+
+# Generates scripts too big to write by hand: more than 256 constants, locals and upvalues, and jumps over more
+# than 64KB of code. They need the wide instructions (OP_WIDE, OP_GET_CONSTANT_LONG and the long jumps).
+# Each one is run from source and then again from the .loxc that -c writes.
+
+# Pass the path of a different build to test that instead. Otherwise out/lox is rebuilt first.
+lox_path = sys.argv[1] if len(sys.argv) > 1 else "out/lox"
+
+# Cope with being run from tests subdir.
+if not os.path.exists("Makefile"):
+    os.chdir("..")
+    if not os.path.exists("Makefile"):
+        print("Makefile not found.")
+        exit(1)
+
+if len(sys.argv) <= 1 and os.system("make native > /dev/null") != 0:
+    print("Build failed.")
+    exit(1)
+
+
+def constants() -> (str, list[str]):
+    count = 100000
+    src = "var total = 0;\n"
+    src += "".join("total = total + %d;\n" % i for i in range(count))
+    src += "print total;\n"
+    src += "var s = \"\";\n"
+    src += "".join("s = \"s%d\";\n" % i for i in range(300))
+    src += "print s;\n"
+    return src, [str(count * (count - 1) // 2), "s299"]
+
+
+def locals_() -> (str, list[str]):
+    count = 400
+    decls = "".join("var l%d = %d;\n" % (i, i) for i in range(count))
+    sum_all = " + ".join("l%d" % i for i in range(count))
+    src = "{\n" + decls + "l399 = l399 + 1;\nprint l399;\nprint " + sum_all + ";\n}\n"
+    # Recursion so frames with many locals stack up.
+    src += "fun deep(n) {\n" + decls + "if (n > 0) return deep(n - 1) + l399;\nreturn l300;\n}\n"
+    src += "print deep(10);\n"
+    return src, ["400", str(count * (count - 1) // 2 + 1), str(300 + 10 * 399)]
+
+
+def upvalues() -> (str, list[str]):
+    count = 300
+    decls = "".join("var l%d = %d;\n" % (i, i) for i in range(count))
+    sum_all = " + ".join("l%d" % i for i in range(count))
+    # middle captures every local of outer so it has more than 256 upvalues. inner gets its upvalues from those.
+    src = "fun outer() {\n" + decls
+    src += "fun middle() {\nl299 = l299 + 1;\nfun inner() {\nvar total = " + sum_all + ";\nl298 = l298 + 1;\nreturn total;\n}\n"
+    src += "return inner;\n}\n"
+    src += "return middle;\n}\n"
+    src += "var inner = outer()();\nprint inner();\nprint inner();\n"
+    total = count * (count - 1) // 2
+    return src, [str(total + 1), str(total + 2)]
+
+
+def jumps() -> (str, list[str]):
+    # Each statement is several bytes so this is well over 64KB.
+    body = "x = x + 1;\n" * 20000
+    src = "var x = 0;\n"
+    src += "if (x == 0) {\n" + body + "} else {\nprint \"wrong\";\n}\nprint x;\n"
+    src += "if (x == 0) {\n" + body + "}\nprint x;\n"
+    src += "if (x == 0) {\nprint \"wrong\";\n} else {\n" + body + "}\nprint x;\n"
+    src += "var i = 0;\nwhile (i < 3) {\ni = i + 1;\nif (i == 2) continue;\n" + body + "}\nprint x;\n"
+    src += "var j = 0;\nwhile (j < 5) {\nif (j == 2) break;\nj = j + 1;\n" + body + "}\nprint x;\n"
+    big = " + ".join(["x"] * 20000)
+    src += "print (x > 0) and ((x < 0) or (" + big + " > 0));\n"
+    src += "print (x < 0) and (" + big + " > 0);\n"
+    return src, ["20000", "20000", "40000", "80000", "120000", "true", "false"]
+
+
+def names() -> (str, list[str]):
+    count = 300
+    # Fill the constant table first so every name below has an index past 255.
+    src = "".join("var g%d = %d;\n" % (i, i) for i in range(count))
+    src += "class Base {\n" + "".join("m%d() { return %d; }\n" % (i, i) for i in range(count)) + "}\n"
+    src += "class Derived < Base {\n"
+    # Methods have their own constants so these fill them up before using super.
+    pad = "".join("this.p%d = %d;\n" % (i, i) for i in range(count))
+    src += "m299() {\n" + pad + "return super.m299() + 1;\n}\n"
+    src += "getSuper() {\n" + pad + "var m = super.m298;\nreturn m();\n}\n"
+    src += "}\n"
+    src += "var d = Derived();\n"
+    src += "".join("d.f%d = %d;\n" % (i, i) for i in range(count))
+    src += "print d.f299;\nprint d.m299();\nprint d.getSuper();\nprint d.m0();\nvar m = d.m150;\nprint m();\n"
+    return src, ["299", "300", "298", "0", "150"]
+
+
+def run(name: str, path: str) -> bool:
+    result = subprocess.run([lox_path, "-s", path], capture_output=True, text=True)
+    actual = result.stdout.split("\n")[:-1]
+    if result.returncode != 0 or actual != expected:
+        print("FAIL " + name + " (" + path + ")")
+        print("  expected: " + str(expected))
+        print("  actual:   " + str(actual))
+        print("  " + result.stderr.strip()[:1000])
+        return False
+    return True
+
+
+failed = 0
+with tempfile.TemporaryDirectory() as directory:
+    for generate in [constants, locals_, upvalues, jumps, names]:
+        name = generate.__name__.rstrip("_")
+        source, expected = generate()
+        lox = os.path.join(directory, name + ".lox")
+        with open(lox, "w") as f:
+            f.write(source)
+
+        if not run(name, lox):
+            failed += 1
+            continue
+        if subprocess.run([lox_path, "-s", "-c", lox], capture_output=True).returncode != 0 or not run(name, lox + "c"):
+            failed += 1
+
+print("failed " + str(failed) + " of 5")
+exit(1 if failed else 0)